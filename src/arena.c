@@ -0,0 +1,126 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "datatypes.h"
+
+#include "arena.h"
+
+// objects are carved out of chunks which are never returned to the
+// system before arena_clear(), free objects are kept in a singly linked
+// list threaded through the objects themselves. If max_objs is set all
+// objects are allocated in one chunk at init time.
+
+static int arena_grow(arena_t* a, u_int32_t cnt)
+{
+  u_int8_t* chunk = malloc(a->obj_size_ * (cnt + 1));
+  if(!chunk)
+    return -2;
+
+  *((void**)chunk) = a->chunks_;
+  a->chunks_ = chunk;
+
+  u_int32_t i;
+  for(i = cnt; i > 0; --i) {
+    void* obj = chunk + a->obj_size_ * i;
+    *((void**)obj) = a->free_;
+    a->free_ = obj;
+  }
+  a->allocated_ += cnt;
+  return 0;
+}
+
+int arena_init(arena_t* a, size_t obj_size, u_int32_t max_objs)
+{
+  if(!a || !obj_size)
+    return -1;
+
+  if(obj_size < sizeof(void*))
+    obj_size = sizeof(void*);
+  a->obj_size_ = (obj_size + 15) & ~((size_t)15);
+  a->max_objs_ = max_objs;
+  a->allocated_ = 0;
+  a->used_ = 0;
+  a->free_ = NULL;
+  a->chunks_ = NULL;
+
+  if(max_objs)
+    return arena_grow(a, max_objs);
+
+  return 0;
+}
+
+void arena_clear(arena_t* a)
+{
+  if(!a)
+    return;
+
+  while(a->chunks_) {
+    void* chunk = a->chunks_;
+    a->chunks_ = *((void**)chunk);
+    free(chunk);
+  }
+  a->allocated_ = 0;
+  a->used_ = 0;
+  a->free_ = NULL;
+}
+
+void* arena_alloc(arena_t* a)
+{
+  if(!a)
+    return NULL;
+
+  if(!a->free_) {
+    if(a->max_objs_ || arena_grow(a, ARENA_CHUNK_OBJECTS))
+      return NULL;
+  }
+
+  void* obj = a->free_;
+  a->free_ = *((void**)obj);
+  a->used_++;
+  return obj;
+}
+
+void arena_free(arena_t* a, void* obj)
+{
+  if(!a || !obj)
+    return;
+
+  *((void**)obj) = a->free_;
+  a->free_ = obj;
+  a->used_--;
+}
+
+int arena_full(arena_t* a)
+{
+  if(!a)
+    return 0;
+
+  return a->max_objs_ && a->used_ >= a->max_objs_;
+}
@@ -0,0 +1,51 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_arena_h_INCLUDED
+#define TCPPROXY_arena_h_INCLUDED
+
+#include <sys/types.h>
+
+#define ARENA_CHUNK_OBJECTS 256
+
+struct arena_struct {
+  size_t obj_size_;
+  u_int32_t max_objs_;
+  u_int32_t allocated_;
+  u_int32_t used_;
+  void* free_;
+  void* chunks_;
+};
+typedef struct arena_struct arena_t;
+
+int arena_init(arena_t* a, size_t obj_size, u_int32_t max_objs);
+void arena_clear(arena_t* a);
+void* arena_alloc(arena_t* a);
+void arena_free(arena_t* a, void* obj);
+int arena_full(arena_t* a);
+
+#endif
@@ -0,0 +1,451 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "datatypes.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "balancer.h"
+#include "log.h"
+
+// round robin steps through the schedule computed along with the config,
+// least connections keeps the backends in a binary heap ordered by their
+// number of active connections relative to their weight and Maglev looks
+// up the hash of the client address in its table. Power of two choices
+// compares two random backends by their latency times their connections.
+// All of them take O(1) to pick a backend, updating the heap takes
+// O(log n). Backends which are down or ejected are skipped by all of them.
+
+int balancer_init(balancer_t* b, const config_listener_t* l)
+{
+  u_int32_t i, ends = 0;
+  for(i = 0; i < l->backend_cnt_; ++i)
+    ends += l->backends_[i]->remote_cnt_;
+
+  // everything is kept in a single block, the backends come first as the
+  // endpoints need the same alignment
+  size_t size = l->backend_cnt_ * sizeof(balancer_backend_t) + ends * sizeof(tcp_endpoint_t) +
+                (l->schedule_len_ + l->backend_cnt_) * sizeof(u_int32_t);
+  char* mem = malloc(size);
+  if(!mem)
+    return -2;
+
+  b->strategy_ = l->balance_;
+  b->cnt_ = l->backend_cnt_;
+  b->usable_cnt_ = l->backend_cnt_;
+  b->backends_ = (balancer_backend_t*)mem;
+  tcp_endpoint_t* end = (tcp_endpoint_t*)(mem + b->cnt_ * sizeof(balancer_backend_t));
+  b->schedule_ = (u_int32_t*)(end + ends);
+  b->schedule_len_ = l->schedule_len_;
+  memcpy(b->schedule_, l->schedule_, l->schedule_len_ * sizeof(u_int32_t));
+  b->next_ = 0;
+  b->heap_ = b->schedule_ + b->schedule_len_;
+  b->rand_ = (u_int32_t)time(NULL) ^ (u_int32_t)(uintptr_t)b;
+  if(!b->rand_)
+    b->rand_ = 1;
+  b->eject_failures_ = l->eject_.failures_;
+  b->eject_time_ = (u_int64_t)l->eject_.time_ * 1000;
+  b->eject_max_ = b->cnt_ * l->eject_.max_percent_ / 100;
+  if(!b->eject_max_ && l->eject_.max_percent_)
+    b->eject_max_ = 1;
+  b->ejected_cnt_ = 0;
+  b->eject_next_ = 0;
+
+  for(i = 0; i < b->cnt_; ++i) {
+    balancer_backend_t* be = &(b->backends_[i]);
+    be->weight_ = l->backends_[i]->weight_;
+    be->up_ = 1;
+    be->ejected_ = 0;
+    be->failures_ = 0;
+    be->ejections_ = 0;
+    be->ejected_until_ = 0;
+    be->active_ = 0;
+    be->pos_ = i;
+    be->ewma_ = 0;
+    be->stamp_ = 0;
+    be->source_end_ = l->backends_[i]->source_end_;
+    be->remote_cnt_ = l->backends_[i]->remote_cnt_;
+    be->remote_ends_ = end;
+    memcpy(end, l->backends_[i]->remote_ends_, be->remote_cnt_ * sizeof(tcp_endpoint_t));
+    end += be->remote_cnt_;
+    b->heap_[i] = i;
+  }
+  return 0;
+}
+
+void balancer_clear(balancer_t* b)
+{
+  if(!b)
+    return;
+
+  free(b->backends_);
+  b->backends_ = NULL;
+  b->cnt_ = 0;
+}
+
+static int balancer_ok(const balancer_backend_t* be)
+{
+  return be->up_ && !be->ejected_;
+}
+
+static int balancer_less(balancer_t* b, u_int32_t x, u_int32_t y)
+{
+  balancer_backend_t* bx = &(b->backends_[x]);
+  balancer_backend_t* by = &(b->backends_[y]);
+  if(balancer_ok(bx) != balancer_ok(by))
+    return balancer_ok(bx);
+  return (u_int64_t)bx->active_ * by->weight_ < (u_int64_t)by->active_ * bx->weight_;
+}
+
+static void balancer_swap(balancer_t* b, u_int32_t i, u_int32_t j)
+{
+  u_int32_t tmp = b->heap_[i];
+  b->heap_[i] = b->heap_[j];
+  b->heap_[j] = tmp;
+  b->backends_[b->heap_[i]].pos_ = i;
+  b->backends_[b->heap_[j]].pos_ = j;
+}
+
+static void balancer_sift_up(balancer_t* b, u_int32_t i)
+{
+  while(i > 0 && balancer_less(b, b->heap_[i], b->heap_[(i - 1) / 2])) {
+    balancer_swap(b, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void balancer_sift_down(balancer_t* b, u_int32_t i)
+{
+  for(;;) {
+    u_int32_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+    if(l < b->cnt_ && balancer_less(b, b->heap_[l], b->heap_[min]))
+      min = l;
+    if(r < b->cnt_ && balancer_less(b, b->heap_[r], b->heap_[min]))
+      min = r;
+    if(min == i)
+      return;
+    balancer_swap(b, i, min);
+    i = min;
+  }
+}
+
+int balancer_usable(const balancer_t* b, u_int32_t backend)
+{
+  return balancer_ok(&(b->backends_[backend])) || !b->usable_cnt_;
+}
+
+// must be called whenever up_ or ejected_ of a backend changed
+static void balancer_update(balancer_t* b, u_int32_t backend, int was_ok)
+{
+  balancer_backend_t* be = &(b->backends_[backend]);
+  if(balancer_ok(be) == was_ok)
+    return;
+
+  if(was_ok)
+    b->usable_cnt_--;
+  else
+    b->usable_cnt_++;
+  if(b->strategy_ == BALANCE_LEAST_CONN) {
+    balancer_sift_up(b, be->pos_);
+    balancer_sift_down(b, be->pos_);
+  }
+}
+
+void balancer_set_up(balancer_t* b, u_int32_t backend, int up)
+{
+  balancer_backend_t* be = &(b->backends_[backend]);
+  int was_ok = balancer_ok(be);
+  be->up_ = up;
+  balancer_update(b, backend, was_ok);
+}
+
+static u_int64_t balancer_eject_duration(const balancer_t* b, u_int32_t ejections)
+{
+  return b->eject_time_ << (ejections < BALANCER_EJECT_MAX_SHIFT ? ejections : BALANCER_EJECT_MAX_SHIFT);
+}
+
+static void balancer_eject(balancer_t* b, u_int32_t backend, u_int64_t until)
+{
+  balancer_backend_t* be = &(b->backends_[backend]);
+  int was_ok = balancer_ok(be);
+  be->ejected_ = 1;
+  be->ejected_until_ = until;
+  b->ejected_cnt_++;
+  if(b->ejected_cnt_ == 1 || until < b->eject_next_)
+    b->eject_next_ = until;
+  balancer_update(b, backend, was_ok);
+}
+
+// ejected backends are taken back lazily by the next pick after their
+// time is up, eject_next_ is the earliest of these times
+static void balancer_readmit(balancer_t* b, u_int64_t now)
+{
+  u_int32_t i;
+  b->eject_next_ = 0;
+  for(i = 0; i < b->cnt_; ++i) {
+    balancer_backend_t* be = &(b->backends_[i]);
+    if(!be->ejected_)
+      continue;
+    if(now < be->ejected_until_) {
+      if(!b->eject_next_ || be->ejected_until_ < b->eject_next_)
+        b->eject_next_ = be->ejected_until_;
+      continue;
+    }
+    int was_ok = balancer_ok(be);
+    be->ejected_ = 0;
+    be->failures_ = 0;
+    b->ejected_cnt_--;
+    balancer_update(b, i, was_ok);
+    char* rs = tcp_endpoint_to_string(be->remote_ends_[0]);
+    log_printf(NOTICE, "backend %s is no longer ejected", rs ? rs : "(null)");
+    if(rs) free(rs);
+  }
+}
+
+// passive health check: connections which could not be established or got
+// reset count as failures, successful connects and connections which ended
+// regularly as successes.
+// A backend is never ejected if that would leave no usable backend or
+// exceed the maximum number of ejected backends. Once a backend has done
+// fine for as long as its last ejection lasted it starts over with the
+// shortest ejection time.
+void balancer_report(balancer_t* b, u_int32_t backend, int ok, u_int64_t now)
+{
+  balancer_backend_t* be = &(b->backends_[backend]);
+  if(!b->eject_failures_ || be->ejected_)
+    return;
+
+  if(ok) {
+    be->failures_ = 0;
+    if(be->ejections_ && now >= be->ejected_until_ + balancer_eject_duration(b, be->ejections_ - 1))
+      be->ejections_ = 0;
+    return;
+  }
+
+  if(++be->failures_ < b->eject_failures_)
+    return;
+  if(b->ejected_cnt_ >= b->eject_max_ || !balancer_ok(be) || b->usable_cnt_ < 2)
+    return;
+
+  u_int64_t duration = balancer_eject_duration(b, be->ejections_);
+  be->ejections_++;
+  balancer_eject(b, backend, now + duration);
+  char* rs = tcp_endpoint_to_string(be->remote_ends_[0]);
+  log_printf(WARNING, "ejecting backend %s for %llu s after %u failed connections", rs ? rs : "(null)",
+             (unsigned long long)(duration / 1000), be->failures_);
+  if(rs) free(rs);
+}
+
+// only the address of the client is used, IPv4 clients accepted by an IPv6
+// socket hash the same as if they were connecting over IPv4
+static u_int32_t balancer_hash(const tcp_endpoint_t* client)
+{
+  const unsigned char* a = NULL;
+  size_t len = 0;
+  if(client->addr_.ss_family == AF_INET) {
+    a = (const unsigned char*)&(((const struct sockaddr_in*)&(client->addr_))->sin_addr);
+    len = 4;
+  } else if(client->addr_.ss_family == AF_INET6) {
+    const struct in6_addr* a6 = &(((const struct sockaddr_in6*)&(client->addr_))->sin6_addr);
+    a = (const unsigned char*)a6;
+    len = 16;
+    if(IN6_IS_ADDR_V4MAPPED(a6)) {
+      a += 12;
+      len = 4;
+    }
+  }
+
+  u_int32_t h = 2166136261u;
+  size_t i;
+  for(i = 0; i < len; ++i)
+    h = (h ^ a[i]) * 16777619;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  return h;
+}
+
+// without new samples the estimate decays towards 0, so a backend which
+// was slow gets another chance once it has been left alone for a while.
+// 1/(1+x) stands in for exp(-x).
+u_int64_t balancer_latency(const balancer_t* b, u_int32_t backend, u_int64_t now)
+{
+  const balancer_backend_t* be = &(b->backends_[backend]);
+  u_int64_t elapsed = now > be->stamp_ ? now - be->stamp_ : 0;
+  return be->ewma_ * BALANCER_DECAY / (BALANCER_DECAY + elapsed);
+}
+
+// peak EWMA: samples above the estimate replace it right away, lower ones
+// are only blended in with the time passed since the last sample
+void balancer_sample(balancer_t* b, u_int32_t backend, u_int64_t latency, u_int64_t now)
+{
+  balancer_backend_t* be = &(b->backends_[backend]);
+  u_int64_t elapsed = now > be->stamp_ ? now - be->stamp_ : 0;
+  if(latency > be->ewma_)
+    be->ewma_ = latency;
+  else
+    be->ewma_ = (be->ewma_ * BALANCER_DECAY + latency * elapsed) / (BALANCER_DECAY + elapsed);
+  be->stamp_ = now;
+}
+
+static u_int32_t balancer_random(balancer_t* b)
+{
+  u_int32_t x = b->rand_;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  b->rand_ = x;
+  return x;
+}
+
+// the cost of a backend is its latency times its connections including
+// the new one, relative to its weight
+static u_int32_t balancer_pick_p2c(balancer_t* b, u_int64_t now)
+{
+  if(b->cnt_ < 2)
+    return 0;
+
+  u_int32_t r = balancer_random(b);
+  u_int32_t x = r % b->cnt_;
+  u_int32_t y = (x + 1 + (r >> 16) % (b->cnt_ - 1)) % b->cnt_;
+  if(!balancer_usable(b, x) || !balancer_usable(b, y)) {
+    if(balancer_usable(b, y))
+      return y;
+    while(!balancer_usable(b, x))
+      x = (x + 1) % b->cnt_;
+    return x;
+  }
+  u_int64_t cx = (balancer_latency(b, x, now) + 1) * (b->backends_[x].active_ + 1);
+  u_int64_t cy = (balancer_latency(b, y, now) + 1) * (b->backends_[y].active_ + 1);
+  return cx * b->backends_[y].weight_ <= cy * b->backends_[x].weight_ ? x : y;
+}
+
+u_int32_t balancer_pick(balancer_t* b, const tcp_endpoint_t* client, u_int64_t now)
+{
+  if(b->ejected_cnt_ && now >= b->eject_next_)
+    balancer_readmit(b, now);
+
+  switch(b->strategy_) {
+  case BALANCE_LEAST_CONN: return b->heap_[0];
+  case BALANCE_P2C: return balancer_pick_p2c(b, now);
+  case BALANCE_MAGLEV: {
+    // the slots of backends which are down go to the next usable slot, so
+    // their clients are spread over the others and come back afterwards
+    u_int32_t slot = balancer_hash(client) % b->schedule_len_;
+    while(!balancer_usable(b, b->schedule_[slot]))
+      slot = (slot + 1) % b->schedule_len_;
+    return b->schedule_[slot];
+  }
+  default: {
+    u_int32_t backend;
+    do {
+      backend = b->schedule_[b->next_];
+      b->next_ = (b->next_ + 1) % b->schedule_len_;
+    } while(!balancer_usable(b, backend));
+    return backend;
+  }
+  }
+}
+
+static int balancer_same_backend(const balancer_backend_t* x, const balancer_backend_t* y)
+{
+  if(x->remote_cnt_ != y->remote_cnt_ || x->source_end_.len_ != y->source_end_.len_ ||
+     memcmp(&(x->source_end_.addr_), &(y->source_end_.addr_), x->source_end_.len_))
+    return 0;
+
+  u_int32_t i;
+  for(i = 0; i < x->remote_cnt_; ++i) {
+    if(x->remote_ends_[i].len_ != y->remote_ends_[i].len_ ||
+       memcmp(&(x->remote_ends_[i].addr_), &(y->remote_ends_[i].addr_), x->remote_ends_[i].len_))
+      return 0;
+  }
+  return 1;
+}
+
+static int balancer_same_end(const tcp_endpoint_t* x, const tcp_endpoint_t* y)
+{
+  return x->len_ == y->len_ && !memcmp(&(x->addr_), &(y->addr_), x->len_);
+}
+
+// returns the index of the backend with this preferred address and source
+// address or (u_int32_t)-1 if there is none
+u_int32_t balancer_find(const balancer_t* b, const tcp_endpoint_t* remote_end, const tcp_endpoint_t* source_end)
+{
+  u_int32_t i;
+  for(i = 0; i < b->cnt_; ++i) {
+    const balancer_backend_t* be = &(b->backends_[i]);
+    if(be->remote_cnt_ && balancer_same_end(&(be->remote_ends_[0]), remote_end) && balancer_same_end(&(be->source_end_), source_end))
+      return i;
+  }
+  return (u_int32_t)-1;
+}
+
+// backends which did not change keep their state over a reload, map is
+// filled with the index in b of every backend of prev or (u_int32_t)-1 if
+// it is gone. The active connections are not carried over, the clients
+// move them along when they switch to b. The results of the health checks
+// are kept by the health board instead.
+void balancer_inherit(balancer_t* b, const balancer_t* prev, u_int32_t* map)
+{
+  u_int32_t i, j;
+  for(j = 0; map && j < prev->cnt_; ++j)
+    map[j] = (u_int32_t)-1;
+  for(i = 0; i < b->cnt_; ++i) {
+    for(j = 0; j < prev->cnt_; ++j) {
+      const balancer_backend_t* p = &(prev->backends_[j]);
+      if(balancer_same_backend(&(b->backends_[i]), p)) {
+        b->backends_[i].ewma_ = p->ewma_;
+        b->backends_[i].stamp_ = p->stamp_;
+        b->backends_[i].failures_ = p->failures_;
+        b->backends_[i].ejections_ = p->ejections_;
+        if(map)
+          map[j] = i;
+        if(p->ejected_ && b->eject_failures_ && b->ejected_cnt_ < b->eject_max_)
+          balancer_eject(b, i, p->ejected_until_);
+        break;
+      }
+    }
+  }
+}
+
+void balancer_get(balancer_t* b, u_int32_t backend)
+{
+  b->backends_[backend].active_++;
+  if(b->strategy_ == BALANCE_LEAST_CONN)
+    balancer_sift_down(b, b->backends_[backend].pos_);
+}
+
+void balancer_put(balancer_t* b, u_int32_t backend)
+{
+  b->backends_[backend].active_--;
+  if(b->strategy_ == BALANCE_LEAST_CONN)
+    balancer_sift_up(b, b->backends_[backend].pos_);
+}
@@ -0,0 +1,97 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_balancer_h_INCLUDED
+#define TCPPROXY_balancer_h_INCLUDED
+
+#include "tcp.h"
+#include "config_store.h"
+
+// the latency estimates of the backends decay with this time constant (ms),
+// a failed connect counts as a sample of BALANCER_PENALTY us
+#define BALANCER_DECAY 10000
+#define BALANCER_PENALTY 1000000
+
+// every further ejection of a backend doubles the time it is left out,
+// up to 2^BALANCER_EJECT_MAX_SHIFT times the configured ejection time
+#define BALANCER_EJECT_MAX_SHIFT 3
+
+// ewma_ is the peak EWMA of the latency in us, last updated at stamp_ (ms).
+// up_ is the result of the health checks, ejected_ is set while the backend
+// is left out because of failed connections until ejected_until_ (ms).
+// Backends which are down or ejected are only used if no other one is.
+typedef struct {
+  u_int32_t weight_;
+  int up_;
+  int ejected_;
+  u_int32_t failures_;
+  u_int32_t ejections_;
+  u_int64_t ejected_until_;
+  u_int32_t active_;
+  u_int32_t pos_;
+  u_int64_t ewma_;
+  u_int64_t stamp_;
+  tcp_endpoint_t source_end_;
+  u_int32_t remote_cnt_;
+  tcp_endpoint_t* remote_ends_;
+} balancer_backend_t;
+
+// the backends of a listener together with the state needed to pick one
+// of them for every new connection. Each worker has its own balancers, so
+// active_ only counts the connections of this worker, the same goes for
+// the failures which get a backend ejected.
+typedef struct {
+  config_balance_t strategy_;
+  u_int32_t cnt_;
+  u_int32_t usable_cnt_;
+  balancer_backend_t* backends_;
+  u_int32_t schedule_len_;
+  u_int32_t* schedule_;
+  u_int32_t next_;
+  u_int32_t* heap_;
+  u_int32_t rand_;
+  u_int32_t eject_failures_;
+  u_int64_t eject_time_;
+  u_int32_t eject_max_;
+  u_int32_t ejected_cnt_;
+  u_int64_t eject_next_;
+} balancer_t;
+
+int balancer_init(balancer_t* b, const config_listener_t* l);
+void balancer_clear(balancer_t* b);
+u_int32_t balancer_pick(balancer_t* b, const tcp_endpoint_t* client, u_int64_t now);
+void balancer_get(balancer_t* b, u_int32_t backend);
+void balancer_put(balancer_t* b, u_int32_t backend);
+int balancer_usable(const balancer_t* b, u_int32_t backend);
+void balancer_set_up(balancer_t* b, u_int32_t backend, int up);
+void balancer_report(balancer_t* b, u_int32_t backend, int ok, u_int64_t now);
+u_int32_t balancer_find(const balancer_t* b, const tcp_endpoint_t* remote_end, const tcp_endpoint_t* source_end);
+void balancer_inherit(balancer_t* b, const balancer_t* prev, u_int32_t* map);
+void balancer_sample(balancer_t* b, u_int32_t backend, u_int64_t latency, u_int64_t now);
+u_int64_t balancer_latency(const balancer_t* b, u_int32_t backend, u_int64_t now);
+
+#endif
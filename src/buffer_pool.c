@@ -0,0 +1,276 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "datatypes.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+#include "log.h"
+
+// all transmit buffers are taken from this pool. Buffers are grouped
+// into power of two size classes starting at one page, each class hands
+// out buffers from a free list or carves new ones from slabs of anonymous
+// memory. Slabs are only unmapped when the pool is cleared, instead the
+// pages of free buffers exceeding BUFFER_POOL_KEEP_BYTES per class are
+// handed back to the kernel using madvise(). If the pool belongs to a
+// worker pinned to a CPU the slabs are preferably placed on its NUMA node.
+// Slabs may be registered with the kernel for I/O, the pages of these stay
+// pinned and must not be handed back.
+
+#if defined(__linux__) && defined(SYS_mbind)
+#define BUFFER_POOL_USE_MBIND
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#endif
+
+#ifdef MADV_FREE
+#define BUFFER_POOL_MADV_RELEASE MADV_FREE
+#else
+#define BUFFER_POOL_MADV_RELEASE MADV_DONTNEED
+#endif
+
+int buffer_pool_init(buffer_pool_t* pool, int hugepages, int node)
+{
+  if(!pool)
+    return -1;
+
+  memset(pool, 0, sizeof(buffer_pool_t));
+  pool->hugepages_ = hugepages;
+  pool->node_ = node;
+  int i;
+  for(i = 0; i < BUFFER_POOL_CLASSES; ++i)
+    pool->classes_[i].size_ = (size_t)1 << (BUFFER_POOL_MIN_SHIFT + i);
+
+  return 0;
+}
+
+void buffer_pool_clear(buffer_pool_t* pool)
+{
+  if(!pool)
+    return;
+
+  u_int32_t i;
+  for(i = 0; i < pool->slabs_cnt_; ++i)
+    munmap(pool->slabs_[i].addr_, pool->slabs_[i].len_);
+  if(pool->slabs_)
+    free(pool->slabs_);
+  for(i = 0; i < BUFFER_POOL_CLASSES; ++i) {
+    if(pool->classes_[i].free_)
+      free(pool->classes_[i].free_);
+  }
+  int hugepages = pool->hugepages_;
+  int node = pool->node_;
+  buffer_pool_register_t reg = pool->register_;
+  void* arg = pool->register_arg_;
+  buffer_pool_init(pool, hugepages, node);
+  pool->register_ = reg;
+  pool->register_arg_ = arg;
+}
+
+void buffer_pool_set_register(buffer_pool_t* pool, buffer_pool_register_t reg, void* arg)
+{
+  if(!pool)
+    return;
+
+  pool->register_ = reg;
+  pool->register_arg_ = arg;
+  u_int32_t i;
+  for(i = 0; i < pool->slabs_cnt_; ++i) {
+    buffer_pool_slab_t* s = &(pool->slabs_[i]);
+    s->index_ = (reg && !reg(arg, i, s->addr_, s->len_)) ? (int)i : -1;
+  }
+}
+
+// returns the index the slab holding buf got registered as or -1
+int buffer_pool_index(buffer_pool_t* pool, const u_int8_t* buf)
+{
+  if(!pool || !buf)
+    return -1;
+
+  u_int32_t i;
+  for(i = 0; i < pool->slabs_cnt_; ++i) {
+    const u_int8_t* addr = pool->slabs_[i].addr_;
+    if(buf >= addr && buf < addr + pool->slabs_[i].len_)
+      return pool->slabs_[i].index_;
+  }
+  return -1;
+}
+
+static void* buffer_pool_map(buffer_pool_t* pool, size_t len)
+{
+  void* addr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if(pool->hugepages_ && !(len % BUFFER_POOL_SLAB_SIZE))
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if(addr == MAP_FAILED) {
+    addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(addr == MAP_FAILED) {
+      log_printf(ERROR, "Error on mmap(): %s", strerror(errno));
+      return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if(pool->hugepages_)
+      madvise(addr, len, MADV_HUGEPAGE);
+#endif
+  }
+#ifdef BUFFER_POOL_USE_MBIND
+  if(pool->node_ >= 0 && pool->node_ < (int)(sizeof(unsigned long) * 8)) {
+    unsigned long mask = 1UL << pool->node_;
+    if(syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0))
+      log_printf(DEBUG, "Error on mbind(): %s", strerror(errno));
+  }
+#endif
+  return addr;
+}
+
+static int buffer_pool_class(u_int32_t size)
+{
+  int i;
+  for(i = 0; i < BUFFER_POOL_CLASSES; ++i) {
+    if(size <= ((u_int32_t)1 << (BUFFER_POOL_MIN_SHIFT + i)))
+      return i;
+  }
+  return -1;
+}
+
+static int buffer_pool_add_slab(buffer_pool_t* pool, buffer_pool_class_t* c)
+{
+  if(pool->slabs_cnt_ >= pool->slabs_len_) {
+    u_int32_t len = pool->slabs_len_ ? pool->slabs_len_ * 2 : 16;
+    buffer_pool_slab_t* slabs = realloc(pool->slabs_, len * sizeof(buffer_pool_slab_t));
+    if(!slabs)
+      return -2;
+    pool->slabs_ = slabs;
+    pool->slabs_len_ = len;
+  }
+
+  size_t len = c->size_ > BUFFER_POOL_SLAB_SIZE ? c->size_ : BUFFER_POOL_SLAB_SIZE;
+  u_int8_t* slab = buffer_pool_map(pool, len);
+  if(!slab)
+    return -2;
+
+  buffer_pool_slab_t* s = &(pool->slabs_[pool->slabs_cnt_]);
+  s->addr_ = slab;
+  s->len_ = len;
+  s->index_ = -1;
+  if(pool->register_ && !pool->register_(pool->register_arg_, pool->slabs_cnt_, slab, len))
+    s->index_ = pool->slabs_cnt_;
+  pool->slabs_cnt_++;
+  c->slab_ = slab;
+  c->slab_left_ = len;
+  return 0;
+}
+
+u_int8_t* buffer_pool_get(buffer_pool_t* pool, u_int32_t size)
+{
+  if(!pool || !size)
+    return NULL;
+
+  int idx = buffer_pool_class(size);
+  if(idx < 0) {
+    u_int8_t* buf = buffer_pool_map(pool, size);
+    if(buf) {
+      pool->oversize_used_++;
+      pool->oversize_misses_++;
+    }
+    return buf;
+  }
+
+  buffer_pool_class_t* c = &(pool->classes_[idx]);
+  u_int8_t* buf = NULL;
+  if(c->free_cnt_) {
+    buf = c->free_[--(c->free_cnt_)];
+    c->hits_++;
+  }
+  else {
+    if(c->slab_left_ < c->size_ && buffer_pool_add_slab(pool, c))
+      return NULL;
+    buf = c->slab_;
+    c->slab_ += c->size_;
+    c->slab_left_ -= c->size_;
+    c->misses_++;
+  }
+  c->used_++;
+  return buf;
+}
+
+void buffer_pool_put(buffer_pool_t* pool, u_int8_t* buf, u_int32_t size)
+{
+  if(!pool || !buf)
+    return;
+
+  int idx = buffer_pool_class(size);
+  if(idx < 0) {
+    munmap(buf, size);
+    pool->oversize_used_--;
+    return;
+  }
+
+  buffer_pool_class_t* c = &(pool->classes_[idx]);
+  if(c->free_cnt_ >= c->free_len_) {
+    u_int32_t len = c->free_len_ ? c->free_len_ * 2 : 64;
+    void** f = realloc(c->free_, len * sizeof(void*));
+    if(!f) {
+      log_printf(ERROR, "memory error on buffer pool, leaking buffer of %u bytes", size);
+      c->used_--;
+      return;
+    }
+    c->free_ = f;
+    c->free_len_ = len;
+  }
+
+  if(!pool->register_ && c->free_cnt_ * c->size_ >= BUFFER_POOL_KEEP_BYTES)
+    madvise(buf, c->size_, BUFFER_POOL_MADV_RELEASE);
+
+  c->free_[c->free_cnt_++] = buf;
+  c->used_--;
+}
+
+void buffer_pool_print(buffer_pool_t* pool)
+{
+  if(!pool)
+    return;
+
+  int i;
+  for(i = 0; i < BUFFER_POOL_CLASSES; ++i) {
+    buffer_pool_class_t* c = &(pool->classes_[i]);
+    if(!c->hits_ && !c->misses_)
+      continue;
+    log_printf(NOTICE, "buffer pool class %lu: %u in use, %u free, %llu hits, %llu misses", (unsigned long)c->size_, c->used_, c->free_cnt_, (unsigned long long)c->hits_, (unsigned long long)c->misses_);
+  }
+  if(pool->oversize_misses_)
+    log_printf(NOTICE, "buffer pool oversize: %u in use, %llu misses", pool->oversize_used_, (unsigned long long)pool->oversize_misses_);
+}
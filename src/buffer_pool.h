@@ -0,0 +1,81 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_buffer_pool_h_INCLUDED
+#define TCPPROXY_buffer_pool_h_INCLUDED
+
+#include <sys/types.h>
+
+#define BUFFER_POOL_MIN_SHIFT 12
+#define BUFFER_POOL_CLASSES 10
+#define BUFFER_POOL_SLAB_SIZE (2 * 1024 * 1024)
+#define BUFFER_POOL_KEEP_BYTES (4 * 1024 * 1024)
+
+typedef struct {
+  size_t size_;
+  void** free_;
+  u_int32_t free_cnt_;
+  u_int32_t free_len_;
+  u_int8_t* slab_;
+  size_t slab_left_;
+  u_int32_t used_;
+  u_int64_t hits_;
+  u_int64_t misses_;
+} buffer_pool_class_t;
+
+// index_ is the number the slab got registered as or -1
+typedef struct {
+  void* addr_;
+  size_t len_;
+  int index_;
+} buffer_pool_slab_t;
+
+// called for every new slab, returns 0 if it could be registered as idx
+typedef int (*buffer_pool_register_t)(void* arg, u_int32_t idx, void* addr, size_t len);
+
+typedef struct {
+  buffer_pool_class_t classes_[BUFFER_POOL_CLASSES];
+  buffer_pool_slab_t* slabs_;
+  u_int32_t slabs_cnt_;
+  u_int32_t slabs_len_;
+  int hugepages_;
+  int node_;
+  u_int32_t oversize_used_;
+  u_int64_t oversize_misses_;
+  buffer_pool_register_t register_;
+  void* register_arg_;
+} buffer_pool_t;
+
+int buffer_pool_init(buffer_pool_t* pool, int hugepages, int node);
+void buffer_pool_clear(buffer_pool_t* pool);
+void buffer_pool_set_register(buffer_pool_t* pool, buffer_pool_register_t reg, void* arg);
+int buffer_pool_index(buffer_pool_t* pool, const u_int8_t* buf);
+u_int8_t* buffer_pool_get(buffer_pool_t* pool, u_int32_t size);
+void buffer_pool_put(buffer_pool_t* pool, u_int8_t* buf, u_int32_t size);
+void buffer_pool_print(buffer_pool_t* pool);
+
+#endif
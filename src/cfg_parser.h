@@ -28,9 +28,9 @@
 #ifndef TCPPROXY_cfg_parser_h_INCLUDED
 #define TCPPROXY_cfg_parser_h_INCLUDED
 
-#include "listener.h"
+#include "config_store.h"
 
-int parse_listener(char* p, char* pe, listeners_t* listener);
-int read_configfile(const char* filename, listeners_t* listener);
+int parse_listener(char* p, char* pe, config_t* cfg);
+int read_configfile(const char* filename, config_t* cfg);
 
 #endif
@@ -38,16 +38,25 @@
 #include "log.h"
 #include "options.h"
 #include "tcp.h"
-#include "listener.h"
+#include "config_store.h"
 
 struct listener {
   char* la_;
   resolv_type_t lrt_;
   char* lp_;
   char* ra_;
-  resolv_type_t rrt_;
   char* rp_;
+  int weight_;
+  config_remote_t* remotes_;
+  u_int32_t remote_cnt_;
+  u_int32_t remote_max_;
+  resolv_type_t rrt_;
   char* sa_;
+  int backlog_;
+  config_timeouts_t timeouts_;
+  config_balance_t balance_;
+  config_check_t check_;
+  config_eject_t eject_;
 };
 
 static void init_listener_struct(struct listener* l)
@@ -58,9 +67,24 @@ static void init_listener_struct(struct listener* l)
   l->lrt_ = ANY;
   l->lp_ = NULL;
   l->ra_ = NULL;
-  l->rrt_ = ANY;
   l->rp_ = NULL;
+  l->weight_ = 1;
+  l->remotes_ = NULL;
+  l->remote_cnt_ = 0;
+  l->remote_max_ = 0;
+  l->rrt_ = ANY;
   l->sa_ = NULL;
+  l->backlog_ = 0;
+  l->timeouts_.connect_ = -1;
+  l->timeouts_.idle_ = -1;
+  l->timeouts_.lifetime_ = -1;
+  l->balance_ = BALANCE_ROUND_ROBIN;
+  memset(&(l->check_), 0, sizeof(l->check_));
+  l->check_.rise_ = 2;
+  l->check_.fall_ = 3;
+  l->eject_.failures_ = 5;
+  l->eject_.time_ = 30;
+  l->eject_.max_percent_ = 50;
 }
 
 static void clear_listener_struct(struct listener* l)
@@ -75,12 +99,61 @@ static void clear_listener_struct(struct listener* l)
     free(l->ra_);
   if(l->rp_)
     free(l->rp_);
+  u_int32_t i;
+  for(i = 0; i < l->remote_cnt_; ++i) {
+    free((char*)l->remotes_[i].addr_);
+    free((char*)l->remotes_[i].port_);
+  }
+  if(l->remotes_)
+    free(l->remotes_);
   if(l->sa_)
     free(l->sa_);
 
   init_listener_struct(l);
 }
 
+// strings longer than dest are only counted, the config rejects them
+static void set_string(char* dest, u_int32_t* len, const char* start, const char* end)
+{
+  u_int32_t n = 0;
+  for(; start < end; ++start, ++n) {
+    char ch = *start;
+    if(ch == '\\' && start + 1 < end) {
+      switch(*(++start)) {
+      case 'n': ch = '\n'; break;
+      case 'r': ch = '\r'; break;
+      case 't': ch = '\t'; break;
+      case '0': ch = '\0'; break;
+      default: ch = *start; break;
+      }
+    }
+    if(n < CONFIG_CHECK_MAX)
+      dest[n] = ch;
+  }
+  *len = n;
+}
+
+static int add_remote(struct listener* l)
+{
+  if(l->remote_cnt_ == l->remote_max_) {
+    u_int32_t max = l->remote_max_ ? l->remote_max_ * 2 : 4;
+    config_remote_t* tmp = realloc(l->remotes_, max * sizeof(config_remote_t));
+    if(!tmp)
+      return -2;
+    l->remotes_ = tmp;
+    l->remote_max_ = max;
+  }
+
+  l->remotes_[l->remote_cnt_].addr_ = l->ra_;
+  l->remotes_[l->remote_cnt_].port_ = l->rp_;
+  l->remotes_[l->remote_cnt_].weight_ = l->weight_;
+  l->remote_cnt_++;
+  l->ra_ = NULL;
+  l->rp_ = NULL;
+  l->weight_ = 1;
+  return 0;
+}
+
 static int owrt_string(char** dest, char* start, char* end)
 {
   if(!dest || start >= end)
@@ -108,11 +181,32 @@ static int owrt_string(char** dest, char* start, char* end)
   action set_local_resolv6 { lst.lrt_ = IPV6_ONLY; }
   action set_remote_addr { ret = owrt_string(&(lst.ra_), cpy_start, fpc); cpy_start = NULL; }
   action set_remote_port { ret = owrt_string(&(lst.rp_), cpy_start, fpc); cpy_start = NULL; }
+  action set_weight { lst.weight_ = atoi(cpy_start); cpy_start = NULL; }
+  action add_remote { ret = add_remote(&lst); }
   action set_remote_resolv4 { lst.rrt_ = IPV4_ONLY; }
   action set_remote_resolv6 { lst.rrt_ = IPV6_ONLY; }
   action set_source_addr { ret = owrt_string(&(lst.sa_), cpy_start, fpc); cpy_start = NULL; }
+  action set_backlog { lst.backlog_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_connect_timeout { lst.timeouts_.connect_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_idle_timeout { lst.timeouts_.idle_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_lifetime { lst.timeouts_.lifetime_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_check_interval { lst.check_.interval_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_check_timeout { lst.check_.timeout_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_check_rise { lst.check_.rise_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_check_fall { lst.check_.fall_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_check_send { set_string(lst.check_.send_, &(lst.check_.send_len_), cpy_start + 1, fpc); cpy_start = NULL; }
+  action set_check_expect { set_string(lst.check_.expect_, &(lst.check_.expect_len_), cpy_start + 1, fpc); cpy_start = NULL; }
+  action set_eject_failures { lst.eject_.failures_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_eject_time { lst.eject_.time_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_eject_max_percent { lst.eject_.max_percent_ = atoi(cpy_start); cpy_start = NULL; }
+  action set_balance_rr { lst.balance_ = BALANCE_ROUND_ROBIN; }
+  action set_balance_lc { lst.balance_ = BALANCE_LEAST_CONN; }
+  action set_balance_mg { lst.balance_ = BALANCE_MAGLEV; }
+  action set_balance_p2c { lst.balance_ = BALANCE_P2C; }
   action add_listener {
-    ret = listeners_add(listener, lst.la_, lst.lrt_, lst.lp_, lst.ra_, lst.rrt_, lst.rp_, lst.sa_);
+    ret = config_add_listener(cfg, lst.la_, lst.lrt_, lst.lp_, lst.remotes_, lst.remote_cnt_, lst.rrt_, lst.sa_, lst.backlog_,
+                              &(lst.timeouts_), lst.balance_, &(lst.check_), &(lst.eject_));
+    if(ret && !add_ret) add_ret = ret;
     clear_listener_struct(&lst);
   }
   action logerror {
@@ -138,6 +232,7 @@ static int owrt_string(char** dest, char* start, char* end)
   tok_ipv6 = "ipv6"i;
 
   host_or_addr = ( host_name | ipv4_addr | ipv6_addr );
+  string = '"' >set_cpy_start ( [^"\\\n] | '\\' [^\n] )* '"';
   service = ( number | name );
 
   local_addr = ( '*' | host_or_addr >set_cpy_start %set_local_addr );
@@ -151,20 +246,37 @@ static int owrt_string(char** dest, char* start, char* end)
   source_addr = host_or_addr >set_cpy_start %set_source_addr;
 
   resolv = "resolv" ws* ":" ws+ lresolv ws* ";";
-  remote = "remote" ws* ":" ws+ remote_addr ws+ remote_port ws* ";";
+  weight = "weight" ws+ number >set_cpy_start %set_weight;
+  remote = "remote" ws* ":" ws+ remote_addr ws+ remote_port ( ws+ weight )? ws* ";" @add_remote;
   remote_resolv = "remote-resolv" ws* ":" ws+ rresolv ws* ";";
   source = "source" ws* ":" ws+ source_addr ws* ";";
+  backlog = "backlog" ws* ":" ws+ number >set_cpy_start %set_backlog ws* ";";
+  connect_timeout = "connect-timeout" ws* ":" ws+ number >set_cpy_start %set_connect_timeout ws* ";";
+  idle_timeout = "idle-timeout" ws* ":" ws+ number >set_cpy_start %set_idle_timeout ws* ";";
+  lifetime = "max-lifetime" ws* ":" ws+ number >set_cpy_start %set_lifetime ws* ";";
+  check_interval = "check-interval" ws* ":" ws+ number >set_cpy_start %set_check_interval ws* ";";
+  check_timeout = "check-timeout" ws* ":" ws+ number >set_cpy_start %set_check_timeout ws* ";";
+  check_rise = "check-rise" ws* ":" ws+ number >set_cpy_start %set_check_rise ws* ";";
+  check_fall = "check-fall" ws* ":" ws+ number >set_cpy_start %set_check_fall ws* ";";
+  check_send = "check-send" ws* ":" ws+ string @set_check_send ws* ";";
+  check_expect = "check-expect" ws* ":" ws+ string @set_check_expect ws* ";";
+  check = ( check_interval | check_timeout | check_rise | check_fall | check_send | check_expect );
+  eject_failures = "eject-failures" ws* ":" ws+ number >set_cpy_start %set_eject_failures ws* ";";
+  eject_time = "eject-time" ws* ":" ws+ number >set_cpy_start %set_eject_time ws* ";";
+  eject_max_percent = "eject-max-percent" ws* ":" ws+ number >set_cpy_start %set_eject_max_percent ws* ";";
+  eject = ( eject_failures | eject_time | eject_max_percent );
+  balance = "balance" ws* ":" ws+ ( "round-robin" @set_balance_rr | "least-conn" @set_balance_lc | "maglev" @set_balance_mg | "p2c" @set_balance_p2c ) ws* ";";
 
   listen_head = 'listen' ws+ local_addr ws+ local_port;
-  listen_body = '{' ( ign+ | resolv | remote | remote_resolv | source )* '};' @add_listener;
+  listen_body = '{' ( ign+ | resolv | remote | remote_resolv | source | backlog | connect_timeout | idle_timeout | lifetime | balance | check | eject )* '};' @add_listener;
 
   main := ( listen_head ign* listen_body | ign+ )* $!logerror;
 }%%
 
 
-int parse_listener(char* p, char* pe, listeners_t* listener)
+int parse_listener(char* p, char* pe, config_t* cfg)
 {
-  int cs, ret = 0, cur_line = 1;
+  int cs, ret = 0, add_ret = 0, cur_line = 1;
 
   %% write data;
   %% write init;
@@ -176,19 +288,17 @@ int parse_listener(char* p, char* pe, listeners_t* listener)
   char* eof = pe;
   %% write exec;
 
-  if(cs == cfg_parser_error) {
-    listeners_revert(listener);
+  if(cs == cfg_parser_error)
     ret = 1;
-  }
   else
-    ret = listeners_update(listener);
+    ret = add_ret;
 
   clear_listener_struct(&lst);
 
   return ret;
 }
 
-int read_configfile(const char* filename, listeners_t* listener)
+int read_configfile(const char* filename, config_t* cfg)
 {
   int fd = open(filename, 0);
   if(fd < 0) {
@@ -224,7 +334,7 @@ int read_configfile(const char* filename, listeners_t* listener)
   close(fd);
 
   log_printf(DEBUG, "mapped %ld bytes from file %s at address 0x%08lX", sb.st_size, filename, p);
-  int ret = parse_listener(p, p + sb.st_size, listener);
+  int ret = parse_listener(p, p + sb.st_size, cfg);
 
   if(munmap(p, sb.st_size) == -1) {
     log_printf(ERROR, "munmap() error: %s", strerror(errno));
@@ -25,6 +25,7 @@
  *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "datatypes.h"
 
 #include <errno.h>
@@ -34,15 +35,199 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "clients.h"
 #include "tcp.h"
 #include "log.h"
 
+#if defined(__linux__) && defined(F_SETPIPE_SZ)
+#define CLIENTS_USE_SPLICE
+#endif
+
+static u_int64_t clients_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static u_int64_t clients_now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+clients_target_t* clients_target_new(const config_listener_t* l, health_board_t* board)
+{
+  clients_target_t* target = malloc(sizeof(clients_target_t));
+  if(!target)
+    return NULL;
+
+  if(balancer_init(&(target->balancer_), l)) {
+    free(target);
+    return NULL;
+  }
+  target->refs_ = 1;
+  target->local_end_ = l->local_end_;
+  target->connect_timeout_ = (u_int64_t)l->timeouts_.connect_ * 1000;
+  target->idle_timeout_ = (u_int64_t)l->timeouts_.idle_ * 1000;
+  target->lifetime_ = (u_int64_t)l->timeouts_.lifetime_ * 1000;
+  target->check_ = l->check_;
+  target->checks_ = NULL;
+  target->next_ = NULL;
+  target->map_ = NULL;
+  if(l->check_.interval_ > 0) {
+    target->checks_ = malloc(target->balancer_.cnt_ * sizeof(health_check_t));
+    if(!target->checks_) {
+      balancer_clear(&(target->balancer_));
+      free(target);
+      return NULL;
+    }
+    u_int32_t i;
+    for(i = 0; i < target->balancer_.cnt_; ++i) {
+      const balancer_backend_t* be = &(target->balancer_.backends_[i]);
+      health_slot_t* slot = health_board_slot(board, &(be->remote_ends_[0]), &(be->source_end_));
+      if(!slot) {
+        free(target->checks_);
+        balancer_clear(&(target->balancer_));
+        free(target);
+        return NULL;
+      }
+      health_check_init(&(target->checks_[i]), &(target->check_), slot, &(target->balancer_), i);
+    }
+    clients_target_sync(target);
+  }
+  return target;
+}
+
+void clients_target_release(clients_target_t* target)
+{
+  if(target && !--target->refs_) {
+    clients_target_unwatch(target);
+    free(target->checks_);
+    free(target->map_);
+    balancer_clear(&(target->balancer_));
+    clients_target_release(target->next_);
+    free(target);
+  }
+}
+
+// the successor inherits the state of the backends which did not change,
+// the clients follow once clients_retarget is called
+void clients_target_succeed(clients_target_t* target, clients_target_t* next)
+{
+  if(!target || !next || target->next_)
+    return;
+
+  target->map_ = malloc(target->balancer_.cnt_ * sizeof(u_int32_t));
+  if(!target->map_ && target->balancer_.cnt_) {
+    log_printf(ERROR, "memory error on backend map, clients of the replaced listener keep the old backends");
+    return;
+  }
+  balancer_inherit(&(next->balancer_), &(target->balancer_), target->map_);
+  target->next_ = next;
+  next->refs_++;
+}
+
+void clients_target_watch(clients_target_t* target, health_t* health)
+{
+  u_int32_t i;
+  for(i = 0; target->checks_ && i < target->balancer_.cnt_; ++i)
+    health_start(health, &(target->checks_[i]));
+}
+
+// clients which are still connected to the backends keep the target, but
+// only the targets of the listeners get checked
+void clients_target_unwatch(clients_target_t* target)
+{
+  u_int32_t i;
+  for(i = 0; target->checks_ && i < target->balancer_.cnt_; ++i)
+    health_stop(&(target->checks_[i]));
+}
+
+// takes over the results of the health checks published by the worker
+// which runs them
+void clients_target_sync(clients_target_t* target)
+{
+  u_int32_t i;
+  for(i = 0; target->checks_ && i < target->balancer_.cnt_; ++i) {
+    int up = atomic_load(&target->checks_[i].slot_->up_);
+    if(up != target->balancer_.backends_[i].up_)
+      balancer_set_up(&(target->balancer_), i, up);
+  }
+}
+
+// only power of two choices makes use of the latency of the backends, so
+// nobody else has to pay for the TCP_INFO calls
+static int clients_sampling(const client_t* c)
+{
+  return c->target_ && c->target_->balancer_.strategy_ == BALANCE_P2C;
+}
+
+static void clients_sample(clients_t* list, client_t* c, u_int32_t backend, u_int64_t latency)
+{
+  if(clients_sampling(c) && backend != CLIENTS_NO_BACKEND)
+    balancer_sample(&(c->target_->balancer_), backend, latency, list->now_);
+}
+
+// failed connects and resets by the backend may get it ejected, every
+// successful connect and regularly ended connection breaks the streak
+static void clients_report(clients_t* list, client_t* c, u_int32_t backend, int ok)
+{
+  if(c->target_ && backend != CLIENTS_NO_BACKEND)
+    balancer_report(&(c->target_->balancer_), backend, ok, list->now_);
+}
+
+// smoothed round trip time of the connection in us, 0 if unknown
+static u_int64_t clients_rtt(int fd)
+{
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len))
+    return 0;
+  return info.tcpi_rtt;
+}
+
+// the balancer counts the connections of every backend including the
+// ones which are still connecting
+static void clients_assign(client_t* c, u_int32_t backend)
+{
+  if(!c->target_ || c->backend_ == backend)
+    return;
+
+  if(c->backend_ != CLIENTS_NO_BACKEND)
+    balancer_put(&(c->target_->balancer_), c->backend_);
+  c->backend_ = backend;
+  if(backend != CLIENTS_NO_BACKEND)
+    balancer_get(&(c->target_->balancer_), backend);
+}
+
+// moves a client over to the successors of its target and takes its
+// connection along. Clients of backends which are gone stay where they are.
+static void clients_follow(client_t* c)
+{
+  while(c->target_ && c->target_->next_) {
+    clients_target_t* t = c->target_;
+    u_int32_t backend = CLIENTS_NO_BACKEND;
+    if(c->backend_ != CLIENTS_NO_BACKEND) {
+      if(!t->map_ || t->map_[c->backend_] == CLIENTS_NO_BACKEND)
+        return;
+      backend = t->map_[c->backend_];
+    }
+    clients_assign(c, CLIENTS_NO_BACKEND);
+    c->target_ = t->next_;
+    c->target_->refs_++;
+    clients_assign(c, backend);
+    clients_target_release(t);
+  }
+}
+
 void clients_delete_element(void* e)
 {
   if(!e)
@@ -50,48 +235,302 @@ void clients_delete_element(void* e)
 
   client_t* element = (client_t*)e;
   close(element->fd_[0]);
-  close(element->fd_[1]);
-  if(element->write_buf_[0].buf_)
-    free(element->write_buf_[0].buf_);
-  if(element->write_buf_[1].buf_)
-    free(element->write_buf_[1].buf_);
+  if(element->fd_[1] >= 0)
+    close(element->fd_[1]);
+  int i;
+  for(i = 0; i < CLIENTS_CONNECT_ATTEMPTS; ++i) {
+    if(element->attempts_[i] >= 0)
+      close(element->attempts_[i]);
+  }
+  clients_target_release(element->target_);
+  for(i = 0; i < 2; ++i) {
+    if(element->write_buf_[i].buf_)
+      buffer_pool_put(element->pool_, element->write_buf_[i].buf_, element->write_buf_[i].length_);
+    if(element->pipe_[i][0] >= 0)
+      close(element->pipe_[i][0]);
+    if(element->pipe_[i][1] >= 0)
+      close(element->pipe_[i][1]);
+  }
 
-  free(e);
+  arena_free(element->arena_, e);
 }
 
-int clients_init(clients_t* list, int32_t buffer_size)
+int clients_init(clients_t* list, int32_t buffer_size, int splice, int lazy_buffers, u_int32_t cut_through, u_int32_t max_connections, buffer_pool_t* pool, poller_t* poller)
 {
   list->buffer_size_ = buffer_size;
-  return slist_init(&(list->list_), &clients_delete_element);
+#ifdef CLIENTS_USE_SPLICE
+  list->splice_ = splice;
+#else
+  if(splice)
+    log_printf(WARNING, "splice() is not supported on this platform, using buffered relay");
+  list->splice_ = 0;
+#endif
+  // with io_uring a receive is always waiting for data, so the buffers are
+  // never idle and cut-through has nothing to skip
+  list->completions_ = poller_completions(poller) && !list->splice_;
+  list->lazy_buffers_ = list->completions_ ? 0 : lazy_buffers;
+  list->cut_through_ = cut_through;
+  list->moving_to_ = NULL;
+  list->moved_ = 0;
+  list->bytes_ = 0;
+  list->pool_ = pool;
+  list->poller_ = poller;
+  list->now_ = clients_now();
+  timer_wheel_init(&(list->timers_), list->now_);
+  fd_table_init(&(list->fds_));
+  int ret = slist_init(&(list->list_), &clients_delete_element);
+  if(ret)
+    return ret;
+
+  list->list_.arena_ = &(list->element_arena_);
+  int cret = arena_init(&(list->client_arena_), sizeof(client_t), max_connections);
+  int eret = arena_init(&(list->element_arena_), sizeof(slist_element_t), max_connections);
+  if(cret || eret) {
+    log_printf(ERROR, "unable to allocate memory for %u connections", max_connections);
+    return -2;
+  }
+
+  return 0;
 }
 
 void clients_clear(clients_t* list)
 {
+  slist_element_t* tmp = list->list_.first_;
+  while(tmp) {
+    client_t* c = (client_t*)tmp->data_;
+    if(c) {
+      int i;
+      poller_remove(list->poller_, c->fd_[0]);
+      poller_remove(list->poller_, c->fd_[1]);
+      for(i = 0; i < CLIENTS_CONNECT_ATTEMPTS; ++i)
+        poller_remove(list->poller_, c->attempts_[i]);
+    }
+    tmp = tmp->next_;
+  }
   slist_clear(&(list->list_));
+  timer_wheel_init(&(list->timers_), list->now_);
+  fd_table_clear(&(list->fds_));
+  arena_clear(&(list->client_arena_));
+  arena_clear(&(list->element_arena_));
 }
 
-static int handle_connect(client_t* c, int32_t buffer_size_)
+// every client has a single timer which is armed for the earliest of its
+// deadlines. Activity only updates active_, the idle timeout is checked
+// once the timer fires and the timer is armed again if the client has been
+// active in the meantime.
+static void clients_arm(clients_t* list, client_t* c)
 {
-  if(!c || c->state_ != CONNECTING)
-    return -1;
+  u_int64_t expires = (u_int64_t)-1;
+  if(c->state_ == CONNECTING) {
+    if(c->deadline_)
+      expires = c->deadline_;
+    if(c->target_->connect_timeout_ && c->backend_started_ + c->target_->connect_timeout_ < expires)
+      expires = c->backend_started_ + c->target_->connect_timeout_;
+  }
+  else {
+    if(c->idle_timeout_)
+      expires = c->active_ + c->idle_timeout_;
+    if(c->lifetime_ && c->started_ + c->lifetime_ < expires)
+      expires = c->started_ + c->lifetime_;
+  }
 
-  int error = 0;
-  socklen_t len = sizeof(error);
-  if(getsockopt(c->fd_[1], SOL_SOCKET, SO_ERROR, &error, &len)==-1) {
-    log_printf(ERROR, "Error on getsockopt(): %s", strerror(errno));
+  if(expires == (u_int64_t)-1)
+    timer_wheel_cancel(&(list->timers_), &(c->timer_));
+  else
+    timer_wheel_arm(&(list->timers_), &(c->timer_), expires);
+}
+
+static void clients_schedule(clients_t* list, client_t* c, u_int64_t deadline)
+{
+  c->deadline_ = deadline;
+  clients_arm(list, c);
+}
+
+static void clients_close_attempt(clients_t* list, client_t* c, int i)
+{
+  int fd = c->attempts_[i];
+  if(fd < 0)
+    return;
+
+  poller_remove(list->poller_, fd);
+  if(fd_table_get(&(list->fds_), fd) == c)
+    fd_table_remove(&(list->fds_), fd);
+  close(fd);
+  c->attempts_[i] = -1;
+}
+
+static void clients_drop(clients_t* list, client_t* c)
+{
+  int i;
+  for(i = 0; i < 2; ++i) {
+    if(c->fd_[i] < 0)
+      continue;
+    poller_remove(list->poller_, c->fd_[i]);
+    if(fd_table_get(&(list->fds_), c->fd_[i]) == c)
+      fd_table_remove(&(list->fds_), c->fd_[i]);
+  }
+  for(i = 0; i < CLIENTS_CONNECT_ATTEMPTS; ++i)
+    clients_close_attempt(list, c, i);
+  timer_wheel_cancel(&(list->timers_), &(c->timer_));
+  clients_assign(c, CLIENTS_NO_BACKEND);
+  slist_remove_element(&(list->list_), c->element_);
+}
+
+// the write buffers are used as ring buffers: write_buf_start_ is the
+// position of the first pending byte and write_buf_offset_ the number of
+// pending bytes, both helpers return the (up to two) regions as iovecs
+static int clients_buf_data(client_t* c, int i, struct iovec* iov)
+{
+  buffer_t* b = &(c->write_buf_[i]);
+  u_int32_t start = c->write_buf_start_[i];
+  u_int32_t len = c->write_buf_offset_[i];
+
+  iov[0].iov_base = &(b->buf_[start]);
+  if(start + len <= b->length_) {
+    iov[0].iov_len = len;
+    return 1;
+  }
+  iov[0].iov_len = b->length_ - start;
+  iov[1].iov_base = b->buf_;
+  iov[1].iov_len = start + len - b->length_;
+  return 2;
+}
+
+static int clients_buf_space(client_t* c, int i, struct iovec* iov)
+{
+  buffer_t* b = &(c->write_buf_[i]);
+  u_int32_t start = c->write_buf_start_[i];
+  u_int32_t end = (start + c->write_buf_offset_[i]) % b->length_;
+
+  iov[0].iov_base = &(b->buf_[end]);
+  if(end < start) {
+    iov[0].iov_len = start - end;
+    return 1;
+  }
+  iov[0].iov_len = b->length_ - end;
+  if(!start)
+    return 1;
+  iov[1].iov_base = b->buf_;
+  iov[1].iov_len = start;
+  return 2;
+}
+
+// with io_uring every direction has at most one receive into the free space
+// and one send of the pending data of its buffer in flight, the next ones
+// are submitted once these completed
+static int clients_submit(clients_t* list, client_t* c)
+{
+  int i;
+  for(i = 0; i < 2 && !c->moving_; ++i) {
+    struct iovec iov[2];
+    if(!c->send_pending_[i] && c->write_buf_offset_[i]) {
+      clients_buf_data(c, i, iov);
+      if(poller_send(list->poller_, c->fd_[i], iov[0].iov_base, iov[0].iov_len, c->buf_index_[i]))
+        return -1;
+      c->send_pending_[i] = 1;
+    }
+    if(!c->recv_pending_[i] && c->write_buf_offset_[i] < c->write_buf_[i].length_) {
+      clients_buf_space(c, i, iov);
+      if(poller_recv(list->poller_, c->fd_[i ^ 1], iov[0].iov_base, iov[0].iov_len, c->buf_index_[i]))
+        return -1;
+      c->recv_pending_[i] = 1;
+    }
+  }
+  return 0;
+}
+
+static int clients_update_events(clients_t* list, client_t* c)
+{
+  if(c->state_ != CONNECTED)
+    return 0;
+  if(list->completions_)
+    return clients_submit(list, c);
+
+  int i, ret = 0;
+  for(i = 0; i < 2; ++i) {
+    int events = 0;
+    if(c->write_buf_offset_[i ^ 1] < c->write_buf_[i ^ 1].length_ && !c->pipe_full_[i ^ 1])
+      events |= POLLER_READ;
+    if(c->write_buf_offset_[i])
+      events |= POLLER_WRITE;
+    if(poller_mod(list->poller_, c->fd_[i], events))
+      ret = -1;
+  }
+  return ret;
+}
+
+static int clients_init_pipe(client_t* c, int i, int32_t buffer_size)
+{
+#ifdef CLIENTS_USE_SPLICE
+  if(pipe2(c->pipe_[i], O_NONBLOCK)) {
+    log_printf(INFO, "Error on pipe(): %s, using buffered relay for client %d", strerror(errno), c->fd_[0]);
+    c->pipe_[i][0] = c->pipe_[i][1] = -1;
     return -1;
   }
-  if(error) {
-    log_printf(ERROR, "Error on connect(): %s, not adding client %d", strerror(error), c->fd_[0]);
+
+  fcntl(c->pipe_[i][1], F_SETPIPE_SZ, buffer_size);
+  int size = fcntl(c->pipe_[i][1], F_GETPIPE_SZ);
+  if(size <= 0) {
+    close(c->pipe_[i][0]);
+    close(c->pipe_[i][1]);
+    c->pipe_[i][0] = c->pipe_[i][1] = -1;
     return -1;
   }
+  c->write_buf_[i].length_ = size;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+// with lazy buffers a direction only holds a buffer from the pool while
+// there is data in flight, length_ is set nevertheless as it is needed to
+// decide whether the direction accepts more data
+static int clients_init_buffer(clients_t* list, client_t* c, int i)
+{
+  c->write_buf_[i].length_ = list->buffer_size_;
+  if(list->lazy_buffers_)
+    return 0;
+
+  c->write_buf_[i].buf_ = buffer_pool_get(c->pool_, list->buffer_size_);
+  if(!c->write_buf_[i].buf_)
+    return -2;
+  if(list->completions_)
+    c->buf_index_[i] = buffer_pool_index(c->pool_, c->write_buf_[i].buf_);
+  return 0;
+}
+
+static int clients_borrow_buffer(client_t* c, int i)
+{
+  if(c->write_buf_[i].buf_)
+    return 0;
 
+  c->write_buf_[i].buf_ = buffer_pool_get(c->pool_, c->write_buf_[i].length_);
+  if(!c->write_buf_[i].buf_)
+    return -2;
+  c->write_buf_start_[i] = 0;
+  return 0;
+}
+
+static void clients_return_buffer(clients_t* list, client_t* c, int i)
+{
+  if(!list->lazy_buffers_ || !c->write_buf_[i].buf_ || c->write_buf_offset_[i])
+    return;
+
+  buffer_pool_put(c->pool_, c->write_buf_[i].buf_, c->write_buf_[i].length_);
+  c->write_buf_[i].buf_ = NULL;
+}
+
+static int handle_connect(clients_t* list, client_t* c)
+{
   int i;
   for(i = 0; i < 2; ++i) {
-    c->write_buf_[i].buf_ = malloc(buffer_size_);
-    if(!c->write_buf_[i].buf_) return -2;
-    c->write_buf_[i].length_ = buffer_size_;
+    if(!list->splice_ || clients_init_pipe(c, i, list->buffer_size_)) {
+      if(clients_init_buffer(list, c, i))
+        return -2;
+    }
     c->write_buf_offset_[i] = 0;
+    c->write_buf_start_[i] = 0;
     c->transferred_[i] = 0;
   }
 
@@ -100,90 +539,283 @@ static int handle_connect(client_t* c, int32_t buffer_size_)
   return 0;
 }
 
-int clients_add(clients_t* list, int fd, const tcp_endpoint_t remote_end, const tcp_endpoint_t source_end)
+// the first attempt which got connected is used for the client, all other
+// attempts still in flight are given up
+static int clients_connected(clients_t* list, client_t* c, int attempt)
 {
-  if(!list)
+  c->fd_[1] = c->attempts_[attempt];
+  c->attempts_[attempt] = -1;
+  clients_assign(c, c->attempt_backends_[attempt]);
+  clients_report(list, c, c->backend_, 1);
+  int i;
+  if(clients_sampling(c)) {
+    // the handshake RTT misses retransmitted SYNs. Other backends which
+    // are still connecting are at least as slow as they took so far.
+    u_int64_t now = clients_now_us();
+    u_int64_t latency = now - c->attempt_started_[attempt];
+    u_int64_t rtt = clients_rtt(c->fd_[1]);
+    clients_sample(list, c, c->backend_, rtt > latency ? rtt : latency);
+    c->rtt_sampled_ = list->now_;
+    for(i = 0; i < CLIENTS_CONNECT_ATTEMPTS; ++i) {
+      if(c->attempts_[i] >= 0 && c->attempt_backends_[i] != c->backend_)
+        clients_sample(list, c, c->attempt_backends_[i], now - c->attempt_started_[i]);
+    }
+  }
+  for(i = 0; i < CLIENTS_CONNECT_ATTEMPTS; ++i)
+    clients_close_attempt(list, c, i);
+  clients_follow(c);
+  c->deadline_ = 0;
+  c->idle_timeout_ = c->target_->idle_timeout_;
+  c->lifetime_ = c->target_->lifetime_;
+
+  int ret = handle_connect(list, c);
+  // the connect was waited for by polling, the poll is not needed any more
+  if(!ret && list->completions_)
+    ret = poller_mod(list->poller_, c->fd_[1], 0);
+  if(!ret)
+    ret = clients_update_events(list, c);
+  if(ret) {
+    clients_drop(list, c);
+    return ret;
+  }
+  c->active_ = list->now_;
+  clients_arm(list, c);
+  return 0;
+}
+
+// returns 0 if the connect is in progress, 1 if it succeeded right away
+// and -1 if this address can't be used
+static int clients_attempt(clients_t* list, client_t* c, int attempt, const balancer_backend_t* backend, const tcp_endpoint_t* remote_end)
+{
+  int fd = socket(remote_end->addr_.ss_family, SOCK_STREAM, 0);
+  if(fd < 0) {
+    log_printf(INFO, "Error on socket(): %s, client %d", strerror(errno), c->fd_[0]);
+    return -1;
+  }
+
+  int on = 1;
+  if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on))) {
+    log_printf(ERROR, "Error on setsockopt(): %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  if(fcntl(fd, F_SETFL, O_NONBLOCK)) {
+    log_printf(ERROR, "Error on fcntl(): %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  const tcp_endpoint_t* source_end = &(backend->source_end_);
+  if(source_end->addr_.ss_family != AF_UNSPEC) {
+    if(bind(fd, (struct sockaddr *)&(source_end->addr_), source_end->len_)==-1) {
+      log_printf(INFO, "Error on bind(): %s, client %d", strerror(errno), c->fd_[0]);
+      close(fd);
+      return -1;
+    }
+  }
+
+  if(fd_table_set(&(list->fds_), fd, c)) {
+    close(fd);
+    return -2;
+  }
+  if(poller_add(list->poller_, fd, POLLER_WRITE, POLLER_CLIENT, c)) {
+    log_printf(ERROR, "unable to watch connection attempt of client %d", c->fd_[0]);
+    fd_table_remove(&(list->fds_), fd);
+    close(fd);
+    return -1;
+  }
+  c->attempts_[attempt] = fd;
+  if(clients_sampling(c))
+    c->attempt_started_[attempt] = clients_now_us();
+
+  if(connect(fd, (struct sockaddr *)&(remote_end->addr_), remote_end->len_)==-1) {
+    if(errno == EINPROGRESS)
+      return 0;
+
+    char* rs = tcp_endpoint_to_string(*remote_end);
+    log_printf(INFO, "Error on connect(%s): %s, client %d", rs ? rs:"(null)", strerror(errno), c->fd_[0]);
+    if(rs) free(rs);
+    clients_sample(list, c, c->attempt_backends_[attempt], BALANCER_PENALTY);
+    clients_report(list, c, c->attempt_backends_[attempt], 0);
+    clients_close_attempt(list, c, attempt);
+    return -1;
+  }
+
+  log_printf(DEBUG, "connect() for client %d returned immediatly", c->fd_[0]);
+  return 1;
+}
+
+// starts the attempt to connect to the next remote address, addresses
+// which fail right away are skipped. The attempts race against each other
+// only within a backend, the next backend which is up is used once all
+// attempts to the current one have failed or timed out. After all
+// backends have been tried the client is removed.
+static int clients_connect_next(clients_t* list, client_t* c)
+{
+  balancer_t* b = &(c->target_->balancer_);
+  int i, pending = 0, free_attempt = -1;
+  for(i = 0; i < CLIENTS_CONNECT_ATTEMPTS; ++i) {
+    if(c->attempts_[i] >= 0)
+      pending++;
+    else if(free_attempt < 0)
+      free_attempt = i;
+  }
+
+  while(free_attempt >= 0) {
+    balancer_backend_t* be = &(b->backends_[c->backend_]);
+    if(c->next_remote_ >= be->remote_cnt_) {
+      if(pending || c->tries_ >= b->cnt_)
+        break;
+      // backends which are down or ejected are skipped unless all of them are
+      u_int32_t next = c->backend_;
+      do {
+        next = (next + 1) % b->cnt_;
+        c->tries_++;
+      } while(c->tries_ < b->cnt_ && !balancer_usable(b, next));
+      if(!balancer_usable(b, next))
+        break;
+      clients_assign(c, next);
+      c->next_remote_ = 0;
+      c->backend_started_ = list->now_;
+      log_printf(DEBUG, "trying backend %u for client %d", c->backend_, c->fd_[0]);
+      continue;
+    }
+    c->attempt_backends_[free_attempt] = c->backend_;
+    int ret = clients_attempt(list, c, free_attempt, be, &(be->remote_ends_[c->next_remote_++]));
+    if(ret == 1)
+      return clients_connected(list, c, free_attempt);
+    if(ret == -2) {
+      clients_drop(list, c);
+      return -2;
+    }
+    if(!ret) {
+      clients_schedule(list, c, list->now_ + CLIENTS_CONNECT_DELAY);
+      return 0;
+    }
+  }
+
+  clients_schedule(list, c, 0);
+  if(!pending) {
+    log_printf(INFO, "unable to connect to any backend, removing client %d", c->fd_[0]);
+    clients_drop(list, c);
     return -1;
+  }
+  return 0;
+}
 
-  client_t* element = malloc(sizeof(client_t));
+static int clients_attempt_done(clients_t* list, client_t* c, int attempt)
+{
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if(getsockopt(c->attempts_[attempt], SOL_SOCKET, SO_ERROR, &error, &len)==-1)
+    error = errno;
+  if(!error)
+    return clients_connected(list, c, attempt);
+
+  log_printf(INFO, "Error on connect(): %s, client %d", strerror(error), c->fd_[0]);
+  clients_sample(list, c, c->attempt_backends_[attempt], BALANCER_PENALTY);
+  clients_report(list, c, c->attempt_backends_[attempt], 0);
+  clients_close_attempt(list, c, attempt);
+  return clients_connect_next(list, c);
+}
+
+// the balancer of the target picks the backend, its remote addresses are
+// tried one after another. A new attempt is started whenever the previous
+// one failed or did not succeed within CLIENTS_CONNECT_DELAY ms (Happy
+// Eyeballs, RFC 8305).
+int clients_add(clients_t* list, int fd, clients_target_t* target, const tcp_endpoint_t* client)
+{
+  if(!list || !target)
+    return -1;
+
+  if(arena_full(&(list->client_arena_))) {
+    log_printf(INFO, "maximum number of connections (%u) reached, rejecting client %d", list->client_arena_.max_objs_, fd);
+    close(fd);
+    return -1;
+  }
+
+  client_t* element = arena_alloc(&(list->client_arena_));
   if(!element) {
     close(fd);
     return -2;
   }
+  element->arena_ = &(list->client_arena_);
+  element->pool_ = list->pool_;
 
   int i;
   for(i = 0; i < 2; ++i) {
     element->write_buf_[i].buf_ = NULL;
     element->write_buf_[i].length_ = 0;
     element->write_buf_offset_[i] = 0;
+    element->write_buf_start_[i] = 0;
+    element->buf_index_[i] = -1;
+    element->recv_pending_[i] = element->send_pending_[i] = 0;
+    element->pipe_[i][0] = element->pipe_[i][1] = -1;
+    element->pipe_full_[i] = 0;
   }
+  element->moving_ = 0;
+  for(i = 0; i < CLIENTS_CONNECT_ATTEMPTS; ++i)
+    element->attempts_[i] = -1;
   element->state_ = CONNECTING;
+  element->sampled_ = 0;
+  element->rtt_sampled_ = 0;
+  element->target_ = NULL;
+  element->backend_ = CLIENTS_NO_BACKEND;
+  element->tries_ = 0;
+  element->next_remote_ = 0;
+  element->deadline_ = 0;
+  element->started_ = element->active_ = element->backend_started_ = list->now_;
+  element->idle_timeout_ = element->lifetime_ = 0;
+  timer_wheel_entry_init(&(element->timer_), element);
   element->fd_[0] = fd;
-  element->fd_[1] = socket(remote_end.addr_.ss_family, SOCK_STREAM, 0);
-  if(element->fd_[1] < 0) {
-    log_printf(INFO, "Error on socket(): %s, not adding client %d", strerror(errno), element->fd_[0]);
-    close(element->fd_[0]);
-    free(element);
-    return -1;
-  }
+  element->fd_[1] = -1;
 
   int on = 1;
-  if(setsockopt(element->fd_[0], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) ||
-     setsockopt(element->fd_[1], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on))) {
+  if(setsockopt(element->fd_[0], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on))) {
     log_printf(ERROR, "Error on setsockopt(): %s", strerror(errno));
     close(element->fd_[0]);
-    close(element->fd_[1]);
-    free(element);
+    arena_free(&(list->client_arena_), element);
     return -1;
   }
 
-  if(fcntl(element->fd_[0], F_SETFL, O_NONBLOCK) ||
-     fcntl(element->fd_[1], F_SETFL, O_NONBLOCK)) {
+  if(fcntl(element->fd_[0], F_SETFL, O_NONBLOCK)) {
     log_printf(ERROR, "Error on fcntl(): %s", strerror(errno));
     close(element->fd_[0]);
-    close(element->fd_[1]);
-    free(element);
+    arena_free(&(list->client_arena_), element);
     return -1;
   }
 
-  if(source_end.addr_.ss_family != AF_UNSPEC) {
-    if(bind(element->fd_[1], (struct sockaddr *)&(source_end.addr_), source_end.len_)==-1) {
-      log_printf(INFO, "Error on bind(): %s, not adding client %d", strerror(errno), element->fd_[0]);
-      close(element->fd_[0]);
-      close(element->fd_[1]);
-      free(element);
-      return -1;
-    }
-  }
-
-  if(slist_add(&(list->list_), element) == NULL) {
+  element->element_ = slist_add(&(list->list_), element);
+  if(element->element_ == NULL) {
     close(element->fd_[0]);
-    close(element->fd_[1]);
-    free(element);
+    arena_free(&(list->client_arena_), element);
     return -2;
   }
+  element->target_ = target;
+  target->refs_++;
+  clients_assign(element, balancer_pick(&(target->balancer_), client, list->now_));
+  element->tries_ = 1;
 
-  if(connect(element->fd_[1], (struct sockaddr *)&(remote_end.addr_), remote_end.len_)==-1) {
-    if(errno == EINPROGRESS)
-      return 0;
+  if(fd_table_set(&(list->fds_), element->fd_[0], element)) {
+    clients_drop(list, element);
+    return -2;
+  }
 
-    log_printf(INFO, "Error on connect(): %s, not adding client %d", strerror(errno), element->fd_[0]);
-    slist_remove(&(list->list_), element);
+  if(poller_add(list->poller_, element->fd_[0], 0, POLLER_CLIENT, element)) {
+    log_printf(ERROR, "unable to watch client %d, removing it", element->fd_[0]);
+    clients_drop(list, element);
     return -1;
   }
 
-  log_printf(DEBUG, "connect() for client %d returned immediatly", element->fd_[0]);
-
-  int ret = handle_connect(element, list->buffer_size_);
-  if(ret)
-    slist_remove(&(list->list_), element);
-
-  return ret;
+  return clients_connect_next(list, element);
 }
 
 void clients_remove(clients_t* list, int fd)
 {
-  slist_remove(&(list->list_), clients_find(list, fd));
+  client_t* c = clients_find(list, fd);
+  if(c)
+    clients_drop(list, c);
 }
 
 client_t* clients_find(clients_t* list, int fd)
@@ -191,15 +823,7 @@ client_t* clients_find(clients_t* list, int fd)
   if(!list)
     return NULL;
 
-  slist_element_t* tmp = list->list_.first_;
-  while(tmp) {
-    client_t* c = (client_t*)tmp->data_;
-    if(c && (c->fd_[0] == fd || c->fd_[1] == fd))
-      return c;
-    tmp = tmp->next_;
-  }
-
-  return NULL;
+  return fd_table_get(&(list->fds_), fd);
 }
 
 void clients_print(clients_t* list)
@@ -220,9 +844,13 @@ void clients_print(clients_t* list)
     }
     tmp = tmp->next_;
   }
+  buffer_pool_print(list->pool_);
 }
 
-void clients_read_fds(clients_t* list, fd_set* set, int* max_fd)
+// must be called after every reload, clients which are still connecting
+// follow once they are connected as the indices of their attempts refer
+// to the old target
+void clients_retarget(clients_t* list)
 {
   if(!list)
     return;
@@ -230,120 +858,542 @@ void clients_read_fds(clients_t* list, fd_set* set, int* max_fd)
   slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     client_t* c = (client_t*)tmp->data_;
-    if(c && c->state_ == CONNECTED) {
-      if(c->write_buf_offset_[1] < c->write_buf_[1].length_) {
-        FD_SET(c->fd_[0], set);
-        *max_fd = *max_fd > c->fd_[0] ? *max_fd : c->fd_[0];
-      }
-      if(c->write_buf_offset_[0] < c->write_buf_[0].length_) {
-        FD_SET(c->fd_[1], set);
-        *max_fd = *max_fd > c->fd_[1] ? *max_fd : c->fd_[1];
-      }
-    }
+    if(c && c->state_ == CONNECTED)
+      clients_follow(c);
     tmp = tmp->next_;
   }
 }
 
-void clients_write_fds(clients_t* list, fd_set* set, int* max_fd)
+#ifdef CLIENTS_USE_SPLICE
+// splice() is not supported by all kinds of sockets, as long as there is
+// no data in flight the direction can be switched over to a userspace buffer
+static int clients_unsplice(clients_t* list, client_t* c, int i)
 {
-  if(!list)
-    return;
+  if(c->write_buf_offset_[i])
+    return -1;
 
-  slist_element_t* tmp = list->list_.first_;
-  while(tmp) {
-    client_t* c = (client_t*)tmp->data_;
-    if(c && c->state_ == CONNECTED) {
-      if(c->write_buf_offset_[0]) {
-        FD_SET(c->fd_[0], set);
-        *max_fd = *max_fd > c->fd_[0] ? *max_fd : c->fd_[0];
-      }
-      if(c->write_buf_offset_[1]) {
-        FD_SET(c->fd_[1], set);
-        *max_fd = *max_fd > c->fd_[1] ? *max_fd : c->fd_[1];
-      }
-    } else if(c && c->state_ == CONNECTING) {
-      FD_SET(c->fd_[1], set);
-      *max_fd = *max_fd > c->fd_[1] ? *max_fd : c->fd_[1];
+  log_printf(INFO, "splice() not possible for client %d, using buffered relay", c->fd_[0]);
+  close(c->pipe_[i][0]);
+  close(c->pipe_[i][1]);
+  c->pipe_[i][0] = c->pipe_[i][1] = -1;
+  c->pipe_full_[i] = 0;
+  return clients_init_buffer(list, c, i);
+}
+#endif
+
+// handles the outcome of receiving len bytes from fd_[in], error is the
+// errno if len is negative
+static int clients_received(clients_t* list, client_t* c, int in, int len, int error)
+{
+  int out = in ^ 1;
+  if(len < 0) {
+    if(error == EAGAIN || error == EWOULDBLOCK || error == EINTR) {
+      clients_return_buffer(list, c, out);
+      return 0;
     }
-    tmp = tmp->next_;
+
+    if(in == 1 && error == ECONNRESET)
+      clients_report(list, c, c->backend_, 0);
+    log_printf(INFO, "Error on recv(): %s, removing client %d", strerror(error), c->fd_[0]);
+    clients_drop(list, c);
+    return 1;
+  }
+  else if(!len) {
+    log_printf(INFO, "client %d closed connection, removing it", c->fd_[0]);
+    clients_report(list, c, c->backend_, 1);
+    clients_drop(list, c);
+    return 1;
   }
+
+  c->write_buf_offset_[out] += len;
+  c->active_ = list->now_;
+  if(in == 1 && list->now_ - c->rtt_sampled_ >= CLIENTS_RTT_INTERVAL && clients_sampling(c)) {
+    clients_sample(list, c, c->backend_, clients_rtt(c->fd_[1]));
+    c->rtt_sampled_ = list->now_;
+  }
+  return 0;
 }
 
-int clients_read(clients_t* list, fd_set* set)
+static int clients_read(clients_t* list, client_t* c, int in)
 {
-  if(!list)
+  int out = in ^ 1;
+  struct iovec iov[2];
+  int len;
+#ifdef CLIENTS_USE_SPLICE
+  if(c->pipe_[out][1] >= 0) {
+    len = splice(c->fd_[in], NULL, c->pipe_[out][1], NULL, c->write_buf_[out].length_ - c->write_buf_offset_[out], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && c->write_buf_offset_[out]) {
+      // the pipe might be full even though it holds less bytes than its
+      // size since partially filled pages occupy a whole slot
+      c->pipe_full_[out] = 1;
+      return 0;
+    }
+    if(len < 0 && errno == EINVAL && !clients_unsplice(list, c, out))
+      return clients_read(list, c, in);
+  }
+  else
+#endif
+  {
+    if(clients_borrow_buffer(c, out)) {
+      log_printf(ERROR, "memory error on buffer pool, removing client %d", c->fd_[0]);
+      clients_drop(list, c);
+      return 1;
+    }
+    len = readv(c->fd_[in], iov, clients_buf_space(c, out, iov));
+  }
+  return clients_received(list, c, in, len, len < 0 ? errno : 0);
+}
+
+// handles the outcome of sending len bytes of buffer i, error is the errno
+// if len is negative
+static int clients_sent(clients_t* list, client_t* c, int i, int len, int error)
+{
+  if(len < 0) {
+    if(error == EAGAIN || error == EWOULDBLOCK || error == EINTR)
+      return 0;
+
+    if(i == 1 && (error == ECONNRESET || error == EPIPE))
+      clients_report(list, c, c->backend_, 0);
+    log_printf(INFO, "Error on send(): %s, removing client %d", strerror(error), c->fd_[0]);
+    clients_drop(list, c);
+    return 1;
+  }
+
+  c->transferred_[i] += len;
+  list->bytes_ += len;
+  if(len)
+    c->active_ = list->now_;
+  if(c->write_buf_offset_[i] > len) {
+    if(c->write_buf_[i].buf_)
+      c->write_buf_start_[i] = (c->write_buf_start_[i] + len) % c->write_buf_[i].length_;
+    c->write_buf_offset_[i] -= len;
+  }
+  else {
+    // a receive in flight fills the buffer right behind the sent data
+    c->write_buf_offset_[i] = 0;
+    c->write_buf_start_[i] = c->recv_pending_[i] ? (c->write_buf_start_[i] + len) % c->write_buf_[i].length_ : 0;
+  }
+  if(len)
+    c->pipe_full_[i] = 0;
+  clients_return_buffer(list, c, i);
+  return 0;
+}
+
+static int clients_write(clients_t* list, client_t* c, int i)
+{
+  struct iovec iov[2];
+  int len;
+#ifdef CLIENTS_USE_SPLICE
+  if(c->pipe_[i][0] >= 0)
+    len = splice(c->pipe_[i][0], NULL, c->fd_[i], NULL, c->write_buf_offset_[i], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  else
+#endif
+  len = writev(c->fd_[i], iov, clients_buf_data(c, i, iov));
+  return clients_sent(list, c, i, len, len < 0 ? errno : 0);
+}
+
+// cut-through: instead of waiting for the next loop iteration to report
+// the peer as writeable try to send the data right away and continue
+// reading as long as everything got sent and the budget is not exhausted
+static int clients_relay(clients_t* list, client_t* c, int in)
+{
+  int out = in ^ 1;
+  u_int64_t start = c->transferred_[out];
+  for(;;) {
+    u_int32_t offset = c->write_buf_offset_[out];
+    if(clients_read(list, c, in))
+      return 1;
+    if(!list->cut_through_ || c->write_buf_offset_[out] == offset)
+      return 0;
+    if(clients_write(list, c, out))
+      return 1;
+    if(c->write_buf_offset_[out] || c->transferred_[out] - start >= list->cut_through_)
+      return 0;
+  }
+}
+
+typedef struct {
+  mpsc_node_t node_;
+  int has_target_;
+  tcp_endpoint_t local_end_;
+  tcp_endpoint_t remote_end_;
+  tcp_endpoint_t source_end_;
+  int fd_[2];
+  int pipe_[2][2];
+  int pipe_full_[2];
+  u_int32_t pipe_fill_[2];
+  u_int32_t pipe_size_[2];
+  u_int64_t transferred_[2];
+  u_int64_t started_;
+  u_int64_t active_;
+  u_int64_t idle_timeout_;
+  u_int64_t lifetime_;
+} client_handoff_t;
+
+static client_handoff_t* clients_detach(clients_t* list, client_t* c)
+{
+  int i;
+  if(c->state_ != CONNECTED)
+    return NULL;
+  for(i = 0; i < 2; ++i) {
+    if(c->pipe_[i][0] < 0 && c->write_buf_offset_[i])
+      return NULL;
+  }
+
+  client_handoff_t* h = malloc(sizeof(client_handoff_t));
+  if(!h)
+    return NULL;
+
+  timer_wheel_cancel(&(list->timers_), &(c->timer_));
+  clients_follow(c);
+  h->has_target_ = c->target_ != NULL;
+  if(c->target_) {
+    h->local_end_ = c->target_->local_end_;
+    h->remote_end_.len_ = 0;
+    if(c->backend_ != CLIENTS_NO_BACKEND) {
+      balancer_backend_t* be = &(c->target_->balancer_.backends_[c->backend_]);
+      h->remote_end_ = be->remote_ends_[0];
+      h->source_end_ = be->source_end_;
+    }
+  }
+  clients_assign(c, CLIENTS_NO_BACKEND);
+  h->started_ = c->started_;
+  h->active_ = c->active_;
+  h->idle_timeout_ = c->idle_timeout_;
+  h->lifetime_ = c->lifetime_;
+  for(i = 0; i < 2; ++i) {
+    poller_remove(list->poller_, c->fd_[i]);
+    if(fd_table_get(&(list->fds_), c->fd_[i]) == c)
+      fd_table_remove(&(list->fds_), c->fd_[i]);
+
+    h->fd_[i] = c->fd_[i];
+    h->pipe_[i][0] = c->pipe_[i][0];
+    h->pipe_[i][1] = c->pipe_[i][1];
+    h->pipe_full_[i] = c->pipe_full_[i];
+    h->pipe_fill_[i] = c->pipe_[i][0] >= 0 ? c->write_buf_offset_[i] : 0;
+    h->pipe_size_[i] = c->write_buf_[i].length_;
+    h->transferred_[i] = c->transferred_[i];
+
+    c->fd_[i] = -1;
+    c->pipe_[i][0] = c->pipe_[i][1] = -1;
+  }
+  slist_remove_element(&(list->list_), c->element_);
+  return h;
+}
+
+// a client which is handed off in completion mode waits until its requests
+// are canceled, it stays if data came in meanwhile
+static int clients_move(clients_t* list, client_t* c)
+{
+  int i;
+  for(i = 0; i < 2; ++i) {
+    if(c->recv_pending_[i] || c->send_pending_[i])
+      return 0;
+  }
+  c->moving_ = 0;
+  client_handoff_t* h = list->moving_to_ ? clients_detach(list, c) : NULL;
+  if(!h)
+    return 0;
+  mpsc_push(list->moving_to_, &(h->node_));
+  list->moved_++;
+  return 1;
+}
+
+static int clients_complete(clients_t* list, client_t* c, int fd, int events, int res)
+{
+  int in = (fd == c->fd_[0]) ? 0 : 1;
+  if(events & POLLER_SEND) {
+    c->send_pending_[in] = 0;
+    if(!(c->moving_ && res == -ECANCELED) && clients_sent(list, c, in, res, -res))
+      return 1;
+  }
+  if(events & POLLER_RECV) {
+    c->recv_pending_[in ^ 1] = 0;
+    if(!(c->moving_ && res == -ECANCELED) && clients_received(list, c, in, res, -res))
+      return 1;
+  }
+  return c->moving_ && clients_move(list, c);
+}
+
+int clients_handle(clients_t* list, client_t* c, int fd, int events, int res)
+{
+  if(!list || !c)
     return -1;
 
-  slist_element_t* tmp = list->list_.first_;
-  while(tmp) {
-    client_t* c = (client_t*)tmp->data_;
-    tmp = tmp->next_;
-    if(c && c->state_ == CONNECTED) {
-      int i;
-      for(i=0; i<2; ++i) {
-        int in, out;
-        if(FD_ISSET(c->fd_[i], set)) {
-          in = i;
-          out = i ^ 1;
-        }
-        else continue;
-
-        int len = recv(c->fd_[in], &(c->write_buf_[out].buf_[c->write_buf_offset_[out]]),  c->write_buf_[out].length_ - c->write_buf_offset_[out], 0);
-        if(len < 0) {
-          log_printf(INFO, "Error on recv(): %s, removing client %d", strerror(errno), c->fd_[0]);
-          slist_remove(&(list->list_), c);
-          break;
-        }
-        else if(!len) {
-          log_printf(INFO, "client %d closed connection, removing it", c->fd_[0]);
-          slist_remove(&(list->list_), c);
-          break;
-        }
-        else
-          c->write_buf_offset_[out] += len;
+  if(c->state_ == CONNECTING) {
+    int i;
+    for(i = 0; i < CLIENTS_CONNECT_ATTEMPTS; ++i) {
+      if(fd == c->attempts_[i] && (events & POLLER_WRITE)) {
+        clients_attempt_done(list, c, i);
+        break;
       }
     }
+    return 0;
   }
 
+  if(events & (POLLER_RECV | POLLER_SEND)) {
+    if(clients_complete(list, c, fd, events, res) || c->state_ != CONNECTED)
+      return 0;
+    if(clients_update_events(list, c)) {
+      log_printf(ERROR, "unable to submit requests for client %d, removing it", c->fd_[0]);
+      clients_drop(list, c);
+    }
+    return 0;
+  }
+
+  int i = (fd == c->fd_[0]) ? 0 : 1;
+  if((events & POLLER_WRITE) && clients_write(list, c, i))
+    return 0;
+  if((events & POLLER_READ) && clients_relay(list, c, i))
+    return 0;
+
+  clients_update_events(list, c);
+
   return 0;
 }
 
-int clients_write(clients_t* list, fd_set* set)
+static void clients_timer(clients_t* list, client_t* c)
+{
+  u_int64_t now = list->now_;
+  if(c->state_ == CONNECTING) {
+    if(c->target_->connect_timeout_ && now >= c->backend_started_ + c->target_->connect_timeout_) {
+      clients_sample(list, c, c->backend_, BALANCER_PENALTY);
+      clients_report(list, c, c->backend_, 0);
+      if(c->tries_ < c->target_->balancer_.cnt_) {
+        log_printf(INFO, "connect timeout on backend %u, trying the next one for client %d", c->backend_, c->fd_[0]);
+        int i;
+        for(i = 0; i < CLIENTS_CONNECT_ATTEMPTS; ++i)
+          clients_close_attempt(list, c, i);
+        c->next_remote_ = c->target_->balancer_.backends_[c->backend_].remote_cnt_;
+        clients_connect_next(list, c);
+        return;
+      }
+      log_printf(INFO, "connect timeout, removing client %d", c->fd_[0]);
+      clients_drop(list, c);
+      return;
+    }
+    if(c->deadline_ && now >= c->deadline_) {
+      clients_connect_next(list, c);
+      return;
+    }
+  }
+  else {
+    if(c->lifetime_ && now >= c->started_ + c->lifetime_) {
+      log_printf(INFO, "client %d reached its maximum lifetime, removing it", c->fd_[0]);
+      clients_drop(list, c);
+      return;
+    }
+    if(c->idle_timeout_ && now >= c->active_ + c->idle_timeout_) {
+      log_printf(INFO, "client %d has been idle for too long, removing it", c->fd_[0]);
+      clients_drop(list, c);
+      return;
+    }
+  }
+  clients_arm(list, c);
+}
+
+// returns the time in ms until the next timer of a client is due
+int clients_timeout(clients_t* list)
 {
   if(!list)
     return -1;
 
+  return timer_wheel_timeout(&(list->timers_), clients_now());
+}
+
+// must be called whenever the poller returns, this also updates the time
+// used to track the activity of the clients
+void clients_expire(clients_t* list)
+{
+  if(!list)
+    return;
+
+  list->now_ = clients_now();
+  timer_wheel_entry_t* e;
+  while((e = timer_wheel_expire(&(list->timers_), list->now_)))
+    clients_timer(list, (client_t*)e->data_);
+}
+
+// connections are moved between workers as a handoff carrying the file
+// descriptors and the fill level of the pipes. Data waiting in userspace
+// buffers can't be moved along, such connections are skipped. The targets
+// belong to the workers, so the listener and backend are carried by their
+// addresses and looked up again by the adopting worker.
+static void clients_handoff_close(client_handoff_t* h)
+{
+  int i;
+  for(i = 0; i < 2; ++i) {
+    close(h->fd_[i]);
+    if(h->pipe_[i][0] >= 0) {
+      close(h->pipe_[i][0]);
+      close(h->pipe_[i][1]);
+    }
+  }
+  free(h);
+}
+
+static int clients_attach(clients_t* list, client_handoff_t* h, clients_lookup_t lookup, void* arg)
+{
+  if(arena_full(&(list->client_arena_))) {
+    log_printf(INFO, "maximum number of connections (%u) reached, dropping migrated client %d", list->client_arena_.max_objs_, h->fd_[0]);
+    clients_handoff_close(h);
+    return -1;
+  }
+  client_t* c = arena_alloc(&(list->client_arena_));
+  if(!c) {
+    clients_handoff_close(h);
+    return -2;
+  }
+  c->arena_ = &(list->client_arena_);
+  c->pool_ = list->pool_;
+  c->state_ = CONNECTED;
+  c->sampled_ = h->transferred_[0] + h->transferred_[1];
+  c->target_ = NULL;
+  c->backend_ = CLIENTS_NO_BACKEND;
+  c->rtt_sampled_ = 0;
+  c->deadline_ = 0;
+  c->started_ = h->started_;
+  if(h->has_target_ && lookup)
+    c->target_ = lookup(arg, &(h->local_end_));
+  if(c->target_) {
+    c->target_->refs_++;
+    if(h->remote_end_.len_)
+      clients_assign(c, balancer_find(&(c->target_->balancer_), &(h->remote_end_), &(h->source_end_)));
+  }
+  c->moving_ = 0;
+  c->active_ = h->active_;
+  c->idle_timeout_ = h->idle_timeout_;
+  c->lifetime_ = h->lifetime_;
+  timer_wheel_entry_init(&(c->timer_), c);
+
+  int i, ret = 0;
+  for(i = 0; i < CLIENTS_CONNECT_ATTEMPTS; ++i)
+    c->attempts_[i] = -1;
+  for(i = 0; i < 2; ++i) {
+    c->fd_[i] = h->fd_[i];
+    c->write_buf_[i].buf_ = NULL;
+    c->write_buf_offset_[i] = h->pipe_fill_[i];
+    c->write_buf_start_[i] = 0;
+    c->buf_index_[i] = -1;
+    c->recv_pending_[i] = c->send_pending_[i] = 0;
+    c->pipe_[i][0] = h->pipe_[i][0];
+    c->pipe_[i][1] = h->pipe_[i][1];
+    c->pipe_full_[i] = h->pipe_full_[i];
+    c->transferred_[i] = h->transferred_[i];
+    if(c->pipe_[i][0] >= 0)
+      c->write_buf_[i].length_ = h->pipe_size_[i];
+    else if(!ret)
+      ret = clients_init_buffer(list, c, i);
+  }
+  free(h);
+
+  c->element_ = slist_add(&(list->list_), c);
+  if(!c->element_) {
+    clients_assign(c, CLIENTS_NO_BACKEND);
+    clients_delete_element(c);
+    return -2;
+  }
+  if(ret || fd_table_set(&(list->fds_), c->fd_[0], c) || fd_table_set(&(list->fds_), c->fd_[1], c)) {
+    clients_drop(list, c);
+    return -2;
+  }
+  if(poller_add(list->poller_, c->fd_[0], 0, POLLER_CLIENT, c) ||
+     poller_add(list->poller_, c->fd_[1], 0, POLLER_CLIENT, c) ||
+     clients_update_events(list, c)) {
+    log_printf(ERROR, "unable to watch migrated client %d, removing it", c->fd_[0]);
+    clients_drop(list, c);
+    return -1;
+  }
+  clients_arm(list, c);
+  return 0;
+}
+
+// hands off up to max of the connections which transferred the most data
+// since the last handoff, summing up to roughly the requested amount of bytes
+int clients_handoff(clients_t* list, u_int64_t bytes, int max, mpsc_queue_t* dest)
+{
+  if(!list || !dest || max <= 0)
+    return 0;
+
+  client_t* picked[max];
+  u_int64_t recent[max];
+  int i, cnt = 0;
   slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     client_t* c = (client_t*)tmp->data_;
     tmp = tmp->next_;
-    if(c && c->state_ == CONNECTED) {
-      int i;
-      for(i=0; i<2; ++i) {
-        if(FD_ISSET(c->fd_[i], set)) {
-          int len = send(c->fd_[i], c->write_buf_[i].buf_, c->write_buf_offset_[i], 0);
-          if(len < 0) {
-            log_printf(INFO, "Error on send(): %s, removing client %d", strerror(errno), c->fd_[0]);
-            slist_remove(&(list->list_), c);
-            break;
-          }
-          else {
-            c->transferred_[i] += len;
-            if(c->write_buf_offset_[i] > len) {
-              memmove(c->write_buf_[i].buf_, &c->write_buf_[i].buf_[len], c->write_buf_offset_[i] - len);
-              c->write_buf_offset_[i] -= len;
-            }
-            else
-              c->write_buf_offset_[i] = 0;
-          }
-        }
-      }
-    } else if(c && c->state_ == CONNECTING && FD_ISSET(c->fd_[1], set)) {
-      int ret = handle_connect(c, list->buffer_size_);
-      if(ret)
-        slist_remove(&(list->list_), c);
+    if(!c || c->state_ != CONNECTED)
+      continue;
+
+    u_int64_t r = c->transferred_[0] + c->transferred_[1] - c->sampled_;
+    c->sampled_ += r;
+    if(!r || (cnt == max && r <= recent[cnt - 1]))
+      continue;
+
+    if(cnt < max)
+      cnt++;
+    for(i = cnt - 1; i > 0 && recent[i - 1] < r; --i) {
+      picked[i] = picked[i - 1];
+      recent[i] = recent[i - 1];
     }
+    picked[i] = c;
+    recent[i] = r;
   }
 
-  return 0;
+  int moved = 0;
+  list->moving_to_ = dest;
+  for(i = 0; i < cnt && bytes; ++i) {
+    if(recent[i] > 2 * bytes)
+      continue;
+    // the requests in flight have to complete first, the client is pushed
+    // to dest from clients_handle and counted by clients_moved
+    if(list->completions_) {
+      client_t* c = picked[i];
+      if(c->moving_ || c->write_buf_offset_[0] || c->write_buf_offset_[1])
+        continue;
+      c->moving_ = 1;
+      poller_cancel(list->poller_, c->fd_[0]);
+      poller_cancel(list->poller_, c->fd_[1]);
+      bytes = recent[i] < bytes ? bytes - recent[i] : 0;
+      continue;
+    }
+    client_handoff_t* h = clients_detach(list, picked[i]);
+    if(!h)
+      continue;
+    mpsc_push(dest, &(h->node_));
+    bytes = recent[i] < bytes ? bytes - recent[i] : 0;
+    moved++;
+  }
+  return moved;
+}
+
+int clients_moved(clients_t* list)
+{
+  if(!list)
+    return 0;
+
+  int moved = list->moved_;
+  list->moved_ = 0;
+  return moved;
+}
+
+int clients_adopt(clients_t* list, mpsc_queue_t* src, clients_lookup_t lookup, void* arg)
+{
+  if(!list || !src)
+    return 0;
+
+  int cnt = 0;
+  mpsc_node_t* n;
+  while((n = mpsc_pop(src))) {
+    if(!clients_attach(list, (client_handoff_t*)n, lookup, arg))
+      cnt++;
+  }
+  return cnt;
+}
+
+void clients_handoff_drop(mpsc_queue_t* q)
+{
+  mpsc_node_t* n;
+  while((n = mpsc_pop(q)))
+    clients_handoff_close((client_handoff_t*)n);
 }
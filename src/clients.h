@@ -28,42 +28,129 @@
 #ifndef TCPPROXY_clients_h_INCLUDED
 #define TCPPROXY_clients_h_INCLUDED
 
-#include <sys/select.h>
-
 #include "slist.h"
+#include "fd_table.h"
+#include "arena.h"
+#include "buffer_pool.h"
 #include "tcp.h"
+#include "poller.h"
+#include "mpsc.h"
+#include "timer_wheel.h"
+#include "balancer.h"
+#include "health.h"
+#include "config_store.h"
 
 #define BUFFER_LENGTH 102400
 
+#define CLIENTS_CONNECT_DELAY 250
+#define CLIENTS_CONNECT_ATTEMPTS 8
+#define CLIENTS_RTT_INTERVAL 1000
+
+#define CLIENTS_NO_BACKEND ((u_int32_t)-1)
+
+// the backends and timeouts (in ms, 0 disables them) for new clients of a
+// listener. The target is shared by the listener and its clients and must
+// only be used by a single worker. checks_ holds the health check of
+// every backend if they are enabled, only one worker runs them but all of
+// them follow the results through the slots of the checks. Once a reload
+// replaced the target next_ is its successor and map_ holds the index of
+// every backend in there.
+typedef struct clients_target_struct {
+  int refs_;
+  tcp_endpoint_t local_end_;
+  u_int64_t connect_timeout_;
+  u_int64_t idle_timeout_;
+  u_int64_t lifetime_;
+  balancer_t balancer_;
+  config_check_t check_;
+  health_check_t* checks_;
+  struct clients_target_struct* next_;
+  u_int32_t* map_;
+} clients_target_t;
+
+clients_target_t* clients_target_new(const config_listener_t* l, health_board_t* board);
+void clients_target_release(clients_target_t* target);
+void clients_target_succeed(clients_target_t* target, clients_target_t* next);
+void clients_target_watch(clients_target_t* target, health_t* health);
+void clients_target_unwatch(clients_target_t* target);
+void clients_target_sync(clients_target_t* target);
+
 enum client_state_enum { CONNECTING, CONNECTED };
 typedef enum client_state_enum client_state_t;
 
-typedef struct {
+struct client_struct {
   int fd_[2];
   buffer_t write_buf_[2];
   u_int32_t write_buf_offset_[2];
+  u_int32_t write_buf_start_[2];
+  int buf_index_[2];
+  int recv_pending_[2];
+  int send_pending_[2];
+  int moving_;
+  int pipe_[2][2];
+  int pipe_full_[2];
   client_state_t state_;
   u_int64_t transferred_[2];
-} client_t;
+  u_int64_t sampled_;
+  slist_element_t* element_;
+  arena_t* arena_;
+  buffer_pool_t* pool_;
+  clients_target_t* target_;
+  u_int32_t backend_;
+  u_int32_t tries_;
+  u_int32_t next_remote_;
+  u_int64_t backend_started_;
+  int attempts_[CLIENTS_CONNECT_ATTEMPTS];
+  u_int32_t attempt_backends_[CLIENTS_CONNECT_ATTEMPTS];
+  u_int64_t attempt_started_[CLIENTS_CONNECT_ATTEMPTS];
+  u_int64_t rtt_sampled_;
+  u_int64_t deadline_;
+  u_int64_t started_;
+  u_int64_t active_;
+  u_int64_t idle_timeout_;
+  u_int64_t lifetime_;
+  timer_wheel_entry_t timer_;
+};
+typedef struct client_struct client_t;
 
 void clients_delete_element(void* e);
 
 typedef struct {
   slist_t list_;
+  fd_table_t fds_;
+  arena_t client_arena_;
+  arena_t element_arena_;
   int32_t buffer_size_;
+  int splice_;
+  int lazy_buffers_;
+  u_int32_t cut_through_;
+  int completions_;
+  mpsc_queue_t* moving_to_;
+  int moved_;
+  u_int64_t bytes_;
+  buffer_pool_t* pool_;
+  poller_t* poller_;
+  timer_wheel_t timers_;
+  u_int64_t now_;
 } clients_t;
 
-int clients_init(clients_t* list, int32_t buffer_size);
+int clients_init(clients_t* list, int32_t buffer_size, int splice, int lazy_buffers, u_int32_t cut_through, u_int32_t max_connections, buffer_pool_t* pool, poller_t* poller);
 void clients_clear(clients_t* list);
-int clients_add(clients_t* list, int fd, const tcp_endpoint_t remote_end, const tcp_endpoint_t source_end);
+int clients_add(clients_t* list, int fd, clients_target_t* target, const tcp_endpoint_t* client);
 void clients_remove(clients_t* list, int fd);
 client_t* clients_find(clients_t* list, int fd);
 void clients_print(clients_t* list);
+void clients_retarget(clients_t* list);
 
-void clients_read_fds(clients_t* list, fd_set* set, int* max_fd);
-void clients_write_fds(clients_t* list, fd_set* set, int* max_fd);
+int clients_handle(clients_t* list, client_t* c, int fd, int events, int res);
+int clients_timeout(clients_t* list);
+void clients_expire(clients_t* list);
 
-int clients_read(clients_t* list, fd_set* set);
-int clients_write(clients_t* list, fd_set* set);
+int clients_handoff(clients_t* list, u_int64_t bytes, int max, mpsc_queue_t* dest);
+int clients_moved(clients_t* list);
+// finds the target of the listener on local_end in the adopting worker
+typedef clients_target_t* (*clients_lookup_t)(void* arg, const tcp_endpoint_t* local_end);
+int clients_adopt(clients_t* list, mpsc_queue_t* src, clients_lookup_t lookup, void* arg);
+void clients_handoff_drop(mpsc_queue_t* q);
 
 #endif
@@ -0,0 +1,521 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "datatypes.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "config_store.h"
+#include "log.h"
+
+// the main thread builds a new config on every reload and publishes it by
+// swapping the current pointer. Every worker announces the version of the
+// config it uses (its epoch) once it switched over. A retired config is
+// freed when the epochs of all workers are past its version.
+
+static void config_delete_element(void* e)
+{
+  free(e);
+}
+
+static void config_delete_listener(void* e)
+{
+  if(!e)
+    return;
+
+  config_listener_t* l = (config_listener_t*)e;
+  u_int32_t i;
+  for(i = 0; i < l->backend_cnt_; ++i)
+    free(l->backends_[i]);
+  free(l->backends_);
+  free(l->schedule_);
+  free(l);
+}
+
+config_t* config_new()
+{
+  config_t* cfg = malloc(sizeof(config_t));
+  if(!cfg)
+    return NULL;
+
+  cfg->version_ = 0;
+  cfg->next_ = NULL;
+  cfg->cached_ = 0;
+  cfg->timeouts_.connect_ = 0;
+  cfg->timeouts_.idle_ = 0;
+  cfg->timeouts_.lifetime_ = 0;
+  slist_init(&(cfg->listeners_), &config_delete_listener);
+  slist_init(&(cfg->pending_), &config_delete_element);
+  resolver_init(&(cfg->resolver_));
+  return cfg;
+}
+
+void config_delete(config_t* cfg)
+{
+  if(!cfg)
+    return;
+
+  slist_clear(&(cfg->listeners_));
+  slist_clear(&(cfg->pending_));
+  resolver_clear(&(cfg->resolver_));
+  free(cfg);
+}
+
+int config_add_listener(config_t* cfg, const char* laddr, resolv_type_t lrt, const char* lport, const config_remote_t* remotes, u_int32_t remote_cnt,
+                        resolv_type_t rrt, const char* saddr, int backlog, const config_timeouts_t* timeouts, config_balance_t balance,
+                        const config_check_t* check, const config_eject_t* eject)
+{
+  if(!cfg)
+    return -1;
+
+  if(!lport) { log_printf(ERROR, "no local port specified"); return -1; }
+  if(!remote_cnt) { log_printf(ERROR, "no remote address specified"); return -1; }
+  u_int32_t i;
+  for(i = 0; i < remote_cnt; ++i) {
+    if(!remotes[i].addr_) { log_printf(ERROR, "no remote address specified"); return -1; }
+    if(!remotes[i].port_) { log_printf(ERROR, "no remote port specified"); return -1; }
+    if(remotes[i].weight_ < 1 || remotes[i].weight_ > CONFIG_MAX_WEIGHT) {
+      log_printf(ERROR, "illegal weight %d for remote %s, must be between 1 and %d", remotes[i].weight_, remotes[i].addr_, CONFIG_MAX_WEIGHT);
+      return -1;
+    }
+  }
+  if(check && check->interval_ > 0) {
+    if(check->rise_ < 1 || check->fall_ < 1) { log_printf(ERROR, "check rise and fall must be at least 1"); return -1; }
+    if(check->send_len_ > CONFIG_CHECK_MAX || check->expect_len_ > CONFIG_CHECK_MAX) {
+      log_printf(ERROR, "check payload and expected answer must not be longer than %d bytes", CONFIG_CHECK_MAX);
+      return -1;
+    }
+  }
+  if(eject && eject->failures_ > 0) {
+    if(eject->time_ < 1) { log_printf(ERROR, "ejection time must be at least 1 second"); return -1; }
+    if(eject->max_percent_ < 0 || eject->max_percent_ > 100) { log_printf(ERROR, "maximum percentage of ejected backends must be between 0 and 100"); return -1; }
+  }
+
+  config_pending_t* element = malloc(sizeof(config_pending_t) + remote_cnt * sizeof(config_pending_remote_t));
+  if(!element)
+    return -2;
+
+  int ret = 0;
+  for(i = 0; i < remote_cnt; ++i) {
+    element->remotes_[i].remote_ = resolver_add(&(cfg->resolver_), remotes[i].addr_, remotes[i].port_, rrt, 0);
+    element->remotes_[i].weight_ = remotes[i].weight_;
+    if(!element->remotes_[i].remote_)
+      ret = -2;
+  }
+  element->remote_cnt_ = remote_cnt;
+  element->source_ = saddr ? resolver_add(&(cfg->resolver_), saddr, NULL, rrt, 0) : NULL;
+  element->local_ = resolver_add(&(cfg->resolver_), laddr, lport, lrt, 1);
+  element->backlog_ = backlog;
+  element->balance_ = balance;
+  memset(&(element->check_), 0, sizeof(config_check_t));
+  if(check && check->interval_ > 0) {
+    element->check_ = *check;
+    if(element->check_.timeout_ <= 0)
+      element->check_.timeout_ = check->interval_;
+  }
+  memset(&(element->eject_), 0, sizeof(config_eject_t));
+  if(eject && eject->failures_ > 0)
+    element->eject_ = *eject;
+  element->timeouts_ = cfg->timeouts_;
+  if(timeouts) {
+    if(timeouts->connect_ >= 0) element->timeouts_.connect_ = timeouts->connect_;
+    if(timeouts->idle_ >= 0) element->timeouts_.idle_ = timeouts->idle_;
+    if(timeouts->lifetime_ >= 0) element->timeouts_.lifetime_ = timeouts->lifetime_;
+  }
+  if(ret || (saddr && !element->source_) || !element->local_ || !slist_add(&(cfg->pending_), element)) {
+    free(element);
+    return -2;
+  }
+  return 0;
+}
+
+// sorts the remote addresses the way RFC 8305 suggests: alternating
+// between the address families, starting with the family of the preferred
+// address. With a source address only addresses of its family are usable.
+static u_int32_t config_order_remotes(const resolver_query_t* remote, const tcp_endpoint_t* source, tcp_endpoint_t* ends)
+{
+  const tcp_endpoint_t* addrs = remote->addrs_;
+  u_int32_t n = remote->addrs_cnt_;
+  sa_family_t first = source ? source->addr_.ss_family : addrs[0].addr_.ss_family;
+  u_int32_t i = 0, j = 0, cnt = 0;
+  for(;;) {
+    while(i < n && addrs[i].addr_.ss_family != first) i++;
+    if(i < n)
+      ends[cnt++] = addrs[i++];
+    if(!source) {
+      while(j < n && addrs[j].addr_.ss_family == first) j++;
+      if(j < n)
+        ends[cnt++] = addrs[j++];
+    }
+    if(i >= n && (source || j >= n))
+      break;
+  }
+  return cnt;
+}
+
+static u_int32_t config_gcd(u_int32_t a, u_int32_t b)
+{
+  while(b) {
+    u_int32_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// smooth weighted round robin (as used by nginx): every backend gains its
+// weight, the one with the highest current weight gets picked and loses
+// the sum of all weights. The sequence repeats after the sum of the
+// weights (divided by their gcd) so it is computed here once and the
+// workers only have to step through it.
+static int config_schedule(config_listener_t* l)
+{
+  u_int32_t i, j, gcd = 0, total = 0;
+  for(i = 0; i < l->backend_cnt_; ++i)
+    gcd = config_gcd(l->backends_[i]->weight_, gcd);
+  for(i = 0; i < l->backend_cnt_; ++i)
+    total += l->backends_[i]->weight_ / gcd;
+
+  int64_t* current = calloc(l->backend_cnt_, sizeof(int64_t));
+  l->schedule_ = malloc(total * sizeof(u_int32_t));
+  if(!current || !l->schedule_) {
+    free(current);
+    return -2;
+  }
+  for(j = 0; j < total; ++j) {
+    u_int32_t best = 0;
+    for(i = 0; i < l->backend_cnt_; ++i) {
+      current[i] += l->backends_[i]->weight_ / gcd;
+      if(current[i] > current[best])
+        best = i;
+    }
+    current[best] -= total;
+    l->schedule_[j] = best;
+  }
+  l->schedule_len_ = total;
+  free(current);
+  return 0;
+}
+
+static u_int64_t config_hash_remote(const resolver_query_t* remote)
+{
+  u_int64_t h = 14695981039346656037ULL;
+  const char* s;
+  for(s = remote->addr_; s && *s; ++s)
+    h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+  h = (h ^ ' ') * 1099511628211ULL;
+  for(s = remote->port_; s && *s; ++s)
+    h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Maglev hashing (Eisenbud et al., NSDI 2016): every backend has its own
+// permutation of the table slots derived from the name it is configured
+// with, not its addresses. The backends take turns claiming the next free
+// slot of their permutation, as often per turn as their weight, until the
+// table is full. Adding or removing a backend only moves about the share
+// of the slots it gets or had.
+static int config_maglev(config_listener_t* l, const config_pending_t* p)
+{
+  u_int32_t i, k, gcd = 0, filled = 0;
+  for(i = 0; i < l->backend_cnt_; ++i)
+    gcd = config_gcd(l->backends_[i]->weight_, gcd);
+
+  u_int32_t* perm = malloc(3 * l->backend_cnt_ * sizeof(u_int32_t));
+  l->schedule_ = malloc(CONFIG_MAGLEV_SIZE * sizeof(u_int32_t));
+  if(!perm || !l->schedule_) {
+    free(perm);
+    return -2;
+  }
+  u_int32_t* offset = perm;
+  u_int32_t* skip = perm + l->backend_cnt_;
+  u_int32_t* next = perm + 2 * l->backend_cnt_;
+  for(i = 0; i < l->backend_cnt_; ++i) {
+    u_int64_t h = config_hash_remote(p->remotes_[i].remote_);
+    offset[i] = (u_int32_t)((h >> 32) % CONFIG_MAGLEV_SIZE);
+    skip[i] = (u_int32_t)((h & 0xffffffff) % (CONFIG_MAGLEV_SIZE - 1)) + 1;
+    next[i] = 0;
+  }
+  memset(l->schedule_, 0xff, CONFIG_MAGLEV_SIZE * sizeof(u_int32_t));
+  l->schedule_len_ = CONFIG_MAGLEV_SIZE;
+
+  while(filled < CONFIG_MAGLEV_SIZE) {
+    for(i = 0; i < l->backend_cnt_ && filled < CONFIG_MAGLEV_SIZE; ++i) {
+      for(k = l->backends_[i]->weight_ / gcd; k > 0 && filled < CONFIG_MAGLEV_SIZE; --k) {
+        u_int32_t slot;
+        do {
+          slot = (u_int32_t)((offset[i] + (u_int64_t)next[i]++ * skip[i]) % CONFIG_MAGLEV_SIZE);
+        } while(l->schedule_[slot] != (u_int32_t)-1);
+        l->schedule_[slot] = i;
+        filled++;
+      }
+    }
+  }
+  free(perm);
+  return 0;
+}
+
+static int config_expand_backends(config_listener_t* l, config_pending_t* p)
+{
+  l->backends_ = calloc(p->remote_cnt_, sizeof(config_backend_t*));
+  if(!l->backends_)
+    return -2;
+
+  u_int32_t i, j;
+  for(j = 0; j < p->remote_cnt_; ++j) {
+    const resolver_query_t* remote = p->remotes_[j].remote_;
+
+    // the source address should match the family of the preferred remote
+    const tcp_endpoint_t* source = NULL;
+    if(p->source_) {
+      source = &(p->source_->addrs_[0]);
+      for(i = 0; i < p->source_->addrs_cnt_; ++i) {
+        if(p->source_->addrs_[i].addr_.ss_family == remote->addrs_[0].addr_.ss_family) {
+          source = &(p->source_->addrs_[i]);
+          break;
+        }
+      }
+    }
+
+    config_backend_t* b = malloc(sizeof(config_backend_t) + remote->addrs_cnt_ * sizeof(tcp_endpoint_t));
+    if(!b)
+      return -2;
+    l->backends_[l->backend_cnt_++] = b;
+
+    b->weight_ = p->remotes_[j].weight_;
+    b->remote_cnt_ = config_order_remotes(remote, source, b->remote_ends_);
+    if(!b->remote_cnt_) {
+      log_printf(ERROR, "no address of %s matches the family of the source address %s", remote->addr_, p->source_->addr_);
+      return -1;
+    }
+    if(source)
+      b->source_end_ = *source;
+    else {
+      memset(&(b->source_end_), 0, sizeof(tcp_endpoint_t));
+      b->source_end_.addr_.ss_family = AF_UNSPEC;
+    }
+  }
+  return l->balance_ == BALANCE_MAGLEV ? config_maglev(l, p) : config_schedule(l);
+}
+
+static int config_expand_listener(config_t* cfg, config_pending_t* p)
+{
+  u_int32_t i;
+  if((p->source_ && !p->source_->addrs_) || !p->local_->addrs_)
+    return -1;
+  for(i = 0; i < p->remote_cnt_; ++i) {
+    if(!p->remotes_[i].remote_->addrs_)
+      return -1;
+  }
+
+  for(i = 0; i < p->local_->addrs_cnt_; ++i) {
+    config_listener_t* element = malloc(sizeof(config_listener_t));
+    if(!element)
+      return -2;
+
+    memset(element, 0, sizeof(config_listener_t));
+    element->local_end_ = p->local_->addrs_[i];
+    element->backlog_ = p->backlog_;
+    element->timeouts_ = p->timeouts_;
+    element->balance_ = p->balance_;
+    element->check_ = p->check_;
+    element->eject_ = p->eject_;
+    int ret = config_expand_backends(element, p);
+    if(!ret && !slist_add(&(cfg->listeners_), element))
+      ret = -2;
+    if(ret) {
+      config_delete_listener(element);
+      return ret;
+    }
+  }
+  return 0;
+}
+
+static int config_expand(config_t* cfg)
+{
+  int ret = 0;
+  slist_element_t* tmp = cfg->pending_.first_;
+  while(tmp) {
+    int err = config_expand_listener(cfg, (config_pending_t*)tmp->data_);
+    if(err && !ret)
+      ret = err;
+    tmp = tmp->next_;
+  }
+  return ret;
+}
+
+// resolves the addresses of all pending listeners using up to jobs
+// threads, identical addresses are only looked up once. If use_cache is
+// set the addresses found in the cache file are not looked up at all,
+// after a successful lookup the cache file is rewritten.
+int config_resolve(config_t* cfg, int jobs, const char* cache, int use_cache)
+{
+  if(!cfg)
+    return -1;
+
+  resolver_t* r = &(cfg->resolver_);
+  int missing = -1;
+  if(cache && use_cache)
+    missing = resolver_load(r, cache);
+  if(missing && !resolver_run(r, jobs) && cache)
+    resolver_save(r, cache);
+  cfg->cached_ = r->cached_ > 0;
+  return config_expand(cfg);
+}
+
+static config_t* config_clone(config_t* base)
+{
+  config_t* cfg = config_new();
+  if(!cfg)
+    return NULL;
+
+  resolver_set_ttl(&(cfg->resolver_), base->resolver_.max_ttl_);
+  cfg->timeouts_ = base->timeouts_;
+  slist_element_t* tmp = base->pending_.first_;
+  while(tmp) {
+    config_pending_t* p = (config_pending_t*)tmp->data_;
+    config_pending_t* element = malloc(sizeof(config_pending_t) + p->remote_cnt_ * sizeof(config_pending_remote_t));
+    if(!element) {
+      config_delete(cfg);
+      return NULL;
+    }
+    *element = *p;
+    int ret = 0;
+    u_int32_t i;
+    for(i = 0; i < p->remote_cnt_; ++i) {
+      resolver_query_t* r = p->remotes_[i].remote_;
+      element->remotes_[i].remote_ = resolver_add(&(cfg->resolver_), r->addr_, r->port_, r->rt_, 0);
+      element->remotes_[i].weight_ = p->remotes_[i].weight_;
+      if(!element->remotes_[i].remote_)
+        ret = -2;
+    }
+    element->source_ = p->source_ ? resolver_add(&(cfg->resolver_), p->source_->addr_, NULL, p->source_->rt_, 0) : NULL;
+    element->local_ = resolver_add(&(cfg->resolver_), p->local_->addr_, p->local_->port_, p->local_->rt_, 1);
+    if(ret || (p->source_ && !element->source_) || !element->local_ || !slist_add(&(cfg->pending_), element)) {
+      free(element);
+      config_delete(cfg);
+      return NULL;
+    }
+    tmp = tmp->next_;
+  }
+  if(resolver_copy(&(cfg->resolver_), &(base->resolver_), 0)) {
+    config_delete(cfg);
+    return NULL;
+  }
+  return cfg;
+}
+
+// resolves the expired addresses of base again and returns a new config
+// if any of them has changed. Otherwise only the expiry times of base are
+// updated, these are never read by the workers.
+config_t* config_refresh(config_t* base, int jobs, const char* cache)
+{
+  if(!base)
+    return NULL;
+
+  config_t* cfg = config_clone(base);
+  if(!cfg)
+    return NULL;
+
+  int changed = resolver_refresh(&(cfg->resolver_), jobs);
+  if(changed <= 0 || config_expand(cfg)) {
+    resolver_copy(&(base->resolver_), &(cfg->resolver_), 1);
+    config_delete(cfg);
+    return NULL;
+  }
+  if(cache)
+    resolver_save(&(cfg->resolver_), cache);
+  return cfg;
+}
+
+time_t config_next_refresh(config_t* cfg)
+{
+  return cfg ? resolver_next_expiry(&(cfg->resolver_)) : 0;
+}
+
+void config_store_init(config_store_t* store)
+{
+  atomic_init(&store->current_, NULL);
+  store->version_ = 0;
+  store->retired_ = NULL;
+}
+
+void config_store_clear(config_store_t* store)
+{
+  if(!store)
+    return;
+
+  config_reclaim(store, (u_int64_t)-1);
+  config_delete(atomic_exchange(&store->current_, NULL));
+}
+
+// must only be called by the main thread
+void config_publish(config_store_t* store, config_t* cfg)
+{
+  if(!store || !cfg)
+    return;
+
+  cfg->version_ = ++store->version_;
+  config_t* old = atomic_exchange_explicit(&store->current_, cfg, memory_order_acq_rel);
+  if(old) {
+    old->next_ = store->retired_;
+    store->retired_ = old;
+  }
+}
+
+config_t* config_acquire(config_store_t* store)
+{
+  return atomic_load_explicit(&store->current_, memory_order_acquire);
+}
+
+// frees all retired configs older than epoch and returns the number of
+// configs which are still waiting for some worker
+int config_reclaim(config_store_t* store, u_int64_t epoch)
+{
+  if(!store)
+    return 0;
+
+  int cnt = 0;
+  config_t** tmp = &store->retired_;
+  while(*tmp) {
+    config_t* cfg = *tmp;
+    if(cfg->version_ < epoch) {
+      *tmp = cfg->next_;
+      log_printf(DEBUG, "freeing config version %llu", (unsigned long long)cfg->version_);
+      config_delete(cfg);
+    }
+    else {
+      tmp = &cfg->next_;
+      cnt++;
+    }
+  }
+  return cnt;
+}
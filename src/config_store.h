@@ -0,0 +1,161 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_config_store_h_INCLUDED
+#define TCPPROXY_config_store_h_INCLUDED
+
+#include <stdatomic.h>
+
+#include "slist.h"
+#include "tcp.h"
+#include "resolver.h"
+
+#define CONFIG_RECLAIM_INTERVAL 100
+#define CONFIG_MAX_WEIGHT 256
+#define CONFIG_MAGLEV_SIZE 16381
+#define CONFIG_CHECK_MAX 256
+
+enum config_balance_enum { BALANCE_ROUND_ROBIN, BALANCE_LEAST_CONN, BALANCE_MAGLEV, BALANCE_P2C };
+typedef enum config_balance_enum config_balance_t;
+
+// timeouts of the clients of a listener in seconds, 0 disables them and
+// -1 selects the default timeouts of the config
+typedef struct {
+  int connect_;
+  int idle_;
+  int lifetime_;
+} config_timeouts_t;
+
+// active health checks of the backends, interval_ and timeout_ are in ms
+// and an interval of 0 disables them. A check connects to the backend,
+// sends send_ and expects the answer to start with expect_, both may be
+// empty.
+typedef struct {
+  int interval_;
+  int timeout_;
+  int rise_;
+  int fall_;
+  u_int32_t send_len_;
+  u_int32_t expect_len_;
+  char send_[CONFIG_CHECK_MAX];
+  char expect_[CONFIG_CHECK_MAX];
+} config_check_t;
+
+// passive health checks, a backend is ejected for time_ seconds after
+// failures_ connections to it failed in a row, doubling with every further
+// ejection. No more than max_percent_ of the backends are ejected at once,
+// failures_ of 0 disables ejection.
+typedef struct {
+  int failures_;
+  int time_;
+  int max_percent_;
+} config_eject_t;
+
+typedef struct {
+  const char* addr_;
+  const char* port_;
+  int weight_;
+} config_remote_t;
+
+// remote_ends_ holds the addresses of the backend in the order they are tried
+typedef struct {
+  int weight_;
+  tcp_endpoint_t source_end_;
+  u_int32_t remote_cnt_;
+  tcp_endpoint_t remote_ends_[];
+} config_backend_t;
+
+// schedule_ is the sequence of backends picked by smooth weighted round
+// robin or the Maglev lookup table indexed by the hash of the client
+// address, either way it is computed once for every config
+typedef struct {
+  tcp_endpoint_t local_end_;
+  int backlog_;
+  config_timeouts_t timeouts_;
+  config_balance_t balance_;
+  config_check_t check_;
+  config_eject_t eject_;
+  u_int32_t backend_cnt_;
+  config_backend_t** backends_;
+  u_int32_t schedule_len_;
+  u_int32_t* schedule_;
+} config_listener_t;
+
+typedef struct {
+  resolver_query_t* remote_;
+  int weight_;
+} config_pending_remote_t;
+
+typedef struct {
+  resolver_query_t* local_;
+  resolver_query_t* source_;
+  int backlog_;
+  config_timeouts_t timeouts_;
+  config_balance_t balance_;
+  config_check_t check_;
+  config_eject_t eject_;
+  u_int32_t remote_cnt_;
+  config_pending_remote_t remotes_[];
+} config_pending_t;
+
+// a config is built completely before it is published and never modified
+// afterwards, the workers only read it. Listeners are added to pending_
+// first and expanded into listeners_ once all addresses have been
+// resolved. The queries are kept to be able to resolve them again.
+struct config_struct {
+  u_int64_t version_;
+  slist_t listeners_;
+  slist_t pending_;
+  resolver_t resolver_;
+  config_timeouts_t timeouts_;
+  int cached_;
+  struct config_struct* next_;
+};
+typedef struct config_struct config_t;
+
+config_t* config_new();
+void config_delete(config_t* cfg);
+int config_add_listener(config_t* cfg, const char* laddr, resolv_type_t lrt, const char* lport, const config_remote_t* remotes, u_int32_t remote_cnt,
+                        resolv_type_t rrt, const char* saddr, int backlog, const config_timeouts_t* timeouts, config_balance_t balance,
+                        const config_check_t* check, const config_eject_t* eject);
+int config_resolve(config_t* cfg, int jobs, const char* cache, int use_cache);
+config_t* config_refresh(config_t* base, int jobs, const char* cache);
+time_t config_next_refresh(config_t* cfg);
+
+typedef struct {
+  config_t* _Atomic current_;
+  u_int64_t version_;
+  config_t* retired_;
+} config_store_t;
+
+void config_store_init(config_store_t* store);
+void config_store_clear(config_store_t* store);
+void config_publish(config_store_t* store, config_t* cfg);
+config_t* config_acquire(config_store_t* store);
+int config_reclaim(config_store_t* store, u_int64_t epoch);
+
+#endif
@@ -0,0 +1,93 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "datatypes.h"
+
+#include "fd_table.h"
+
+int fd_table_init(fd_table_t* t)
+{
+  if(!t)
+    return -1;
+
+  t->data_ = NULL;
+  t->len_ = 0;
+  return 0;
+}
+
+void fd_table_clear(fd_table_t* t)
+{
+  if(!t)
+    return;
+
+  if(t->data_)
+    free(t->data_);
+  t->data_ = NULL;
+  t->len_ = 0;
+}
+
+int fd_table_set(fd_table_t* t, int fd, void* data)
+{
+  if(!t || fd < 0)
+    return -1;
+
+  if(fd >= t->len_) {
+    int len = t->len_ ? t->len_ : 64;
+    while(len <= fd)
+      len *= 2;
+
+    void** d = realloc(t->data_, len * sizeof(void*));
+    if(!d)
+      return -2;
+
+    memset(&(d[t->len_]), 0, (len - t->len_) * sizeof(void*));
+    t->data_ = d;
+    t->len_ = len;
+  }
+
+  t->data_[fd] = data;
+  return 0;
+}
+
+void* fd_table_get(fd_table_t* t, int fd)
+{
+  if(!t || fd < 0 || fd >= t->len_)
+    return NULL;
+
+  return t->data_[fd];
+}
+
+void fd_table_remove(fd_table_t* t, int fd)
+{
+  if(!t || fd < 0 || fd >= t->len_)
+    return;
+
+  t->data_[fd] = NULL;
+}
@@ -0,0 +1,43 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_fd_table_h_INCLUDED
+#define TCPPROXY_fd_table_h_INCLUDED
+
+struct fd_table_struct {
+  void** data_;
+  int len_;
+};
+typedef struct fd_table_struct fd_table_t;
+
+int fd_table_init(fd_table_t* t);
+void fd_table_clear(fd_table_t* t);
+int fd_table_set(fd_table_t* t, int fd, void* data);
+void* fd_table_get(fd_table_t* t, int fd);
+void fd_table_remove(fd_table_t* t, int fd);
+
+#endif
@@ -0,0 +1,355 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "datatypes.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "health.h"
+#include "tcp.h"
+#include "log.h"
+
+// a probe connects to the preferred address of the backend, sends the
+// payload if there is one and waits for the expected answer. Probes which
+// don't finish within the timeout count as failed. The next probe is
+// started one interval after the previous one has finished.
+
+static u_int64_t health_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int health_board_init(health_board_t* board)
+{
+  if(pthread_mutex_init(&board->lock_, NULL))
+    return -1;
+  board->blocks_ = NULL;
+  atomic_init(&board->version_, 0);
+  return 0;
+}
+
+void health_board_clear(health_board_t* board)
+{
+  while(board->blocks_) {
+    health_block_t* next = board->blocks_->next_;
+    free(board->blocks_);
+    board->blocks_ = next;
+  }
+  pthread_mutex_destroy(&board->lock_);
+}
+
+static int health_same_end(const tcp_endpoint_t* x, const tcp_endpoint_t* y)
+{
+  return x->len_ == y->len_ && !memcmp(&(x->addr_), &(y->addr_), x->len_);
+}
+
+// returns the slot of this backend address, new slots start out as up
+health_slot_t* health_board_slot(health_board_t* board, const tcp_endpoint_t* remote_end, const tcp_endpoint_t* source_end)
+{
+  health_slot_t* slot = NULL;
+  pthread_mutex_lock(&board->lock_);
+  health_block_t* b;
+  for(b = board->blocks_; b && !slot; b = b->next_) {
+    u_int32_t i;
+    for(i = 0; i < b->cnt_; ++i) {
+      if(health_same_end(&(b->slots_[i].remote_end_), remote_end) && health_same_end(&(b->slots_[i].source_end_), source_end)) {
+        slot = &(b->slots_[i]);
+        break;
+      }
+    }
+  }
+  if(!slot) {
+    b = board->blocks_;
+    if(!b || b->cnt_ == HEALTH_BOARD_BLOCK) {
+      b = malloc(sizeof(health_block_t));
+      if(b) {
+        b->cnt_ = 0;
+        b->next_ = board->blocks_;
+        board->blocks_ = b;
+      }
+    }
+    if(b) {
+      slot = &(b->slots_[b->cnt_++]);
+      slot->remote_end_ = *remote_end;
+      slot->source_end_ = *source_end;
+      atomic_init(&slot->up_, 1);
+    }
+  }
+  pthread_mutex_unlock(&board->lock_);
+  return slot;
+}
+
+void health_init(health_t* h, health_board_t* board, poller_t* poller)
+{
+  h->board_ = board;
+  h->seen_ = atomic_load(&board->version_);
+  h->poller_ = poller;
+  h->now_ = health_now();
+  timer_wheel_init(&(h->timers_), h->now_);
+  h->checks_ = NULL;
+}
+
+void health_clear(health_t* h)
+{
+  while(h->checks_)
+    health_stop(h->checks_);
+}
+
+// tells whether any backend went up or down since the last call
+int health_changed(health_t* h)
+{
+  u_int64_t version = atomic_load(&h->board_->version_);
+  if(version == h->seen_)
+    return 0;
+  h->seen_ = version;
+  return 1;
+}
+
+void health_check_init(health_check_t* c, const config_check_t* cfg, health_slot_t* slot, balancer_t* balancer, u_int32_t backend)
+{
+  c->health_ = NULL;
+  c->next_ = NULL;
+  c->pprev_ = NULL;
+  c->cfg_ = cfg;
+  c->slot_ = slot;
+  c->balancer_ = balancer;
+  c->backend_ = backend;
+  c->fd_ = -1;
+  c->state_ = HEALTH_IDLE;
+  c->received_ = 0;
+  c->rise_ = 0;
+  c->fall_ = 0;
+  timer_wheel_entry_init(&(c->timer_), c);
+}
+
+// the first probes of the backends are spread over one interval
+void health_start(health_t* h, health_check_t* c)
+{
+  if(c->health_)
+    return;
+
+  c->health_ = h;
+  c->next_ = h->checks_;
+  if(c->next_)
+    c->next_->pprev_ = &(c->next_);
+  c->pprev_ = &(h->checks_);
+  h->checks_ = c;
+  u_int64_t offset = (u_int64_t)c->cfg_->interval_ * c->backend_ / c->balancer_->cnt_;
+  timer_wheel_arm(&(h->timers_), &(c->timer_), h->now_ + offset + 1);
+}
+
+static void health_close(health_check_t* c)
+{
+  if(c->fd_ < 0)
+    return;
+
+  poller_remove(c->health_->poller_, c->fd_);
+  close(c->fd_);
+  c->fd_ = -1;
+}
+
+void health_stop(health_check_t* c)
+{
+  if(!c->health_)
+    return;
+
+  health_close(c);
+  timer_wheel_cancel(&(c->health_->timers_), &(c->timer_));
+  *(c->pprev_) = c->next_;
+  if(c->next_)
+    c->next_->pprev_ = c->pprev_;
+  c->next_ = NULL;
+  c->pprev_ = NULL;
+  c->health_ = NULL;
+  c->state_ = HEALTH_IDLE;
+}
+
+static void health_done(health_t* h, health_check_t* c, const char* error)
+{
+  health_close(c);
+  c->state_ = HEALTH_IDLE;
+  timer_wheel_arm(&(h->timers_), &(c->timer_), h->now_ + c->cfg_->interval_);
+
+  int up = atomic_load(&c->slot_->up_);
+  if(error) {
+    log_printf(DEBUG, "health check of backend %u failed: %s", c->backend_, error);
+    c->rise_ = 0;
+    if(c->fall_ < c->cfg_->fall_)
+      c->fall_++;
+    if(!up || c->fall_ < c->cfg_->fall_)
+      return;
+  }
+  else {
+    c->fall_ = 0;
+    if(c->rise_ < c->cfg_->rise_)
+      c->rise_++;
+    if(up || c->rise_ < c->cfg_->rise_)
+      return;
+  }
+
+  atomic_store(&c->slot_->up_, !up);
+  atomic_fetch_add(&h->board_->version_, 1);
+  char* rs = tcp_endpoint_to_string(c->balancer_->backends_[c->backend_].remote_ends_[0]);
+  if(error)
+    log_printf(WARNING, "backend %s is down: %s", rs ? rs : "(null)", error);
+  else
+    log_printf(NOTICE, "backend %s is up again", rs ? rs : "(null)");
+  if(rs) free(rs);
+}
+
+static void health_connected(health_t* h, health_check_t* c)
+{
+  const config_check_t* cfg = c->cfg_;
+  if(cfg->send_len_) {
+    int len = send(c->fd_, cfg->send_, cfg->send_len_, MSG_NOSIGNAL);
+    if(len < 0 || (u_int32_t)len != cfg->send_len_) {
+      health_done(h, c, len < 0 ? strerror(errno) : "short write");
+      return;
+    }
+  }
+  if(!cfg->expect_len_) {
+    health_done(h, c, NULL);
+    return;
+  }
+
+  if(poller_mod(h->poller_, c->fd_, POLLER_READ)) {
+    health_done(h, c, "unable to wait for the answer");
+    return;
+  }
+  c->state_ = HEALTH_RECEIVING;
+  c->received_ = 0;
+}
+
+static void health_receive(health_t* h, health_check_t* c)
+{
+  const config_check_t* cfg = c->cfg_;
+  char buf[CONFIG_CHECK_MAX];
+  int len = recv(c->fd_, buf, cfg->expect_len_ - c->received_, 0);
+  if(len < 0) {
+    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      health_done(h, c, strerror(errno));
+    return;
+  }
+  if(!len) {
+    health_done(h, c, "connection closed before the expected answer");
+    return;
+  }
+  if(memcmp(buf, cfg->expect_ + c->received_, len)) {
+    health_done(h, c, "unexpected answer");
+    return;
+  }
+  c->received_ += len;
+  if(c->received_ == cfg->expect_len_)
+    health_done(h, c, NULL);
+}
+
+static void health_probe(health_t* h, health_check_t* c)
+{
+  const balancer_backend_t* be = &(c->balancer_->backends_[c->backend_]);
+  const tcp_endpoint_t* remote_end = &(be->remote_ends_[0]);
+  c->fd_ = socket(remote_end->addr_.ss_family, SOCK_STREAM, 0);
+  if(c->fd_ < 0) {
+    health_done(h, c, strerror(errno));
+    return;
+  }
+  if(fcntl(c->fd_, F_SETFL, O_NONBLOCK)) {
+    close(c->fd_);
+    c->fd_ = -1;
+    health_done(h, c, strerror(errno));
+    return;
+  }
+  if(be->source_end_.addr_.ss_family != AF_UNSPEC &&
+     bind(c->fd_, (const struct sockaddr *)&(be->source_end_.addr_), be->source_end_.len_) == -1) {
+    int error = errno;
+    close(c->fd_);
+    c->fd_ = -1;
+    health_done(h, c, strerror(error));
+    return;
+  }
+  if(poller_add(h->poller_, c->fd_, POLLER_WRITE, POLLER_CHECK, c)) {
+    close(c->fd_);
+    c->fd_ = -1;
+    health_done(h, c, "unable to watch the connection");
+    return;
+  }
+
+  c->state_ = HEALTH_CONNECTING;
+  timer_wheel_arm(&(h->timers_), &(c->timer_), h->now_ + c->cfg_->timeout_);
+  if(connect(c->fd_, (const struct sockaddr *)&(remote_end->addr_), remote_end->len_) == -1) {
+    if(errno != EINPROGRESS)
+      health_done(h, c, strerror(errno));
+    return;
+  }
+  health_connected(h, c);
+}
+
+int health_handle(health_t* h, health_check_t* c, int events)
+{
+  switch(c->state_) {
+  case HEALTH_CONNECTING: {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if(getsockopt(c->fd_, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+      error = errno;
+    if(error)
+      health_done(h, c, strerror(error));
+    else
+      health_connected(h, c);
+    break;
+  }
+  case HEALTH_RECEIVING: health_receive(h, c); break;
+  default: break;
+  }
+  return 0;
+}
+
+int health_timeout(health_t* h)
+{
+  return timer_wheel_timeout(&(h->timers_), health_now());
+}
+
+void health_expire(health_t* h)
+{
+  h->now_ = health_now();
+  timer_wheel_entry_t* e;
+  while((e = timer_wheel_expire(&(h->timers_), h->now_))) {
+    health_check_t* c = (health_check_t*)e->data_;
+    if(c->state_ == HEALTH_IDLE)
+      health_probe(h, c);
+    else
+      health_done(h, c, "timed out");
+  }
+}
@@ -0,0 +1,115 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_health_h_INCLUDED
+#define TCPPROXY_health_h_INCLUDED
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "poller.h"
+#include "timer_wheel.h"
+#include "balancer.h"
+#include "config_store.h"
+
+enum health_state_enum { HEALTH_IDLE, HEALTH_CONNECTING, HEALTH_RECEIVING };
+typedef enum health_state_enum health_state_t;
+
+// the state of a backend address as seen by the health checks. It is
+// written by the worker running the checks and read by all the others, slots
+// never move once created so the checks and balancers can keep pointers to
+// them. Slots of backends which are gone stay around until shutdown.
+typedef struct {
+  tcp_endpoint_t remote_end_;
+  tcp_endpoint_t source_end_;
+  _Atomic int up_;
+} health_slot_t;
+
+#define HEALTH_BOARD_BLOCK 64
+
+typedef struct health_block_struct {
+  health_slot_t slots_[HEALTH_BOARD_BLOCK];
+  u_int32_t cnt_;
+  struct health_block_struct* next_;
+} health_block_t;
+
+// version_ is incremented whenever a backend goes up or down
+typedef struct {
+  pthread_mutex_t lock_;
+  health_block_t* blocks_;
+  _Atomic u_int64_t version_;
+} health_board_t;
+
+int health_board_init(health_board_t* board);
+void health_board_clear(health_board_t* board);
+health_slot_t* health_board_slot(health_board_t* board, const tcp_endpoint_t* remote_end, const tcp_endpoint_t* source_end);
+
+struct health_struct;
+
+// the check of a single backend, rise_ and fall_ count the consecutive
+// successful and failed probes. health_ is set while it is being watched.
+struct health_check_struct {
+  struct health_struct* health_;
+  struct health_check_struct* next_;
+  struct health_check_struct** pprev_;
+  const config_check_t* cfg_;
+  health_slot_t* slot_;
+  balancer_t* balancer_;
+  u_int32_t backend_;
+  int fd_;
+  health_state_t state_;
+  u_int32_t received_;
+  int rise_;
+  int fall_;
+  timer_wheel_entry_t timer_;
+};
+typedef struct health_check_struct health_check_t;
+
+// only one worker runs the checks and publishes the results on the board,
+// seen_ is the version of the board the balancers of a worker are in sync with
+typedef struct health_struct {
+  health_board_t* board_;
+  u_int64_t seen_;
+  poller_t* poller_;
+  timer_wheel_t timers_;
+  u_int64_t now_;
+  health_check_t* checks_;
+} health_t;
+
+void health_init(health_t* h, health_board_t* board, poller_t* poller);
+void health_clear(health_t* h);
+int health_changed(health_t* h);
+
+void health_check_init(health_check_t* c, const config_check_t* cfg, health_slot_t* slot, balancer_t* balancer, u_int32_t backend);
+void health_start(health_t* h, health_check_t* c);
+void health_stop(health_check_t* c);
+
+int health_handle(health_t* h, health_check_t* c, int events);
+int health_timeout(health_t* h);
+void health_expire(health_t* h);
+
+#endif
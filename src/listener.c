@@ -25,6 +25,7 @@
  *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "datatypes.h"
 
 #include <errno.h>
@@ -32,12 +33,12 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
-#include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <sys/select.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
 
 #include "listener.h"
 #include "tcp.h"
@@ -45,100 +46,191 @@
 
 #include "clients.h"
 
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+#define LISTENER_USE_ACCEPT4
+#endif
+#if defined(__linux__) && defined(TCP_INFO)
+#define LISTENER_USE_TCP_INFO
+// connections accepted by the poller come one at a time, the queue is only
+// looked at for every LISTENER_QUEUE_SAMPLE of them
+#define LISTENER_QUEUE_SAMPLE 64
+#endif
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+#define LISTENER_USE_CBPF
+#include <linux/filter.h>
+#endif
+
+// with io_uring the poller accepts the connections itself
+static int listeners_events(poller_t* poller)
+{
+  return poller_completions(poller) ? POLLER_ACCEPT : POLLER_READ;
+}
+
 void listeners_delete_element(void* e)
 {
   if(!e)
     return;
 
   listener_t* element = (listener_t*)e;
-  if(element->fd_ >= 0)
+  if(element->fd_ >= 0) {
+    poller_remove(element->poller_, element->fd_);
     close(element->fd_);
+  }
+  clients_target_unwatch(element->target_);
+  clients_target_release(element->target_);
 
   free(e);
 }
 
-int listeners_init(listeners_t* list)
+int listeners_init(listeners_t* list, int backlog, int reuseport, health_board_t* board)
 {
-  return slist_init(list, &listeners_delete_element);
+  list->board_ = board;
+  list->backlog_ = backlog > 0 ? backlog : SOMAXCONN;
+  list->reuseport_ = reuseport;
+  list->cpu_ = -1;
+  list->cpus_ = NULL;
+  list->cpus_cnt_ = 0;
+  list->report_time_ = time(NULL);
+  fd_table_init(&(list->fds_));
+  return slist_init(&(list->list_), &listeners_delete_element);
 }
 
 void listeners_clear(listeners_t* list)
 {
-  slist_clear(list);
+  slist_clear(&(list->list_));
+  fd_table_clear(&(list->fds_));
 }
 
-int listeners_add(listeners_t* list, const char* laddr, resolv_type_t lrt, const char* lport, const char* raddr, resolv_type_t rrt, const char* rport, const char* saddr)
+// cpu is the CPU the owner of this list is pinned to, cpus holds the CPUs
+// of all workers in the order their sockets join the reuseport groups
+void listeners_set_cpus(listeners_t* list, int cpu, const int* cpus, int cpus_cnt)
 {
-  if(!list)
-    return -1;
-
-  if(!lport) { log_printf(ERROR, "no local port specified"); return -1; }
-  if(!raddr) { log_printf(ERROR, "no remote address specified"); return -1; }
-  if(!rport) { log_printf(ERROR, "no remote port specified"); return -1; }
+  list->cpu_ = cpu;
+  list->cpus_ = cpus;
+  list->cpus_cnt_ = cpus_cnt;
+}
 
-// TODO: what if more than one address is returned here?
-  struct addrinfo* re = tcp_resolve_endpoint(raddr, rport, rrt, 0);
-  if(!re)
-    return -1;
+// the remote addresses of a backend in the order they are tried
+static char* listener_backend_to_string(const balancer_backend_t* be)
+{
+  char* ret = NULL;
+  u_int32_t i;
+  for(i = 0; i < be->remote_cnt_; ++i) {
+    char* rs = tcp_endpoint_to_string(be->remote_ends_[i]);
+    char* tmp = NULL;
+    int len = asprintf(&tmp, "%s%s%s", ret ? ret : "", ret ? ", " : "", rs ? rs : "(null)");
+    if(rs) free(rs);
+    if(ret) free(ret);
+    if(len == -1)
+      return NULL;
+    ret = tmp;
+  }
+  return ret;
+}
 
-  struct addrinfo* se = NULL;
-  if(saddr) {
-    se = tcp_resolve_endpoint(saddr, NULL, rrt, 0);
-    if(!se) {
-      freeaddrinfo(re);
-      return -1;
-    }
+// all backends of a listener including their weight and source address
+static char* listener_remote_to_string(listener_t* l)
+{
+  const balancer_t* b = &(l->target_->balancer_);
+  char* ret = NULL;
+  u_int32_t i;
+  for(i = 0; i < b->cnt_; ++i) {
+    const balancer_backend_t* be = &(b->backends_[i]);
+    char* rs = listener_backend_to_string(be);
+    char* ss = tcp_endpoint_to_string(be->source_end_);
+    char ws[16] = "";
+    if(be->weight_ != 1)
+      snprintf(ws, sizeof(ws), " weight %u", be->weight_);
+    char* tmp = NULL;
+    int len = asprintf(&tmp, "%s%s%s%s%s%s", ret ? ret : "", ret ? "; " : "", rs ? rs : "(null)", ws,
+                       ss ? " with source " : "", ss ? ss : "");
+    if(rs) free(rs);
+    if(ss) free(ss);
+    if(ret) free(ret);
+    if(len == -1)
+      return NULL;
+    ret = tmp;
   }
+  return ret;
+}
+
+static void listeners_drop(listeners_t* list, listener_t* l)
+{
+  if(fd_table_get(&(list->fds_), l->fd_) == l)
+    fd_table_remove(&(list->fds_), l->fd_);
+  slist_remove_element(&(list->list_), l->element_);
+}
 
-  struct addrinfo* le = tcp_resolve_endpoint(laddr, lport, lrt, 1);
-  if(!le) {
-    freeaddrinfo(re);
-    if(se)
-      freeaddrinfo(se);
+// creates a new listener for every entry of the config and activates or
+// takes over the sockets, listeners missing from the config are removed
+int listeners_apply(listeners_t* list, const config_t* cfg)
+{
+  if(!list || !cfg)
     return -1;
-  }
 
-  struct addrinfo* l = le;
-  int ret = 0;
-  while(l) {
+  slist_element_t* tmp = cfg->listeners_.first_;
+  while(tmp) {
+    const config_listener_t* c = (const config_listener_t*)tmp->data_;
+    tmp = tmp->next_;
     listener_t* element = malloc(sizeof(listener_t));
     if(!element) {
-      ret = -2;
-      break;
+      listeners_revert(list);
+      return -2;
     }
-    memset(&(element->remote_end_.addr_), 0, sizeof(element->remote_end_.addr_));
-    memcpy(&(element->remote_end_.addr_), re->ai_addr, re->ai_addrlen);
-    element->remote_end_.len_ = re->ai_addrlen;
-
-    memset(&(element->source_end_.addr_), 0, sizeof(element->source_end_.addr_));
-    if(se) {
-      memcpy(&(element->source_end_.addr_), se->ai_addr, se->ai_addrlen);
-      element->source_end_.len_ = se->ai_addrlen;
+    element->target_ = clients_target_new(c, list->board_);
+    if(!element->target_) {
+      free(element);
+      listeners_revert(list);
+      return -2;
     }
-    else element->source_end_.addr_.ss_family = AF_UNSPEC;
-
-    memset(&(element->local_end_.addr_), 0, sizeof(element->local_end_.addr_));
-    memcpy(&(element->local_end_.addr_), l->ai_addr, l->ai_addrlen);
-    element->local_end_.len_ = l->ai_addrlen;
+    element->local_end_ = c->local_end_;
     element->state_ = NEW;
+    element->backlog_ = c->backlog_ > 0 ? c->backlog_ : list->backlog_;
+    element->accepted_ = 0;
+    element->accepted_reported_ = 0;
+    element->overflows_ = 0;
+    element->queue_max_ = 0;
     element->fd_ = -1;
+    element->poller_ = NULL;
 
-    if(slist_add(list, element) == NULL) {
+    element->element_ = slist_add(&(list->list_), element);
+    if(element->element_ == NULL) {
+      clients_target_release(element->target_);
       free(element);
-      ret = -2;
-      break;
+      listeners_revert(list);
+      return -2;
     }
-
-    l = l->ai_next;
   }
-  freeaddrinfo(re);
-  if(se) freeaddrinfo(se);
-  freeaddrinfo(le);
 
-  return ret;
+  return listeners_update(list);
 }
 
-static int activate_listener(listener_t* l)
+#ifdef LISTENER_USE_CBPF
+// the index returned by a reuseport program selects the socket in the
+// order the sockets have joined the group. The program compares the CPU
+// which received the SYN with the CPUs of all workers and falls back to
+// cpu % workers if there is no match.
+static void listeners_steer(listeners_t* list, listener_t* l)
+{
+  int n = list->cpus_cnt_ > 254 ? 0 : list->cpus_cnt_;
+  struct sock_filter code[2 * 254 + 3];
+  int i, len = 0;
+
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+  for(i = 0; i < n; ++i)
+    code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, list->cpus_[i], n + 1, 0);
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, list->cpus_cnt_);
+  code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+  for(i = 0; i < n; ++i)
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+
+  struct sock_fprog prog = { .len = len, .filter = code };
+  if(setsockopt(l->fd_, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)))
+    log_printf(WARNING, "unable to attach reuseport program: %s", strerror(errno));
+}
+#endif
+
+static int activate_listener(listeners_t* list, listener_t* l)
 {
   if(!l || l->state_ != NEW)
     return -1;
@@ -157,6 +249,18 @@ static int activate_listener(listener_t* l)
     l->state_ = ZOMBIE;
     return -1;
   }
+#ifdef SO_REUSEPORT
+  if(list->reuseport_ && setsockopt(l->fd_, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))) {
+    log_printf(ERROR, "Error on setsockopt(SO_REUSEPORT): %s", strerror(errno));
+    l->state_ = ZOMBIE;
+    return -1;
+  }
+#endif
+  if(fcntl(l->fd_, F_SETFL, O_NONBLOCK)) {
+    log_printf(ERROR, "Error on fcntl(): %s", strerror(errno));
+    l->state_ = ZOMBIE;
+    return -1;
+  }
   if(l->local_end_.addr_.ss_family == AF_INET6) {
     if(setsockopt(l->fd_, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)))
       log_printf(WARNING, "failed to set IPV6_V6ONLY socket option: %s", strerror(errno));
@@ -171,22 +275,28 @@ static int activate_listener(listener_t* l)
     return -1;
   }
 
-  ret = listen(l->fd_, 0);
+  ret = listen(l->fd_, l->backlog_);
   if(ret) {
     log_printf(ERROR, "Error on listen(): %s", strerror(errno));
     if(ls) free(ls);
     l->state_ = ZOMBIE;
     return -1;
   }
+#ifdef SO_INCOMING_CPU
+  if(list->cpu_ >= 0 && setsockopt(l->fd_, SOL_SOCKET, SO_INCOMING_CPU, &(list->cpu_), sizeof(list->cpu_)))
+    log_printf(WARNING, "failed to set SO_INCOMING_CPU socket option: %s", strerror(errno));
+#endif
+#ifdef LISTENER_USE_CBPF
+  if(list->reuseport_ && list->cpus_cnt_ > 1)
+    listeners_steer(list, l);
+#endif
 
   l->state_ = ACTIVE;
 
-  char* rs = tcp_endpoint_to_string(l->remote_end_);
-  char* ss = tcp_endpoint_to_string(l->source_end_);
-  log_printf(NOTICE, "listening on: %s (remote: %s%s%s)", ls ? ls:"(null)", rs ? rs:"(null)", ss ? " with source " : "", ss ? ss : "");
+  char* rs = listener_remote_to_string(l);
+  log_printf(NOTICE, "listening on: %s (remote: %s)", ls ? ls:"(null)", rs ? rs:"(null)");
   if(ls) free(ls);
   if(rs) free(rs);
-  if(ss) free(ss);
 
   return 0;
 }
@@ -199,14 +309,23 @@ static void update_listener(listener_t* dest, listener_t* src)
   dest->fd_ = src->fd_;
   src->fd_ = -1;
   dest->state_ = ACTIVE;
+  dest->accepted_ = src->accepted_;
+  dest->accepted_reported_ = src->accepted_reported_;
+  dest->overflows_ = src->overflows_;
+  dest->queue_max_ = src->queue_max_;
+  if(dest->backlog_ != src->backlog_ && listen(dest->fd_, dest->backlog_))
+    log_printf(WARNING, "unable to change backlog to %d: %s", dest->backlog_, strerror(errno));
+  dest->poller_ = src->poller_;
+  src->poller_ = NULL;
+  clients_target_succeed(src->target_, dest->target_);
+  if(dest->poller_)
+    poller_add(dest->poller_, dest->fd_, listeners_events(dest->poller_), POLLER_LISTENER, dest);
 
   char* ls = tcp_endpoint_to_string(dest->local_end_);
-  char* rs = tcp_endpoint_to_string(dest->remote_end_);
-  char* ss = tcp_endpoint_to_string(dest->source_end_);
-  log_printf(NOTICE, "reusing %s with remote: %s%s%s", ls ? ls:"(null)", rs ? rs:"(null)", ss ? " and source " : "", ss ? ss : "");
+  char* rs = listener_remote_to_string(dest);
+  log_printf(NOTICE, "reusing %s with remote: %s", ls ? ls:"(null)", rs ? rs:"(null)");
   if(ls) free(ls);
   if(rs) free(rs);
-  if(ss) free(ss);
 }
 
 static listener_t* find_zombie_listener(listeners_t* list, tcp_endpoint_t* local_end)
@@ -214,7 +333,7 @@ static listener_t* find_zombie_listener(listeners_t* list, tcp_endpoint_t* local
   if(!list)
     return NULL;
 
-  slist_element_t* tmp = list->first_;
+  slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
     if(l && l->state_ == ZOMBIE && l->local_end_.len_ == local_end->len_ &&
@@ -231,7 +350,7 @@ int listeners_update(listeners_t* list)
   if(!list)
     return 0;
 
-  slist_element_t* tmp = list->first_;
+  slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
     if(l && l->state_ == ACTIVE)
@@ -240,7 +359,7 @@ int listeners_update(listeners_t* list)
   }
 
   int retval = 0;
-  tmp = list->first_;
+  tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
     int ret = 0;
@@ -249,20 +368,22 @@ int listeners_update(listeners_t* list)
       if(tmp)
         update_listener(l, tmp);
       else
-        ret = activate_listener(l);
+        ret = activate_listener(list, l);
+      if(l->state_ == ACTIVE && fd_table_set(&(list->fds_), l->fd_, l))
+        ret = -2;
     }
     if(!retval) retval = ret;
     tmp = tmp->next_;
   }
 
   int cnt = 0;
-  tmp = list->first_;
+  tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
     tmp = tmp->next_;
     if(l && l->state_ == ZOMBIE) {
       cnt++;
-      slist_remove(list, l);
+      listeners_drop(list, l);
     }
   }
   log_printf(DEBUG, "%d listener zombies removed", cnt);
@@ -276,13 +397,13 @@ void listeners_revert(listeners_t* list)
     return;
 
   int cnt = 0;
-  slist_element_t* tmp = list->first_;
+  slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
     tmp = tmp->next_;
     if(l && l->state_ == NEW) {
       cnt++;
-      slist_remove(list, l);
+      listeners_drop(list, l);
     }
   }
 
@@ -291,7 +412,9 @@ void listeners_revert(listeners_t* list)
 
 void listeners_remove(listeners_t* list, int fd)
 {
-  slist_remove(list, listeners_find(list, fd));
+  listener_t* l = listeners_find(list, fd);
+  if(l)
+    listeners_drop(list, l);
 }
 
 listener_t* listeners_find(listeners_t* list, int fd)
@@ -299,14 +422,24 @@ listener_t* listeners_find(listeners_t* list, int fd)
   if(!list)
     return NULL;
 
-  slist_element_t* tmp = list->first_;
+  return fd_table_get(&(list->fds_), fd);
+}
+
+// takes a listeners_t to be usable as clients_lookup_t
+clients_target_t* listeners_target(void* arg, const tcp_endpoint_t* local_end)
+{
+  listeners_t* list = (listeners_t*)arg;
+  if(!list)
+    return NULL;
+
+  slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
-    if(l && l->fd_ == fd)
-      return l;
+    if(l && l->state_ == ACTIVE && l->local_end_.len_ == local_end->len_ &&
+       !memcmp(&(l->local_end_.addr_), &(local_end->addr_), local_end->len_))
+      return l->target_;
     tmp = tmp->next_;
   }
-
   return NULL;
 }
 
@@ -315,69 +448,195 @@ void listeners_print(listeners_t* list)
   if(!list)
     return;
 
-  slist_element_t* tmp = list->first_;
+  time_t now = time(NULL);
+  time_t elapsed = now - list->report_time_;
+  list->report_time_ = now;
+
+  slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
     if(l) {
       char* ls = tcp_endpoint_to_string(l->local_end_);
-      char* rs = tcp_endpoint_to_string(l->remote_end_);
-      char* ss = tcp_endpoint_to_string(l->source_end_);
+      char* rs = listener_remote_to_string(l);
       char state = '?';
       switch(l->state_) {
       case NEW: state = 'n'; break;
       case ACTIVE: state = 'a'; break;
       case ZOMBIE: state = 'z'; break;
       }
-      log_printf(NOTICE, "[%c] listener #%d: %s -> %s%s%s", state, l->fd_, ls ? ls : "(null)", rs ? rs : "(null)", ss ? " with source " : "", ss ? ss : "");
+      log_printf(NOTICE, "[%c] listener #%d: %s -> %s", state, l->fd_, ls ? ls : "(null)", rs ? rs : "(null)");
+      log_printf(NOTICE, "    backlog %d: %llu accepted (%llu/s), %llu overflows, %u max queued", l->backlog_, (unsigned long long)l->accepted_,
+                 (unsigned long long)(elapsed > 0 ? (l->accepted_ - l->accepted_reported_) / elapsed : 0), (unsigned long long)l->overflows_, l->queue_max_);
+      l->accepted_reported_ = l->accepted_;
+      const balancer_t* b = &(l->target_->balancer_);
+      u_int32_t i;
+      for(i = 0; (b->cnt_ > 1 || l->target_->checks_) && i < b->cnt_; ++i) {
+        const char* state = !b->backends_[i].up_ ? " (down)" : b->backends_[i].ejected_ ? " (ejected)" : "";
+        if(b->strategy_ == BALANCE_P2C)
+          log_printf(NOTICE, "    backend %u%s: %u active, last latency estimate %llu us", i, state, b->backends_[i].active_,
+                     (unsigned long long)b->backends_[i].ewma_);
+        else
+          log_printf(NOTICE, "    backend %u%s: %u active", i, state, b->backends_[i].active_);
+      }
       if(ls) free(ls);
       if(rs) free(rs);
-      if(ss) free(ss);
     }
     tmp = tmp->next_;
   }
 }
 
-void listeners_read_fds(listeners_t* list, fd_set* set, int* max_fd)
+int listeners_register(listeners_t* list, poller_t* poller)
 {
   if(!list)
-    return;
+    return -1;
 
-  slist_element_t* tmp = list->first_;
+  int retval = 0;
+  slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
-    if(l && l->state_ == ACTIVE) {
-      FD_SET(l->fd_, set);
-      *max_fd = *max_fd > l->fd_ ? *max_fd : l->fd_;
+    if(l && l->state_ == ACTIVE && !l->poller_) {
+      int ret = poller_add(poller, l->fd_, listeners_events(poller), POLLER_LISTENER, l);
+      if(!ret)
+        l->poller_ = poller;
+      else if(!retval)
+        retval = ret;
     }
     tmp = tmp->next_;
   }
+
+  return retval;
 }
 
-int listeners_handle_accept(listeners_t* list, clients_t* clients, fd_set* set)
+// starts the health checks of the backends of all listeners
+void listeners_watch(listeners_t* list, health_t* health)
 {
   if(!list)
-    return -1;
+    return;
 
-  slist_element_t* tmp = list->first_;
+  slist_element_t* tmp = list->list_.first_;
   while(tmp) {
     listener_t* l = (listener_t*)tmp->data_;
-    if(l && FD_ISSET(l->fd_, set)) {
-      tcp_endpoint_t remote_addr;
-      remote_addr.len_ = sizeof(remote_addr.addr_);
-      int new_client = accept(l->fd_, (struct sockaddr *)&(remote_addr.addr_), &remote_addr.len_);
-      if(new_client == -1) {
-        log_printf(ERROR, "Error on accept(): %s", strerror(errno));
-        return -1;
-      }
-      char* rs = tcp_endpoint_to_string(remote_addr);
-      log_printf(INFO, "new client from %s (fd=%d)", rs ? rs:"(null)", new_client);
-      if(rs) free(rs);
-      FD_CLR(l->fd_, set);
+    if(l)
+      clients_target_watch(l->target_, health);
+    tmp = tmp->next_;
+  }
+}
 
-      clients_add(clients, new_client, l->remote_end_, l->source_end_);
+// updates the backends of all listeners with the results of the health checks
+void listeners_sync(listeners_t* list)
+{
+  if(!list)
+    return;
+
+  slist_element_t* tmp = list->list_.first_;
+  while(tmp) {
+    listener_t* l = (listener_t*)tmp->data_;
+    if(l)
+      clients_target_sync(l->target_);
+    tmp = tmp->next_;
+  }
+}
+
+void listeners_unregister(listeners_t* list)
+{
+  if(!list)
+    return;
+
+  slist_element_t* tmp = list->list_.first_;
+  while(tmp) {
+    listener_t* l = (listener_t*)tmp->data_;
+    if(l && l->poller_) {
+      poller_remove(l->poller_, l->fd_);
+      l->poller_ = NULL;
     }
     tmp = tmp->next_;
   }
+}
+
+#ifdef LISTENER_USE_TCP_INFO
+// for listening sockets tcpi_unacked holds the current length of the
+// accept queue and tcpi_sacked its limit
+static void listeners_check_queue(listener_t* l)
+{
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  if(getsockopt(l->fd_, IPPROTO_TCP, TCP_INFO, &info, &len))
+    return;
 
+  if(info.tcpi_unacked > l->queue_max_)
+    l->queue_max_ = info.tcpi_unacked;
+  if(info.tcpi_sacked && info.tcpi_unacked >= info.tcpi_sacked)
+    l->overflows_++;
+}
+#endif
+
+static void listeners_add_client(listener_t* l, clients_t* clients, int fd, tcp_endpoint_t* remote_addr)
+{
+  l->accepted_++;
+  char* rs = tcp_endpoint_to_string(*remote_addr);
+  log_printf(INFO, "new client from %s (fd=%d)", rs ? rs:"(null)", fd);
+  if(rs) free(rs);
+
+  clients_add(clients, fd, l->target_, remote_addr);
+}
+
+int listeners_handle_accept(listener_t* l, clients_t* clients, u_int32_t budget)
+{
+  if(!l)
+    return -1;
+
+#ifdef LISTENER_USE_TCP_INFO
+  listeners_check_queue(l);
+#endif
+
+  u_int32_t cnt;
+  for(cnt = 0; cnt < budget; ++cnt) {
+    tcp_endpoint_t remote_addr;
+    remote_addr.len_ = sizeof(remote_addr.addr_);
+#ifdef LISTENER_USE_ACCEPT4
+    int new_client = accept4(l->fd_, (struct sockaddr *)&(remote_addr.addr_), &remote_addr.len_, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int new_client = accept(l->fd_, (struct sockaddr *)&(remote_addr.addr_), &remote_addr.len_);
+    if(new_client >= 0)
+      fcntl(new_client, F_SETFD, FD_CLOEXEC);
+#endif
+    if(new_client == -1) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+        return 0;
+      log_printf(ERROR, "Error on accept(): %s", strerror(errno));
+      return -1;
+    }
+    listeners_add_client(l, clients, new_client, &remote_addr);
+  }
+
+  return 0;
+}
+
+// takes a connection accepted by the poller, fd is -errno if this failed
+int listeners_handle_accepted(listener_t* l, clients_t* clients, int fd)
+{
+  if(!l)
+    return -1;
+
+  if(fd < 0) {
+    if(fd == -EAGAIN || fd == -EWOULDBLOCK || fd == -EINTR || fd == -ECONNABORTED)
+      return 0;
+    log_printf(ERROR, "Error on accept(): %s", strerror(-fd));
+    return -1;
+  }
+
+#ifdef LISTENER_USE_TCP_INFO
+  if(!(l->accepted_ % LISTENER_QUEUE_SAMPLE))
+    listeners_check_queue(l);
+#endif
+
+  tcp_endpoint_t remote_addr;
+  remote_addr.len_ = sizeof(remote_addr.addr_);
+  if(getpeername(fd, (struct sockaddr *)&(remote_addr.addr_), &remote_addr.len_)) {
+    log_printf(INFO, "Error on getpeername(): %s, dropping client %d", strerror(errno), fd);
+    close(fd);
+    return 0;
+  }
+  listeners_add_client(l, clients, fd, &remote_addr);
   return 0;
 }
@@ -28,11 +28,14 @@
 #ifndef TCPPROXY_listener_h_INCLUDED
 #define TCPPROXY_listener_h_INCLUDED
 
-#include <sys/select.h>
+#include <time.h>
 
 #include "slist.h"
+#include "fd_table.h"
 #include "tcp.h"
 #include "clients.h"
+#include "poller.h"
+#include "config_store.h"
 
 enum listener_state_enum { NEW, ACTIVE, ZOMBIE };
 typedef enum listener_state_enum listener_state_t;
@@ -40,25 +43,47 @@ typedef enum listener_state_enum listener_state_t;
 typedef struct {
   int fd_;
   tcp_endpoint_t local_end_;
-  tcp_endpoint_t remote_end_;
-  tcp_endpoint_t source_end_;
+  clients_target_t* target_;
   listener_state_t state_;
+  int backlog_;
+  u_int64_t accepted_;
+  u_int64_t accepted_reported_;
+  u_int64_t overflows_;
+  u_int32_t queue_max_;
+  poller_t* poller_;
+  slist_element_t* element_;
 } listener_t;
 
 void listeners_delete_element(void* e);
 
-typedef slist_t listeners_t;
+typedef struct {
+  slist_t list_;
+  fd_table_t fds_;
+  int backlog_;
+  int reuseport_;
+  int cpu_;
+  const int* cpus_;
+  int cpus_cnt_;
+  time_t report_time_;
+  health_board_t* board_;
+} listeners_t;
 
-int listeners_init(listeners_t* list);
+int listeners_init(listeners_t* list, int backlog, int reuseport, health_board_t* board);
 void listeners_clear(listeners_t* list);
-int listeners_add(listeners_t* list, const char* laddr, resolv_type_t lrt, const char* lport, const char* raddr, resolv_type_t rrt, const char* rport, const char* saddr);
+void listeners_set_cpus(listeners_t* list, int cpu, const int* cpus, int cpus_cnt);
+int listeners_apply(listeners_t* list, const config_t* cfg);
 int listeners_update(listeners_t* list);
 void listeners_revert(listeners_t* list);
 void listeners_remove(listeners_t* list, int fd);
 listener_t* listeners_find(listeners_t* list, int fd);
+clients_target_t* listeners_target(void* list, const tcp_endpoint_t* local_end);
 void listeners_print(listeners_t* list);
 
-void listeners_read_fds(listeners_t* list, fd_set* set, int* max_fd);
-int listeners_handle_accept(listeners_t* list, clients_t* clients, fd_set* set);
+int listeners_register(listeners_t* list, poller_t* poller);
+void listeners_watch(listeners_t* list, health_t* health);
+void listeners_sync(listeners_t* list);
+void listeners_unregister(listeners_t* list);
+int listeners_handle_accept(listener_t* l, clients_t* clients, u_int32_t budget);
+int listeners_handle_accepted(listener_t* l, clients_t* clients, int fd);
 
 #endif
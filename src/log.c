@@ -181,6 +181,7 @@ void log_init()
 {
   stdlog.max_prio_ = 0;
   stdlog.targets_.first_ = NULL;
+  pthread_mutex_init(&stdlog.lock_, NULL);
 }
 
 void log_close()
@@ -214,14 +215,16 @@ void log_printf(log_prio_t prio, const char* fmt, ...)
   if(stdlog.max_prio_ < prio)
     return;
 
-  static char msg[MSG_LENGTH_MAX];
+  char msg[MSG_LENGTH_MAX];
   va_list args;
 
   va_start(args, fmt);
   vsnprintf(msg, MSG_LENGTH_MAX, fmt, args);
   va_end(args);
 
+  pthread_mutex_lock(&stdlog.lock_);
   log_targets_log(&stdlog.targets_, prio, msg);
+  pthread_mutex_unlock(&stdlog.lock_);
 }
 
 void log_print_hex_dump(log_prio_t prio, const uint8_t* buf, uint32_t len)
@@ -229,7 +232,7 @@ void log_print_hex_dump(log_prio_t prio, const uint8_t* buf, uint32_t len)
   if(stdlog.max_prio_ < prio)
     return;
 
-  static char msg[MSG_LENGTH_MAX];
+  char msg[MSG_LENGTH_MAX];
 
   if(!buf) {
     snprintf(msg, MSG_LENGTH_MAX, "(NULL)");
@@ -248,5 +251,7 @@ void log_print_hex_dump(log_prio_t prio, const uint8_t* buf, uint32_t len)
       ptr+=3;
     }
   }
+  pthread_mutex_lock(&stdlog.lock_);
   log_targets_log(&stdlog.targets_, prio, msg);
+  pthread_mutex_unlock(&stdlog.lock_);
 }
@@ -28,6 +28,8 @@
 #ifndef TCPPROXY_log_h_INCLUDED
 #define TCPPROXY_log_h_INCLUDED
 
+#include <pthread.h>
+
 #define MSG_LENGTH_MAX 1024
 
 enum log_prio_enum { ERROR = 1, WARNING = 2, NOTICE = 3,
@@ -69,6 +71,7 @@ void log_targets_clear(log_targets_t* targets);
 struct log_struct {
   log_prio_t max_prio_;
   log_targets_t targets_;
+  pthread_mutex_t lock_;
 };
 typedef struct log_struct log_t;
 
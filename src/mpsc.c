@@ -0,0 +1,79 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "datatypes.h"
+
+#include <stddef.h>
+
+#include "mpsc.h"
+
+// intrusive multi-producer single-consumer queue: producers only ever swap
+// the head pointer and link the previous head to the new node, the single
+// consumer follows the links starting at the tail. A node which has been
+// pushed but not linked yet appears as the end of the queue, mpsc_pop()
+// returns NULL in this case and the node shows up on the next call.
+
+void mpsc_init(mpsc_queue_t* q)
+{
+  atomic_store_explicit(&q->stub_.next_, NULL, memory_order_relaxed);
+  atomic_store_explicit(&q->head_, &q->stub_, memory_order_relaxed);
+  q->tail_ = &q->stub_;
+}
+
+void mpsc_push(mpsc_queue_t* q, mpsc_node_t* n)
+{
+  atomic_store_explicit(&n->next_, NULL, memory_order_relaxed);
+  mpsc_node_t* prev = atomic_exchange_explicit(&q->head_, n, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next_, n, memory_order_release);
+}
+
+mpsc_node_t* mpsc_pop(mpsc_queue_t* q)
+{
+  mpsc_node_t* tail = q->tail_;
+  mpsc_node_t* next = atomic_load_explicit(&tail->next_, memory_order_acquire);
+  if(tail == &q->stub_) {
+    if(!next)
+      return NULL;
+    q->tail_ = next;
+    tail = next;
+    next = atomic_load_explicit(&next->next_, memory_order_acquire);
+  }
+  if(next) {
+    q->tail_ = next;
+    return tail;
+  }
+  if(tail != atomic_load_explicit(&q->head_, memory_order_acquire))
+    return NULL;
+
+  mpsc_push(q, &q->stub_);
+  next = atomic_load_explicit(&tail->next_, memory_order_acquire);
+  if(next) {
+    q->tail_ = next;
+    return tail;
+  }
+  return NULL;
+}
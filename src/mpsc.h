@@ -0,0 +1,49 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_mpsc_h_INCLUDED
+#define TCPPROXY_mpsc_h_INCLUDED
+
+#include <stdatomic.h>
+
+struct mpsc_node_struct {
+  struct mpsc_node_struct* _Atomic next_;
+};
+typedef struct mpsc_node_struct mpsc_node_t;
+
+struct mpsc_queue_struct {
+  mpsc_node_t* _Atomic head_;
+  mpsc_node_t* tail_;
+  mpsc_node_t stub_;
+};
+typedef struct mpsc_queue_struct mpsc_queue_t;
+
+void mpsc_init(mpsc_queue_t* q);
+void mpsc_push(mpsc_queue_t* q, mpsc_node_t* n);
+mpsc_node_t* mpsc_pop(mpsc_queue_t* q);
+
+#endif
@@ -133,6 +133,24 @@
       i++;                                               \
     }
 
+#define PARSE_IO_ENGINE(SHORT, LONG, VALUE)              \
+    else if(!strcmp(str,SHORT) || !strcmp(str,LONG))     \
+    {                                                    \
+      if(argc < 1 || argv[i+1][0] == '-')                \
+        return i;                                        \
+      if(!strcmp(argv[i+1], "select"))                   \
+        VALUE = POLLER_BACKEND_SELECT;                   \
+      else if(!strcmp(argv[i+1], "epoll"))               \
+        VALUE = POLLER_BACKEND_EPOLL;                    \
+      else if(!strcmp(argv[i+1], "io_uring") ||          \
+              !strcmp(argv[i+1], "uring"))               \
+        VALUE = POLLER_BACKEND_URING;                    \
+      else                                               \
+        return i+1;                                      \
+      argc--;                                            \
+      i++;                                               \
+    }
+
 int options_parse_hex_string(const char* hex, buffer_t* buffer)
 {
   if(!hex || !buffer)
@@ -206,6 +224,23 @@ int options_parse(options_t* opt, int argc, char* argv[])
     PARSE_STRING_PARAM("-s","--source-addr", opt->source_addr_)
     PARSE_STRING_PARAM("-c","--config", opt->config_file_)
     PARSE_INT_PARAM("-b","--buffer-size", opt->buffer_size_)
+    PARSE_BOOL_PARAM("-z","--splice", opt->splice_)
+    PARSE_BOOL_PARAM("-H","--hugepages", opt->hugepages_)
+    PARSE_BOOL_PARAM("-y","--lazy-buffers", opt->lazy_buffers_)
+    PARSE_INT_PARAM("-T","--cut-through", opt->cut_through_)
+    PARSE_INT_PARAM("-m","--max-connections", opt->max_connections_)
+    PARSE_INT_PARAM("-k","--listen-backlog", opt->listen_backlog_)
+    PARSE_INT_PARAM("-a","--accept-budget", opt->accept_budget_)
+    PARSE_IO_ENGINE("-e","--io-engine", opt->io_engine_)
+    PARSE_INT_PARAM("-n","--threads", opt->threads_)
+    PARSE_BOOL_PARAM("-A","--cpu-affinity", opt->cpu_affinity_)
+    PARSE_INT_PARAM("-B","--rebalance", opt->rebalance_)
+    PARSE_INT_PARAM("-j","--resolv-jobs", opt->resolv_jobs_)
+    PARSE_STRING_PARAM("-S","--resolv-cache", opt->resolv_cache_)
+    PARSE_INT_PARAM("-F","--resolv-refresh", opt->resolv_refresh_)
+    PARSE_INT_PARAM("-O","--connect-timeout", opt->connect_timeout_)
+    PARSE_INT_PARAM("-i","--idle-timeout", opt->idle_timeout_)
+    PARSE_INT_PARAM("-M","--max-lifetime", opt->max_lifetime_)
     else
       return i;
   }
@@ -242,6 +277,62 @@ void options_parse_post(options_t* opt)
     log_printf(WARNING, "illegal buffer size %d using default buffer size", opt->buffer_size_);
     opt->buffer_size_ = 10 * 1024;
   }
+
+  if(opt->cut_through_ < 0) {
+    log_printf(WARNING, "illegal cut-through budget %d, disabling cut-through", opt->cut_through_);
+    opt->cut_through_ = 0;
+  }
+
+  if(opt->max_connections_ < 0) {
+    log_printf(WARNING, "illegal maximum number of connections %d, not limiting connections", opt->max_connections_);
+    opt->max_connections_ = 0;
+  }
+
+  if(opt->threads_ <= 0) {
+    log_printf(WARNING, "illegal number of threads %d, using a single thread", opt->threads_);
+    opt->threads_ = 1;
+  }
+#ifndef SO_REUSEPORT
+  if(opt->threads_ > 1) {
+    log_printf(WARNING, "SO_REUSEPORT is not supported on this platform, using a single thread");
+    opt->threads_ = 1;
+  }
+#endif
+
+  if(opt->rebalance_ < 0) {
+    log_printf(WARNING, "illegal rebalance interval %d, disabling rebalancing", opt->rebalance_);
+    opt->rebalance_ = 0;
+  }
+  if(opt->resolv_jobs_ <= 0) {
+    log_printf(WARNING, "illegal number of resolver jobs %d, resolving one address at a time", opt->resolv_jobs_);
+    opt->resolv_jobs_ = 1;
+  }
+  if(opt->resolv_refresh_ < 0) {
+    log_printf(WARNING, "illegal maximum TTL %d, disabling the refresh of addresses", opt->resolv_refresh_);
+    opt->resolv_refresh_ = 0;
+  }
+  if(opt->connect_timeout_ < 0) {
+    log_printf(WARNING, "illegal connect timeout %d, disabling it", opt->connect_timeout_);
+    opt->connect_timeout_ = 0;
+  }
+  if(opt->idle_timeout_ < 0) {
+    log_printf(WARNING, "illegal idle timeout %d, disabling it", opt->idle_timeout_);
+    opt->idle_timeout_ = 0;
+  }
+  if(opt->max_lifetime_ < 0) {
+    log_printf(WARNING, "illegal maximum lifetime %d, disabling it", opt->max_lifetime_);
+    opt->max_lifetime_ = 0;
+  }
+
+  if(opt->listen_backlog_ <= 0) {
+    log_printf(WARNING, "illegal listen backlog %d, using default backlog", opt->listen_backlog_);
+    opt->listen_backlog_ = SOMAXCONN;
+  }
+
+  if(opt->accept_budget_ <= 0) {
+    log_printf(WARNING, "illegal accept budget %d, using default budget", opt->accept_budget_);
+    opt->accept_budget_ = 64;
+  }
 }
 
 void options_default(options_t* opt)
@@ -265,6 +356,23 @@ void options_default(options_t* opt)
   opt->config_file_ = NULL;
   string_list_init(&opt->log_targets_);
   opt->buffer_size_ = 10 * 1024;
+  opt->splice_ = 0;
+  opt->hugepages_ = 0;
+  opt->lazy_buffers_ = 0;
+  opt->cut_through_ = 64 * 1024;
+  opt->max_connections_ = 0;
+  opt->listen_backlog_ = SOMAXCONN;
+  opt->accept_budget_ = 64;
+  opt->io_engine_ = POLLER_BACKEND_DEFAULT;
+  opt->threads_ = 1;
+  opt->cpu_affinity_ = 0;
+  opt->rebalance_ = 0;
+  opt->resolv_jobs_ = 16;
+  opt->resolv_cache_ = NULL;
+  opt->resolv_refresh_ = 0;
+  opt->connect_timeout_ = 0;
+  opt->idle_timeout_ = 0;
+  opt->max_lifetime_ = 0;
   opt->debug_ = 0;
 }
 
@@ -296,6 +404,8 @@ void options_clear(options_t* opt)
     free(opt->source_addr_);
   if(opt->config_file_)
     free(opt->config_file_);
+  if(opt->resolv_cache_)
+    free(opt->resolv_cache_);
 }
 
 void options_print_usage()
@@ -319,6 +429,24 @@ void options_print_usage()
   printf("         [-o|--remote-port] <service>         remote port to connect to\n");
   printf("         [-s|--source-addr] <host>            source address to connect from\n");
   printf("         [-b|--buffer-size] <size>            size of transmit buffers\n");
+  printf("         [-z|--splice]                        relay data through kernel pipes instead of transmit buffers\n");
+  printf("         [-H|--hugepages]                     back transmit buffers with huge pages\n");
+  printf("         [-y|--lazy-buffers]                  only hold transmit buffers while data is in flight\n");
+  printf("         [-T|--cut-through] <bytes>           bytes to forward right away per read event, 0 to disable\n");
+  printf("         [-m|--max-connections] <num>         maximum number of concurrent client connections\n");
+  printf("         [-k|--listen-backlog] <num>          length of the queue for pending connections\n");
+  printf("         [-a|--accept-budget] <num>           maximum number of connections accepted at once\n");
+  printf("         [-e|--io-engine] (select|epoll|io_uring)\n");
+  printf("                                              event notification mechanism to use\n");
+  printf("         [-n|--threads] <num>                 number of worker threads\n");
+  printf("         [-A|--cpu-affinity]                  pin worker threads to CPUs and steer connections to them\n");
+  printf("         [-B|--rebalance] <ms>                interval to move connections between workers, 0 to disable\n");
+  printf("         [-j|--resolv-jobs] <num>             number of addresses to resolve in parallel\n");
+  printf("         [-S|--resolv-cache] <file>           keep resolved addresses in this file to start without DNS\n");
+  printf("         [-F|--resolv-refresh] <s>            resolve remote host names again after their TTL, at most after <s> seconds\n");
+  printf("         [-O|--connect-timeout] <s>           give up connecting to the remote host after <s> seconds\n");
+  printf("         [-i|--idle-timeout] <s>              close connections without any traffic for <s> seconds\n");
+  printf("         [-M|--max-lifetime] <s>              close connections after <s> seconds\n");
   printf("         [-c|--config] <file>                 configuration file\n");
 }
 
@@ -359,6 +487,23 @@ void options_print(options_t* opt)
   printf("remote_port: '%s'\n", opt->remote_port_);
   printf("source_addr: '%s'\n", opt->source_addr_);
   printf("buffer-size: %d\n", opt->buffer_size_);
+  printf("splice: %s\n", !opt->splice_ ? "false" : "true");
+  printf("hugepages: %s\n", !opt->hugepages_ ? "false" : "true");
+  printf("lazy-buffers: %s\n", !opt->lazy_buffers_ ? "false" : "true");
+  printf("cut-through: %d\n", opt->cut_through_);
+  printf("max-connections: %d\n", opt->max_connections_);
+  printf("listen-backlog: %d\n", opt->listen_backlog_);
+  printf("accept-budget: %d\n", opt->accept_budget_);
+  printf("io-engine: %s\n", poller_backend_to_string(opt->io_engine_));
+  printf("threads: %d\n", opt->threads_);
+  printf("cpu-affinity: %s\n", !opt->cpu_affinity_ ? "false" : "true");
+  printf("rebalance: %d\n", opt->rebalance_);
+  printf("resolv-jobs: %d\n", opt->resolv_jobs_);
+  printf("resolv-cache: '%s'\n", opt->resolv_cache_);
+  printf("resolv-refresh: %d\n", opt->resolv_refresh_);
+  printf("connect-timeout: %d\n", opt->connect_timeout_);
+  printf("idle-timeout: %d\n", opt->idle_timeout_);
+  printf("max-lifetime: %d\n", opt->max_lifetime_);
   printf("config_file: '%s'\n", opt->config_file_);
   printf("debug: %s\n", !opt->debug_ ? "false" : "true");
 }
@@ -31,6 +31,7 @@
 #include "string_list.h"
 #include "datatypes.h"
 #include "tcp.h"
+#include "poller.h"
 
 struct options_struct {
   char* progname_;
@@ -49,6 +50,23 @@ struct options_struct {
   char* source_addr_;
   char* config_file_;
   int32_t buffer_size_;
+  int splice_;
+  int hugepages_;
+  int lazy_buffers_;
+  int32_t cut_through_;
+  int32_t max_connections_;
+  int32_t listen_backlog_;
+  int32_t accept_budget_;
+  poller_backend_t io_engine_;
+  int32_t threads_;
+  int cpu_affinity_;
+  int32_t rebalance_;
+  int32_t resolv_jobs_;
+  char* resolv_cache_;
+  int32_t resolv_refresh_;
+  int32_t connect_timeout_;
+  int32_t idle_timeout_;
+  int32_t max_lifetime_;
   int debug_;
 };
 typedef struct options_struct options_t;
@@ -0,0 +1,899 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "datatypes.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "poller.h"
+#include "log.h"
+
+#ifdef POLLER_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef POLLER_USE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// accepting, receiving and sending through the ring needs the interface of
+// Linux 6.0, with older headers only the one-shot polls are used
+#if defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_RSRC_REGISTER_SPARSE) && defined(IORING_SETUP_SINGLE_ISSUER)
+#define POLLER_USE_URING_OPS
+#endif
+
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 1024
+#define URING_UD_IGNORE (~(u_int64_t)0)
+#define URING_GEN_MASK 0xFFFFFF
+
+// the user data of a request holds its kind, the fd and the generation of
+// the poll or the sequence number of the other requests of the fd
+enum uring_op_enum { URING_OP_POLL, URING_OP_ACCEPT, URING_OP_RECV, URING_OP_SEND };
+
+struct poller_uring_struct {
+  int fd_;
+  void* ring_;
+  size_t ring_len_;
+  struct io_uring_sqe* sqes_;
+  size_t sqes_len_;
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned sq_entries_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  struct io_uring_cqe* cqes_;
+  unsigned to_submit_;
+  int ops_;
+  u_int32_t buffers_;
+  int* dirty_;
+  int dirty_cnt_;
+  int dirty_len_;
+};
+#endif
+
+const char* poller_backend_to_string(poller_backend_t backend)
+{
+  switch(backend) {
+  case POLLER_BACKEND_DEFAULT: return "default";
+  case POLLER_BACKEND_SELECT: return "select";
+  case POLLER_BACKEND_EPOLL: return "epoll";
+  case POLLER_BACKEND_URING: return "io_uring";
+  }
+  return "unknown";
+}
+
+#ifdef POLLER_USE_URING
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t argsz)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_clear(struct poller_uring_struct* u)
+{
+  if(!u)
+    return;
+
+  if(u->sqes_)
+    munmap(u->sqes_, u->sqes_len_);
+  if(u->ring_)
+    munmap(u->ring_, u->ring_len_);
+  if(u->fd_ >= 0)
+    close(u->fd_);
+  if(u->dirty_)
+    free(u->dirty_);
+  free(u);
+}
+
+static struct poller_uring_struct* uring_init()
+{
+  struct poller_uring_struct* u = malloc(sizeof(struct poller_uring_struct));
+  if(!u)
+    return NULL;
+  memset(u, 0, sizeof(struct poller_uring_struct));
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  u->fd_ = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if(u->fd_ < 0) {
+    log_printf(WARNING, "Error on io_uring_setup(): %s", strerror(errno));
+    uring_clear(u);
+    return NULL;
+  }
+
+  // we rely on a single ring mapping, on never loosing completions
+  // and on waiting with a timeout without an extra timeout request
+  unsigned feat = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  if((params.features & feat) != feat) {
+    log_printf(WARNING, "io_uring of this kernel lacks required features");
+    uring_clear(u);
+    return NULL;
+  }
+
+  size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  u->ring_len_ = sq_len > cq_len ? sq_len : cq_len;
+  u->ring_ = mmap(NULL, u->ring_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd_, IORING_OFF_SQ_RING);
+  if(u->ring_ == MAP_FAILED) {
+    log_printf(WARNING, "Error on mmap() of io_uring: %s", strerror(errno));
+    u->ring_ = NULL;
+    uring_clear(u);
+    return NULL;
+  }
+  u->sqes_len_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes_ = mmap(NULL, u->sqes_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd_, IORING_OFF_SQES);
+  if(u->sqes_ == MAP_FAILED) {
+    log_printf(WARNING, "Error on mmap() of io_uring: %s", strerror(errno));
+    u->sqes_ = NULL;
+    uring_clear(u);
+    return NULL;
+  }
+
+  char* ring = (char*)u->ring_;
+  u->sq_head_ = (unsigned*)(ring + params.sq_off.head);
+  u->sq_tail_ = (unsigned*)(ring + params.sq_off.tail);
+  u->sq_mask_ = (unsigned*)(ring + params.sq_off.ring_mask);
+  u->sq_array_ = (unsigned*)(ring + params.sq_off.array);
+  u->sq_entries_ = params.sq_entries;
+  u->cq_head_ = (unsigned*)(ring + params.cq_off.head);
+  u->cq_tail_ = (unsigned*)(ring + params.cq_off.tail);
+  u->cq_mask_ = (unsigned*)(ring + params.cq_off.ring_mask);
+  u->cqes_ = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+#ifdef POLLER_USE_URING_OPS
+  // synchronous cancelation came with 6.0 like the rest of what is needed
+  // for the other requests, probing it with an invalid fd fails with EBADF
+  // instead of EINVAL if it is there. The buffers are registered as the
+  // buffer pool grows.
+  struct io_uring_sync_cancel_reg cancel;
+  memset(&cancel, 0, sizeof(cancel));
+  cancel.fd = -1;
+  cancel.flags = IORING_ASYNC_CANCEL_FD;
+  if(uring_register(u->fd_, IORING_REGISTER_SYNC_CANCEL, &cancel, 1) < 0 && errno == EBADF) {
+    u->ops_ = 1;
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = URING_BUFFERS;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if(!uring_register(u->fd_, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)))
+      u->buffers_ = URING_BUFFERS;
+    else
+      log_printf(INFO, "unable to register buffers with io_uring: %s", strerror(errno));
+  }
+#endif
+
+  return u;
+}
+
+static int uring_submit(struct poller_uring_struct* u)
+{
+  while(u->to_submit_) {
+    int ret = uring_enter(u->fd_, u->to_submit_, 0, 0, NULL, 0);
+    if(ret < 0) {
+      if(errno == EINTR)
+        continue;
+      log_printf(ERROR, "Error on io_uring_enter(): %s", strerror(errno));
+      return -1;
+    }
+    u->to_submit_ -= ret;
+  }
+  return 0;
+}
+
+// the returned entry is already queued, it is submitted together with the
+// next wait so it must be filled in right away
+static struct io_uring_sqe* uring_get_sqe(struct poller_uring_struct* u)
+{
+  unsigned tail = *(u->sq_tail_);
+  if(tail - __atomic_load_n(u->sq_head_, __ATOMIC_ACQUIRE) >= u->sq_entries_) {
+    if(uring_submit(u))
+      return NULL;
+  }
+
+  unsigned idx = tail & *(u->sq_mask_);
+  struct io_uring_sqe* sqe = &(u->sqes_[idx]);
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  u->sq_array_[idx] = idx;
+  __atomic_store_n(u->sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  u->to_submit_++;
+  return sqe;
+}
+
+static int uring_push(struct poller_uring_struct* u, u_int8_t opcode, int fd, int events, u_int64_t addr, u_int64_t user_data)
+{
+  struct io_uring_sqe* sqe = uring_get_sqe(u);
+  if(!sqe)
+    return -1;
+
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = addr;
+  u_int32_t mask = ((events & POLLER_READ) ? POLLIN : 0) | ((events & POLLER_WRITE) ? POLLOUT : 0);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  mask = (mask << 16) | (mask >> 16);
+#endif
+  sqe->poll32_events = mask;
+  sqe->user_data = user_data;
+  return 0;
+}
+
+static inline u_int64_t uring_user_data(int op, int fd, u_int32_t gen)
+{
+  return ((u_int64_t)op << 56) | ((u_int64_t)(gen & URING_GEN_MASK) << 32) | (u_int32_t)fd;
+}
+
+static void uring_mark_dirty(poller_t* p, int fd)
+{
+  struct poller_uring_struct* u = p->uring_;
+  poller_entry_t* e = &(p->entries_[fd]);
+  if(e->dirty_)
+    return;
+
+  if(u->dirty_cnt_ >= u->dirty_len_) {
+    int len = u->dirty_len_ ? u->dirty_len_ * 2 : 256;
+    int* dirty = realloc(u->dirty_, len * sizeof(int));
+    if(!dirty) {
+      log_printf(ERROR, "memory error on io_uring dirty list, fd %d will not be watched", fd);
+      return;
+    }
+    u->dirty_ = dirty;
+    u->dirty_len_ = len;
+  }
+  u->dirty_[u->dirty_cnt_++] = fd;
+  e->dirty_ = 1;
+}
+
+static void uring_disarm(poller_t* p, int fd)
+{
+  poller_entry_t* e = &(p->entries_[fd]);
+  if(!e->armed_)
+    return;
+
+  uring_push(p->uring_, IORING_OP_POLL_REMOVE, -1, 0, uring_user_data(URING_OP_POLL, fd, e->gen_), URING_UD_IGNORE);
+  e->gen_++;
+  e->armed_ = 0;
+}
+
+#ifdef POLLER_USE_URING_OPS
+// a multishot accept keeps delivering connections until it fails, it is
+// armed again with the next wait afterwards
+static void uring_accept(poller_t* p, int fd)
+{
+  poller_entry_t* e = &(p->entries_[fd]);
+  struct io_uring_sqe* sqe = uring_get_sqe(p->uring_);
+  if(!sqe)
+    return;
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = uring_user_data(URING_OP_ACCEPT, fd, e->seq_);
+  e->accepting_ = 1;
+  e->pending_++;
+}
+
+// requests in flight would keep using their buffers or keep accepting
+// connections after the fd got closed, so they are canceled and waited for
+// before the fd is given up. Their completions are ignored afterwards as the
+// sequence number of the fd has changed.
+static void uring_cancel(poller_t* p, int fd)
+{
+  struct poller_uring_struct* u = p->uring_;
+  poller_entry_t* e = &(p->entries_[fd]);
+  e->seq_++;
+  if(!e->pending_)
+    return;
+
+  uring_submit(u);
+  struct io_uring_sync_cancel_reg cancel;
+  memset(&cancel, 0, sizeof(cancel));
+  cancel.fd = fd;
+  cancel.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  cancel.timeout.tv_sec = -1;
+  cancel.timeout.tv_nsec = -1;
+  int ret;
+  do {
+    ret = uring_register(u->fd_, IORING_REGISTER_SYNC_CANCEL, &cancel, 1);
+  } while(ret < 0 && errno == EINTR);
+  if(ret < 0 && errno != ENOENT)
+    log_printf(ERROR, "Error on canceling io_uring requests of fd %d: %s", fd, strerror(errno));
+  e->pending_ = 0;
+  e->accepting_ = 0;
+}
+
+static int uring_op(poller_t* p, int op, int fd, const void* buf, u_int32_t len, int buf_index)
+{
+  if(!poller_completions(p) || fd < 0 || fd >= p->entries_len_)
+    return -1;
+
+  poller_entry_t* e = &(p->entries_[fd]);
+  struct io_uring_sqe* sqe = uring_get_sqe(p->uring_);
+  if(!sqe)
+    return -1;
+
+  if(op == URING_OP_RECV)
+    sqe->opcode = buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+  else {
+    sqe->opcode = buf_index >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_SEND;
+    if(buf_index < 0)
+      sqe->msg_flags = MSG_NOSIGNAL;
+  }
+  sqe->fd = fd;
+  sqe->addr = (u_int64_t)(unsigned long)buf;
+  sqe->len = len;
+  if(buf_index >= 0)
+    sqe->buf_index = buf_index;
+  sqe->user_data = uring_user_data(op, fd, e->seq_);
+  e->pending_++;
+  return 0;
+}
+
+static void uring_complete(poller_t* p, int fd, int op, u_int32_t seq, int res, u_int32_t flags)
+{
+  poller_entry_t* e = &(p->entries_[fd]);
+  if((e->seq_ & URING_GEN_MASK) != seq) {
+    // connections accepted for a listener which is gone
+    if(op == URING_OP_ACCEPT && res >= 0)
+      close(res);
+    return;
+  }
+
+  if(!(flags & IORING_CQE_F_MORE)) {
+    e->pending_--;
+    if(op == URING_OP_ACCEPT) {
+      e->accepting_ = 0;
+      uring_mark_dirty(p, fd);
+    }
+  }
+
+  poller_event_t* ev = &(p->ready_[p->ready_cnt_++]);
+  ev->fd_ = fd;
+  ev->events_ = op == URING_OP_ACCEPT ? POLLER_ACCEPT : (op == URING_OP_RECV ? POLLER_RECV : POLLER_SEND);
+  ev->res_ = res;
+  ev->type_ = e->type_;
+  ev->data_ = e->data_;
+}
+#endif
+
+// io_uring polls are one-shot: this (re-)arms all fds whose interest has
+// changed or whose poll has completed since the last call, all of them get
+// submitted together with the next wait
+static void uring_sync(poller_t* p)
+{
+  struct poller_uring_struct* u = p->uring_;
+  int i;
+  for(i = 0; i < u->dirty_cnt_; ++i) {
+    int fd = u->dirty_[i];
+    poller_entry_t* e = &(p->entries_[fd]);
+    e->dirty_ = 0;
+    int events = e->type_ != POLLER_NONE ? e->events_ : 0;
+    int poll = events & (POLLER_READ | POLLER_WRITE);
+    if(e->armed_ && e->armed_ != poll)
+      uring_disarm(p, fd);
+    if(poll && !e->armed_) {
+      if(!uring_push(u, IORING_OP_POLL_ADD, fd, poll, 0, uring_user_data(URING_OP_POLL, fd, e->gen_)))
+        e->armed_ = poll;
+    }
+#ifdef POLLER_USE_URING_OPS
+    if((events & POLLER_ACCEPT) && !e->accepting_)
+      uring_accept(p, fd);
+#endif
+  }
+  u->dirty_cnt_ = 0;
+}
+#endif
+
+int poller_init(poller_t* p, poller_backend_t backend)
+{
+  if(!p)
+    return -1;
+
+  p->entries_ = NULL;
+  p->entries_len_ = 0;
+  p->max_fd_ = -1;
+  p->ready_cnt_ = 0;
+  p->fd_ = -1;
+  p->uring_ = NULL;
+
+  if(backend == POLLER_BACKEND_DEFAULT)
+    backend = POLLER_BACKEND_EPOLL;
+
+#ifdef POLLER_USE_URING
+  if(backend == POLLER_BACKEND_URING) {
+    p->uring_ = uring_init();
+    if(!p->uring_) {
+      log_printf(WARNING, "io_uring is not available, falling back to epoll");
+      backend = POLLER_BACKEND_EPOLL;
+    }
+  }
+#else
+  if(backend == POLLER_BACKEND_URING)
+    backend = POLLER_BACKEND_EPOLL;
+#endif
+#ifdef POLLER_USE_EPOLL
+  if(backend == POLLER_BACKEND_EPOLL) {
+    p->fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if(p->fd_ < 0) {
+      log_printf(ERROR, "Error on epoll_create1(): %s", strerror(errno));
+      return -1;
+    }
+  }
+#else
+  if(backend == POLLER_BACKEND_EPOLL)
+    backend = POLLER_BACKEND_SELECT;
+#endif
+  p->backend_ = backend;
+
+  p->ready_len_ = backend == POLLER_BACKEND_SELECT ? FD_SETSIZE : POLLER_MAX_EVENTS;
+  p->ready_ = malloc(p->ready_len_ * sizeof(poller_event_t));
+  if(!p->ready_) {
+    poller_clear(p);
+    return -2;
+  }
+
+  log_printf(INFO, "using %s for event notification", poller_backend_to_string(p->backend_));
+  if(poller_completions(p))
+    log_printf(INFO, "accepting, receiving and sending through io_uring");
+  return 0;
+}
+
+void poller_clear(poller_t* p)
+{
+  if(!p)
+    return;
+
+  if(p->fd_ >= 0)
+    close(p->fd_);
+  p->fd_ = -1;
+#ifdef POLLER_USE_URING
+  uring_clear(p->uring_);
+#endif
+  p->uring_ = NULL;
+  if(p->entries_)
+    free(p->entries_);
+  p->entries_ = NULL;
+  p->entries_len_ = 0;
+  p->max_fd_ = -1;
+  if(p->ready_)
+    free(p->ready_);
+  p->ready_ = NULL;
+  p->ready_cnt_ = 0;
+}
+
+static int poller_grow(poller_t* p, int fd)
+{
+  if(fd < p->entries_len_)
+    return 0;
+
+  int len = p->entries_len_ ? p->entries_len_ : 64;
+  while(len <= fd)
+    len *= 2;
+
+  poller_entry_t* entries = realloc(p->entries_, len * sizeof(poller_entry_t));
+  if(!entries)
+    return -2;
+
+  memset(&(entries[p->entries_len_]), 0, (len - p->entries_len_) * sizeof(poller_entry_t));
+  p->entries_ = entries;
+  p->entries_len_ = len;
+  return 0;
+}
+
+static int poller_ctl(poller_t* p, int fd, int old_events, int new_events)
+{
+#ifdef POLLER_USE_URING
+  if(p->backend_ == POLLER_BACKEND_URING) {
+    uring_mark_dirty(p, fd);
+    return 0;
+  }
+#endif
+#ifdef POLLER_USE_EPOLL
+  if(p->backend_ != POLLER_BACKEND_EPOLL || (!old_events && !new_events))
+    return 0;
+
+  // fds without any interest are not kept in the epoll set, otherwise
+  // EPOLLHUP/EPOLLERR would be reported over and over again
+  int op = EPOLL_CTL_MOD;
+  if(!old_events)
+    op = EPOLL_CTL_ADD;
+  else if(!new_events)
+    op = EPOLL_CTL_DEL;
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = ((new_events & POLLER_READ) ? EPOLLIN : 0) | ((new_events & POLLER_WRITE) ? EPOLLOUT : 0);
+  ev.data.fd = fd;
+  if(epoll_ctl(p->fd_, op, fd, &ev)) {
+    log_printf(ERROR, "Error on epoll_ctl(): %s", strerror(errno));
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+int poller_add(poller_t* p, int fd, int events, poller_type_t type, void* data)
+{
+  if(!p || fd < 0)
+    return -1;
+
+  if(p->backend_ == POLLER_BACKEND_SELECT && fd >= FD_SETSIZE) {
+    log_printf(ERROR, "unable to watch fd %d: exceeds FD_SETSIZE (%d)", fd, FD_SETSIZE);
+    return -1;
+  }
+
+  int ret = poller_grow(p, fd);
+  if(ret)
+    return ret;
+
+  poller_entry_t* e = &(p->entries_[fd]);
+  int old_events = e->type_ != POLLER_NONE ? e->events_ : 0;
+  ret = poller_ctl(p, fd, old_events, events);
+  if(ret)
+    return ret;
+
+  if(e->type_ != POLLER_NONE) {
+    int i;
+    for(i = 0; i < p->ready_cnt_; ++i) {
+      if(p->ready_[i].fd_ == fd) {
+        p->ready_[i].type_ = type;
+        p->ready_[i].data_ = data;
+      }
+    }
+  }
+  e->type_ = type;
+  e->events_ = events;
+  e->data_ = data;
+  if(fd > p->max_fd_)
+    p->max_fd_ = fd;
+
+  return 0;
+}
+
+int poller_mod(poller_t* p, int fd, int events)
+{
+  if(!p || fd < 0 || fd >= p->entries_len_ || p->entries_[fd].type_ == POLLER_NONE)
+    return -1;
+
+  poller_entry_t* e = &(p->entries_[fd]);
+  if(e->events_ == events)
+    return 0;
+
+  int ret = poller_ctl(p, fd, e->events_, events);
+  if(ret)
+    return ret;
+
+  e->events_ = events;
+  return 0;
+}
+
+void poller_remove(poller_t* p, int fd)
+{
+  if(!p || fd < 0 || fd >= p->entries_len_ || p->entries_[fd].type_ == POLLER_NONE)
+    return;
+
+  poller_entry_t* e = &(p->entries_[fd]);
+#ifdef POLLER_USE_URING
+  // the fd is about to be closed and its number may be reused right away,
+  // the pending poll must not be mistaken for one of the new file
+  if(p->backend_ == POLLER_BACKEND_URING) {
+    uring_disarm(p, fd);
+#ifdef POLLER_USE_URING_OPS
+    uring_cancel(p, fd);
+#endif
+  }
+  else
+#endif
+  poller_ctl(p, fd, e->events_, 0);
+  e->type_ = POLLER_NONE;
+  e->events_ = 0;
+  e->data_ = NULL;
+
+  // the fd number may get reused before the current batch of events
+  // is handled completely, drop all pending events for it
+  int i;
+  for(i = 0; i < p->ready_cnt_; ++i) {
+    if(p->ready_[i].fd_ == fd) {
+      if((p->ready_[i].events_ & POLLER_ACCEPT) && p->ready_[i].res_ >= 0)
+        close(p->ready_[i].res_);
+      p->ready_[i].events_ = 0;
+      p->ready_[i].type_ = POLLER_NONE;
+      p->ready_[i].data_ = NULL;
+    }
+  }
+}
+
+static void poller_add_ready(poller_t* p, int fd, int events)
+{
+  poller_entry_t* e = &(p->entries_[fd]);
+  events &= e->events_;
+  if(!events || e->type_ == POLLER_NONE || p->ready_cnt_ >= p->ready_len_)
+    return;
+
+  poller_event_t* ev = &(p->ready_[p->ready_cnt_++]);
+  ev->fd_ = fd;
+  ev->events_ = events;
+  ev->res_ = 0;
+  ev->type_ = e->type_;
+  ev->data_ = e->data_;
+}
+
+#ifdef POLLER_USE_URING
+static int poller_wait_uring(poller_t* p, int timeout)
+{
+  struct poller_uring_struct* u = p->uring_;
+  uring_sync(p);
+
+  unsigned head = *(u->cq_head_);
+  if(head == __atomic_load_n(u->cq_tail_, __ATOMIC_ACQUIRE) && timeout) {
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if(timeout > 0) {
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000;
+      arg.ts = (u_int64_t)(unsigned long)&ts;
+    }
+    int ret = uring_enter(u->fd_, u->to_submit_, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if(ret < 0 && errno != ETIME)
+      return -1;
+    if(ret > 0)
+      u->to_submit_ -= ret;
+  }
+  else if(uring_submit(u))
+    return -1;
+
+  unsigned tail = __atomic_load_n(u->cq_tail_, __ATOMIC_ACQUIRE);
+  while(head != tail && p->ready_cnt_ < p->ready_len_) {
+    struct io_uring_cqe* cqe = &(u->cqes_[head & *(u->cq_mask_)]);
+    u_int64_t user_data = cqe->user_data;
+    int res = cqe->res;
+    head++;
+
+    if(user_data == URING_UD_IGNORE)
+      continue;
+    u_int32_t gen = (u_int32_t)(user_data >> 32) & URING_GEN_MASK;
+    int fd = (int)(user_data & 0xFFFFFFFF);
+    if(fd < 0 || fd >= p->entries_len_)
+      continue;
+#ifdef POLLER_USE_URING_OPS
+    int op = (int)(user_data >> 56);
+    if(op != URING_OP_POLL) {
+      uring_complete(p, fd, op, gen, res, cqe->flags);
+      continue;
+    }
+#endif
+    poller_entry_t* e = &(p->entries_[fd]);
+    if((e->gen_ & URING_GEN_MASK) != gen || !e->armed_)
+      continue;
+
+    e->armed_ = 0;
+    uring_mark_dirty(p, fd);
+    if(res < 0)
+      continue;
+
+    int events = 0;
+    if(res & (POLLIN | POLLPRI))
+      events |= POLLER_READ;
+    if(res & POLLOUT)
+      events |= POLLER_WRITE;
+    if(res & (POLLERR | POLLHUP))
+      events |= e->events_;
+    poller_add_ready(p, fd, events);
+  }
+  __atomic_store_n(u->cq_head_, head, __ATOMIC_RELEASE);
+
+  return p->ready_cnt_;
+}
+#endif
+
+#ifdef POLLER_USE_EPOLL
+static int poller_wait_epoll(poller_t* p, int timeout)
+{
+  struct epoll_event evs[POLLER_MAX_EVENTS];
+  int n = epoll_wait(p->fd_, evs, POLLER_MAX_EVENTS, timeout);
+  if(n < 0)
+    return -1;
+
+  int i;
+  for(i = 0; i < n; ++i) {
+    int fd = evs[i].data.fd;
+    if(fd < 0 || fd >= p->entries_len_)
+      continue;
+
+    int events = 0;
+    if(evs[i].events & EPOLLIN)
+      events |= POLLER_READ;
+    if(evs[i].events & EPOLLOUT)
+      events |= POLLER_WRITE;
+    if(evs[i].events & (EPOLLERR | EPOLLHUP))
+      events |= p->entries_[fd].events_;
+    poller_add_ready(p, fd, events);
+  }
+
+  return p->ready_cnt_;
+}
+#endif
+
+static int poller_wait_select(poller_t* p, int timeout)
+{
+  fd_set readfds, writefds;
+  FD_ZERO(&readfds);
+  FD_ZERO(&writefds);
+  int fd, nfds = -1;
+  for(fd = 0; fd <= p->max_fd_; ++fd) {
+    poller_entry_t* e = &(p->entries_[fd]);
+    if(e->type_ == POLLER_NONE || !e->events_)
+      continue;
+    if(e->events_ & POLLER_READ)
+      FD_SET(fd, &readfds);
+    if(e->events_ & POLLER_WRITE)
+      FD_SET(fd, &writefds);
+    nfds = fd;
+  }
+
+  struct timeval tv, *tvp = NULL;
+  if(timeout >= 0) {
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    tvp = &tv;
+  }
+
+  int n = select(nfds + 1, &readfds, &writefds, NULL, tvp);
+  if(n < 0)
+    return -1;
+
+  for(fd = 0; n > 0 && fd <= nfds; ++fd) {
+    int events = 0;
+    if(FD_ISSET(fd, &readfds))
+      events |= POLLER_READ;
+    if(FD_ISSET(fd, &writefds))
+      events |= POLLER_WRITE;
+    poller_add_ready(p, fd, events);
+  }
+
+  return p->ready_cnt_;
+}
+
+int poller_wait(poller_t* p, int timeout)
+{
+  if(!p)
+    return -1;
+
+  p->ready_cnt_ = 0;
+  switch(p->backend_) {
+#ifdef POLLER_USE_URING
+  case POLLER_BACKEND_URING: return poller_wait_uring(p, timeout);
+#endif
+#ifdef POLLER_USE_EPOLL
+  case POLLER_BACKEND_EPOLL: return poller_wait_epoll(p, timeout);
+#endif
+  default: return poller_wait_select(p, timeout);
+  }
+}
+
+// tells whether listeners may use POLLER_ACCEPT and clients poller_recv and
+// poller_send instead of waiting for readiness
+int poller_completions(poller_t* p)
+{
+#ifdef POLLER_USE_URING
+  return p && p->backend_ == POLLER_BACKEND_URING && p->uring_->ops_;
+#else
+  return 0;
+#endif
+}
+
+// makes the memory at addr usable as buffer idx of poller_recv and
+// poller_send, the caller must keep it mapped as long as the poller exists
+int poller_register_buffer(poller_t* p, u_int32_t idx, void* addr, size_t len)
+{
+#ifdef POLLER_USE_URING_OPS
+  if(!poller_completions(p) || idx >= p->uring_->buffers_)
+    return -1;
+
+  struct iovec iov;
+  iov.iov_base = addr;
+  iov.iov_len = len;
+  u_int64_t tag = 0;
+  struct io_uring_rsrc_update2 update;
+  memset(&update, 0, sizeof(update));
+  update.offset = idx;
+  update.data = (u_int64_t)(unsigned long)&iov;
+  update.tags = (u_int64_t)(unsigned long)&tag;
+  update.nr = 1;
+  if(uring_register(p->uring_->fd_, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) < 0) {
+    log_printf(INFO, "unable to register buffer with io_uring: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+// buf must lie within the registered buffer buf_index or buf_index must be
+// -1, the completion is reported as POLLER_RECV or POLLER_SEND event
+int poller_recv(poller_t* p, int fd, void* buf, u_int32_t len, int buf_index)
+{
+#ifdef POLLER_USE_URING_OPS
+  return uring_op(p, URING_OP_RECV, fd, buf, len, buf_index);
+#else
+  return -1;
+#endif
+}
+
+int poller_send(poller_t* p, int fd, const void* buf, u_int32_t len, int buf_index)
+{
+#ifdef POLLER_USE_URING_OPS
+  return uring_op(p, URING_OP_SEND, fd, buf, len, buf_index);
+#else
+  return -1;
+#endif
+}
+
+// unlike poller_remove this doesn't wait, the canceled requests complete
+// with -ECANCELED unless they finished before
+int poller_cancel(poller_t* p, int fd)
+{
+#ifdef POLLER_USE_URING_OPS
+  if(!poller_completions(p) || fd < 0 || fd >= p->entries_len_)
+    return -1;
+  if(!p->entries_[fd].pending_)
+    return 0;
+
+  struct io_uring_sqe* sqe = uring_get_sqe(p->uring_);
+  if(!sqe)
+    return -1;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = URING_UD_IGNORE;
+  return 0;
+#else
+  return -1;
+#endif
+}
@@ -0,0 +1,108 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_poller_h_INCLUDED
+#define TCPPROXY_poller_h_INCLUDED
+
+#include <sys/types.h>
+
+#if defined(__linux__)
+#define POLLER_USE_EPOLL
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define POLLER_USE_URING
+#endif
+#endif
+#endif
+
+#define POLLER_READ  0x01
+#define POLLER_WRITE 0x02
+// with io_uring listeners may be watched with POLLER_ACCEPT instead of
+// POLLER_READ, the events then carry the accepted connection in res_.
+// POLLER_RECV and POLLER_SEND report the completion of poller_recv and
+// poller_send with the number of bytes or -errno in res_.
+#define POLLER_ACCEPT 0x04
+#define POLLER_RECV   0x08
+#define POLLER_SEND   0x10
+
+#define POLLER_MAX_EVENTS 256
+
+enum poller_backend_enum { POLLER_BACKEND_DEFAULT, POLLER_BACKEND_SELECT, POLLER_BACKEND_EPOLL, POLLER_BACKEND_URING };
+typedef enum poller_backend_enum poller_backend_t;
+
+enum poller_type_enum { POLLER_NONE, POLLER_CONTROL, POLLER_LISTENER, POLLER_CLIENT, POLLER_CHECK };
+typedef enum poller_type_enum poller_type_t;
+
+typedef struct {
+  poller_type_t type_;
+  int events_;
+  void* data_;
+  int armed_;
+  int dirty_;
+  u_int32_t gen_;
+  u_int32_t seq_;
+  int pending_;
+  int accepting_;
+} poller_entry_t;
+
+typedef struct {
+  int fd_;
+  int events_;
+  int res_;
+  poller_type_t type_;
+  void* data_;
+} poller_event_t;
+
+struct poller_uring_struct;
+
+typedef struct {
+  poller_backend_t backend_;
+  int fd_;
+  struct poller_uring_struct* uring_;
+  poller_entry_t* entries_;
+  int entries_len_;
+  int max_fd_;
+  poller_event_t* ready_;
+  int ready_len_;
+  int ready_cnt_;
+} poller_t;
+
+const char* poller_backend_to_string(poller_backend_t backend);
+int poller_init(poller_t* p, poller_backend_t backend);
+void poller_clear(poller_t* p);
+int poller_add(poller_t* p, int fd, int events, poller_type_t type, void* data);
+int poller_mod(poller_t* p, int fd, int events);
+void poller_remove(poller_t* p, int fd);
+int poller_wait(poller_t* p, int timeout);
+
+int poller_completions(poller_t* p);
+int poller_register_buffer(poller_t* p, u_int32_t idx, void* addr, size_t len);
+int poller_recv(poller_t* p, int fd, void* buf, u_int32_t len, int buf_index);
+int poller_send(poller_t* p, int fd, const void* buf, u_int32_t len, int buf_index);
+int poller_cancel(poller_t* p, int fd);
+
+#endif
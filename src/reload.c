@@ -0,0 +1,227 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "datatypes.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "reload.h"
+#include "cfg_parser.h"
+#include "sig_handler.h"
+#include "log.h"
+
+// reading the config file and resolving all addresses is done by a
+// separate thread, the main thread keeps handling signals and only
+// publishes the result once the thread reports back through the pipe.
+// The same thread resolves the expired addresses of the current config
+// again, only one of these jobs runs at a time.
+
+static u_int64_t reload_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+config_t* reload_load(options_t* opt, int use_cache)
+{
+  config_t* cfg = config_new();
+  if(!cfg) {
+    log_printf(ERROR, "memory error on config allocation");
+    return NULL;
+  }
+
+  cfg->timeouts_.connect_ = opt->connect_timeout_;
+  cfg->timeouts_.idle_ = opt->idle_timeout_;
+  cfg->timeouts_.lifetime_ = opt->max_lifetime_;
+
+  int ret;
+  if(opt->local_port_) {
+    config_remote_t remote = { opt->remote_addr_, opt->remote_port_, 1 };
+    ret = config_add_listener(cfg, opt->local_addr_, opt->lresolv_type_, opt->local_port_, &remote, 1, opt->rresolv_type_, opt->source_addr_, 0, NULL,
+                              BALANCE_ROUND_ROBIN, NULL, NULL);
+  } else
+    ret = read_configfile(opt->config_file_, cfg);
+  resolver_set_ttl(&(cfg->resolver_), opt->resolv_refresh_);
+  if(!ret)
+    ret = config_resolve(cfg, opt->resolv_jobs_, opt->resolv_cache_, use_cache);
+  if(!ret && !opt->local_port_ && !slist_length(&(cfg->listeners_))) {
+    log_printf(ERROR, "no listeners defined in config file %s", opt->config_file_);
+    ret = -1;
+  }
+  if(ret) {
+    config_delete(cfg);
+    return NULL;
+  }
+  return cfg;
+}
+
+static void* reload_main(void* arg)
+{
+  reload_t* r = (reload_t*)arg;
+  if(r->base_)
+    r->result_ = config_refresh(r->base_, r->opt_->resolv_jobs_, r->opt_->resolv_cache_);
+  else
+    r->result_ = reload_load(r->opt_, 0);
+  char c = 0;
+  if(write(r->fds_[1], &c, 1) != 1)
+    log_printf(ERROR, "unable to report finished reload: %s", strerror(errno));
+  return NULL;
+}
+
+int reload_init(reload_t* r, options_t* opt)
+{
+  if(!r)
+    return -1;
+
+  r->opt_ = opt;
+  r->running_ = 0;
+  r->pending_ = 0;
+  r->result_ = NULL;
+  r->base_ = NULL;
+  r->started_ = 0;
+  r->duration_ = 0;
+  r->count_ = 0;
+  r->failed_ = 0;
+  if(pipe(r->fds_)) {
+    log_printf(ERROR, "Error on pipe(): %s", strerror(errno));
+    return -1;
+  }
+  fcntl(r->fds_[0], F_SETFL, O_NONBLOCK);
+  fcntl(r->fds_[0], F_SETFD, FD_CLOEXEC);
+  fcntl(r->fds_[1], F_SETFD, FD_CLOEXEC);
+  return 0;
+}
+
+void reload_clear(reload_t* r)
+{
+  if(!r)
+    return;
+
+  if(r->running_) {
+    pthread_join(r->thread_, NULL);
+    r->running_ = 0;
+  }
+  config_delete(r->result_);
+  r->result_ = NULL;
+  close(r->fds_[0]);
+  close(r->fds_[1]);
+}
+
+static int reload_spawn(reload_t* r)
+{
+  sigset_t oldset;
+  signal_block(&oldset);
+  int ret = pthread_create(&r->thread_, NULL, reload_main, r);
+  pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+  if(ret) {
+    log_printf(ERROR, "unable to start reload thread: %s", strerror(ret));
+    return -1;
+  }
+  r->running_ = 1;
+  return 0;
+}
+
+// starts reading the config file, if this is already in progress the file
+// is read once more as soon as the current run is finished
+int reload_start(reload_t* r)
+{
+  if(!r)
+    return -1;
+
+  if(r->running_) {
+    log_printf(NOTICE, "config update already in progress, reading the config file again afterwards");
+    r->pending_ = 1;
+    return 0;
+  }
+
+  r->pending_ = 0;
+  r->base_ = NULL;
+  r->started_ = reload_now();
+  return reload_spawn(r);
+}
+
+// resolves the expired addresses of base again, base must stay the current
+// config until the refresh is finished
+int reload_refresh(reload_t* r, config_t* base)
+{
+  if(!r || !base || r->running_)
+    return -1;
+
+  r->base_ = base;
+  if(reload_spawn(r)) {
+    r->base_ = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// collects the result of a finished reload, returns NULL if the new
+// config could not be loaded
+config_t* reload_finish(reload_t* r)
+{
+  if(!r)
+    return NULL;
+
+  char c;
+  if(read(r->fds_[0], &c, 1) != 1 || !r->running_)
+    return NULL;
+
+  pthread_join(r->thread_, NULL);
+  r->running_ = 0;
+  if(r->base_) {
+    r->base_ = NULL;
+    config_t* cfg = r->result_;
+    r->result_ = NULL;
+    return cfg;
+  }
+  r->duration_ = reload_now() - r->started_;
+  r->count_++;
+
+  config_t* cfg = r->result_;
+  r->result_ = NULL;
+  if(!cfg) {
+    r->failed_++;
+    log_printf(ERROR, "keeping the current configuration");
+  }
+  else
+    log_printf(NOTICE, "config file read in %llu ms", (unsigned long long)(r->duration_ / 1000000));
+  return cfg;
+}
+
+void reload_print(reload_t* r, u_int64_t version)
+{
+  if(!r)
+    return;
+
+  log_printf(NOTICE, "config version %llu: %u reloads, %u failed, last took %llu ms%s", (unsigned long long)version,
+             r->count_, r->failed_, (unsigned long long)(r->duration_ / 1000000), r->running_ ? ", reload in progress" : "");
+}
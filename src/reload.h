@@ -0,0 +1,59 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_reload_h_INCLUDED
+#define TCPPROXY_reload_h_INCLUDED
+
+#include <pthread.h>
+
+#include "options.h"
+#include "config_store.h"
+
+typedef struct {
+  options_t* opt_;
+  pthread_t thread_;
+  int running_;
+  int pending_;
+  int fds_[2];
+  config_t* result_;
+  config_t* base_;
+  u_int64_t started_;
+  u_int64_t duration_;
+  u_int32_t count_;
+  u_int32_t failed_;
+} reload_t;
+
+config_t* reload_load(options_t* opt, int use_cache);
+
+int reload_init(reload_t* r, options_t* opt);
+void reload_clear(reload_t* r);
+int reload_start(reload_t* r);
+int reload_refresh(reload_t* r, config_t* base);
+config_t* reload_finish(reload_t* r);
+void reload_print(reload_t* r, u_int64_t version);
+
+#endif
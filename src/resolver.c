@@ -0,0 +1,586 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "datatypes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef __linux__
+#include <arpa/nameser.h>
+#include <resolv.h>
+#define RESOLVER_USE_RES_QUERY
+#endif
+
+#include "resolver.h"
+#include "sig_handler.h"
+#include "log.h"
+
+// the queries are resolved by up to jobs threads at once, every thread
+// takes the next unresolved query until none are left. Duplicates are
+// found through a hash table with chaining which grows with the number of
+// queries.
+//
+// The results can be saved to a cache file which holds one line per
+// address: resolver type, passive flag, address and port as requested and
+// the resolved numeric address and port. '*' stands for no address or port.
+//
+// If a maximum TTL is set, the results of active queries for host names
+// expire. getaddrinfo() does not return the TTL of the records, it is
+// looked up separately with res_query() where this is available and
+// limited to the maximum TTL. The expiry times are only accessed by the
+// thread which resolves the queries.
+
+time_t resolver_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+void resolver_init(resolver_t* r)
+{
+  r->table_ = NULL;
+  r->table_size_ = 0;
+  r->queries_ = NULL;
+  r->cnt_ = 0;
+  r->max_ = 0;
+  r->lookups_ = 0;
+  r->cached_ = 0;
+  r->max_ttl_ = 0;
+  atomic_init(&r->next_, 0);
+}
+
+void resolver_clear(resolver_t* r)
+{
+  if(!r)
+    return;
+
+  u_int32_t i;
+  for(i = 0; i < r->cnt_; ++i) {
+    resolver_query_t* q = r->queries_[i];
+    if(q->addrs_)
+      free(q->addrs_);
+    if(q->addr_)
+      free(q->addr_);
+    if(q->port_)
+      free(q->port_);
+    free(q);
+  }
+  if(r->queries_)
+    free(r->queries_);
+  if(r->table_)
+    free(r->table_);
+  resolver_init(r);
+}
+
+// results of the queries which are added afterwards expire after at most
+// max_ttl seconds, 0 means they never expire
+void resolver_set_ttl(resolver_t* r, int max_ttl)
+{
+  if(r)
+    r->max_ttl_ = max_ttl > 0 ? max_ttl : 0;
+}
+
+static u_int32_t resolver_hash_string(u_int32_t h, const char* s)
+{
+  if(!s)
+    return (h ^ 0xff) * 16777619;
+  for(; *s; ++s)
+    h = (h ^ (unsigned char)*s) * 16777619;
+  return h * 16777619;
+}
+
+static int resolver_equal_string(const char* a, const char* b)
+{
+  if(!a || !b)
+    return a == b;
+  return !strcmp(a, b);
+}
+
+static u_int32_t resolver_hash(const char* addr, const char* port, resolv_type_t rt, int passive)
+{
+  u_int32_t h = resolver_hash_string(resolver_hash_string(2166136261u, addr), port);
+  return (h ^ (u_int32_t)(rt * 2 + (passive ? 1 : 0))) * 16777619;
+}
+
+static resolver_query_t* resolver_find(resolver_t* r, u_int32_t h, const char* addr, const char* port, resolv_type_t rt, int passive)
+{
+  if(!r->table_)
+    return NULL;
+
+  resolver_query_t* q = r->table_[h & (r->table_size_ - 1)];
+  for(; q; q = q->next_) {
+    if(q->hash_ == h && q->rt_ == rt && q->passive_ == passive &&
+       resolver_equal_string(q->addr_, addr) && resolver_equal_string(q->port_, port))
+      return q;
+  }
+  return NULL;
+}
+
+static int resolver_grow(resolver_t* r)
+{
+  u_int32_t size = r->table_size_ ? r->table_size_ * 2 : 64;
+  resolver_query_t** table = calloc(size, sizeof(resolver_query_t*));
+  if(!table)
+    return -2;
+
+  u_int32_t i;
+  for(i = 0; i < r->cnt_; ++i) {
+    resolver_query_t* q = r->queries_[i];
+    q->next_ = table[q->hash_ & (size - 1)];
+    table[q->hash_ & (size - 1)] = q;
+  }
+  if(r->table_)
+    free(r->table_);
+  r->table_ = table;
+  r->table_size_ = size;
+  return 0;
+}
+
+resolver_query_t* resolver_add(resolver_t* r, const char* addr, const char* port, resolv_type_t rt, int passive)
+{
+  if(!r)
+    return NULL;
+
+  r->lookups_++;
+  u_int32_t h = resolver_hash(addr, port, rt, passive);
+  resolver_query_t* q = resolver_find(r, h, addr, port, rt, passive);
+  if(q)
+    return q;
+
+  if(r->cnt_ >= r->max_) {
+    u_int32_t max = r->max_ ? r->max_ * 2 : 64;
+    resolver_query_t** queries = realloc(r->queries_, max * sizeof(resolver_query_t*));
+    if(!queries)
+      return NULL;
+    r->queries_ = queries;
+    r->max_ = max;
+  }
+  if(r->cnt_ * 2 >= r->table_size_ && resolver_grow(r))
+    return NULL;
+
+  q = malloc(sizeof(resolver_query_t));
+  if(!q)
+    return NULL;
+  q->addr_ = addr ? strdup(addr) : NULL;
+  q->port_ = port ? strdup(port) : NULL;
+  if((addr && !q->addr_) || (port && !q->port_)) {
+    if(q->addr_) free(q->addr_);
+    if(q->port_) free(q->port_);
+    free(q);
+    return NULL;
+  }
+  q->rt_ = rt;
+  q->passive_ = passive;
+  q->hash_ = h;
+  q->addrs_ = NULL;
+  q->addrs_cnt_ = 0;
+  q->expires_ = 0;
+  q->next_ = r->table_[h & (r->table_size_ - 1)];
+  r->table_[h & (r->table_size_ - 1)] = q;
+  r->queries_[r->cnt_++] = q;
+  return q;
+}
+
+static int resolver_append(resolver_query_t* q, const struct sockaddr* addr, socklen_t len)
+{
+  if(len > sizeof(struct sockaddr_storage))
+    return -1;
+
+  tcp_endpoint_t* addrs = realloc(q->addrs_, (q->addrs_cnt_ + 1) * sizeof(tcp_endpoint_t));
+  if(!addrs)
+    return -2;
+  q->addrs_ = addrs;
+  memset(&(addrs[q->addrs_cnt_]), 0, sizeof(tcp_endpoint_t));
+  memcpy(&(addrs[q->addrs_cnt_].addr_), addr, len);
+  addrs[q->addrs_cnt_].len_ = len;
+  q->addrs_cnt_++;
+  return 0;
+}
+
+static void resolver_set(resolver_query_t* q, struct addrinfo* res)
+{
+  for(; res; res = res->ai_next) {
+    if(resolver_append(q, res->ai_addr, res->ai_addrlen) == -2) {
+      log_printf(ERROR, "memory error while storing resolved addresses");
+      break;
+    }
+  }
+}
+
+// copies the results of src to dest which must hold the same queries
+int resolver_copy(resolver_t* dest, const resolver_t* src, int expiry_only)
+{
+  if(!dest || !src || dest->cnt_ != src->cnt_)
+    return -1;
+
+  u_int32_t i;
+  for(i = 0; i < src->cnt_; ++i) {
+    resolver_query_t* d = dest->queries_[i];
+    const resolver_query_t* q = src->queries_[i];
+    d->expires_ = q->expires_;
+    if(expiry_only || !q->addrs_)
+      continue;
+    tcp_endpoint_t* addrs = malloc(q->addrs_cnt_ * sizeof(tcp_endpoint_t));
+    if(!addrs)
+      return -2;
+    memcpy(addrs, q->addrs_, q->addrs_cnt_ * sizeof(tcp_endpoint_t));
+    if(d->addrs_)
+      free(d->addrs_);
+    d->addrs_ = addrs;
+    d->addrs_cnt_ = q->addrs_cnt_;
+  }
+  dest->cached_ = src->cached_;
+  return 0;
+}
+
+static int resolver_is_numeric(const char* addr)
+{
+  struct in6_addr buf;
+  return inet_pton(AF_INET, addr, &buf) == 1 || inet_pton(AF_INET6, addr, &buf) == 1;
+}
+
+#ifdef RESOLVER_USE_RES_QUERY
+static int resolver_lookup_ttl(const char* addr, int type)
+{
+  unsigned char answer[4096];
+  int len = res_query(addr, ns_c_in, type, answer, sizeof(answer));
+  ns_msg msg;
+  if(len < 0 || ns_initparse(answer, len, &msg))
+    return -1;
+
+  int i, ttl = -1;
+  for(i = 0; i < ns_msg_count(msg, ns_s_an); ++i) {
+    ns_rr rr;
+    if(ns_parserr(&msg, ns_s_an, i, &rr))
+      break;
+    if(ttl < 0 || ns_rr_ttl(rr) < (u_int32_t)ttl)
+      ttl = ns_rr_ttl(rr);
+  }
+  return ttl;
+}
+#endif
+
+static int resolver_ttl(resolver_t* r, resolver_query_t* q)
+{
+  int ttl = -1;
+#ifdef RESOLVER_USE_RES_QUERY
+  if(q->rt_ != IPV6_ONLY)
+    ttl = resolver_lookup_ttl(q->addr_, ns_t_a);
+  if(q->rt_ != IPV4_ONLY) {
+    int ttl6 = resolver_lookup_ttl(q->addr_, ns_t_aaaa);
+    if(ttl6 >= 0 && (ttl < 0 || ttl6 < ttl))
+      ttl = ttl6;
+  }
+#endif
+  if(ttl < 0 || ttl > r->max_ttl_)
+    ttl = r->max_ttl_;
+  return ttl < RESOLVER_MIN_TTL ? RESOLVER_MIN_TTL : ttl;
+}
+
+static void* resolver_main(void* arg)
+{
+  resolver_t* r = (resolver_t*)arg;
+  for(;;) {
+    u_int32_t i = atomic_fetch_add_explicit(&r->next_, 1, memory_order_relaxed);
+    if(i >= r->cnt_)
+      break;
+    resolver_query_t* q = r->queries_[i];
+    if(q->addrs_)
+      continue;
+    struct addrinfo* res = tcp_resolve_endpoint(q->addr_, q->port_, q->rt_, q->passive_);
+    if(res) {
+      resolver_set(q, res);
+      freeaddrinfo(res);
+      if(r->max_ttl_ && !q->passive_ && q->addr_ && !resolver_is_numeric(q->addr_))
+        q->expires_ = resolver_now() + resolver_ttl(r, q);
+    }
+  }
+  return NULL;
+}
+
+// resolves all queries which have no result yet, the calling thread takes
+// part in this. Returns the number of queries which could not be resolved.
+int resolver_run(resolver_t* r, int jobs)
+{
+  if(!r)
+    return -1;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  atomic_store(&r->next_, 0);
+
+  u_int32_t j, todo = 0;
+  for(j = 0; j < r->cnt_; ++j)
+    if(!r->queries_[j]->addrs_)
+      todo++;
+  if(jobs < 1)
+    jobs = 1;
+  if((u_int32_t)jobs > todo)
+    jobs = todo;
+
+  pthread_t threads[jobs > 1 ? jobs - 1 : 1];
+  int i, started = 0;
+  sigset_t oldset;
+  signal_block(&oldset);
+  for(i = 0; i < jobs - 1; ++i) {
+    int ret = pthread_create(&threads[started], NULL, resolver_main, r);
+    if(ret) {
+      log_printf(WARNING, "unable to start resolver thread: %s", strerror(ret));
+      break;
+    }
+    started++;
+  }
+  pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+  resolver_main(r);
+  for(i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+
+  int failed = 0;
+  for(j = 0; j < r->cnt_; ++j)
+    if(!r->queries_[j]->addrs_)
+      failed++;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long long ms = (end.tv_sec - start.tv_sec) * 1000LL + (end.tv_nsec - start.tv_nsec) / 1000000;
+  log_printf(INFO, "resolved %u addresses (%u requested, %u cached) using %d threads in %lld ms, %d failed", todo, r->lookups_, r->cached_, started + 1, ms, failed);
+  return failed;
+}
+
+// name servers may rotate the order of the records, only the sets of
+// addresses are compared
+static int resolver_same(const tcp_endpoint_t* a, u_int32_t a_cnt, const tcp_endpoint_t* b, u_int32_t b_cnt)
+{
+  if(a_cnt != b_cnt)
+    return 0;
+
+  u_int32_t i, j;
+  for(i = 0; i < a_cnt; ++i) {
+    for(j = 0; j < b_cnt; ++j)
+      if(a[i].len_ == b[j].len_ && !memcmp(&(a[i].addr_), &(b[j].addr_), a[i].len_))
+        break;
+    if(j == b_cnt)
+      return 0;
+  }
+  return 1;
+}
+
+// resolves all queries whose results have expired again. If a lookup fails
+// the old result is kept and the lookup is retried after a short time.
+// Returns the number of queries whose result has changed.
+int resolver_refresh(resolver_t* r, int jobs)
+{
+  if(!r || !r->cnt_)
+    return 0;
+
+  tcp_endpoint_t** old = calloc(r->cnt_, sizeof(tcp_endpoint_t*));
+  u_int32_t* old_cnt = calloc(r->cnt_, sizeof(u_int32_t));
+  if(!old || !old_cnt) {
+    if(old) free(old);
+    if(old_cnt) free(old_cnt);
+    return -2;
+  }
+
+  time_t now = resolver_now();
+  u_int32_t i;
+  for(i = 0; i < r->cnt_; ++i) {
+    resolver_query_t* q = r->queries_[i];
+    if(!q->expires_ || q->expires_ > now)
+      continue;
+    old[i] = q->addrs_;
+    old_cnt[i] = q->addrs_cnt_;
+    q->addrs_ = NULL;
+    q->addrs_cnt_ = 0;
+  }
+  r->cached_ = 0;
+  resolver_run(r, jobs);
+
+  int changed = 0;
+  for(i = 0; i < r->cnt_; ++i) {
+    resolver_query_t* q = r->queries_[i];
+    if(!old[i])
+      continue;
+    if(!q->addrs_) {
+      log_printf(WARNING, "keeping the previous addresses of %s for now", q->addr_);
+      q->addrs_ = old[i];
+      q->addrs_cnt_ = old_cnt[i];
+      q->expires_ = now + (r->max_ttl_ < RESOLVER_NEGATIVE_TTL ? r->max_ttl_ : RESOLVER_NEGATIVE_TTL);
+      continue;
+    }
+    if(!resolver_same(q->addrs_, q->addrs_cnt_, old[i], old_cnt[i])) {
+      log_printf(NOTICE, "addresses of %s have changed", q->addr_);
+      changed++;
+    }
+    free(old[i]);
+  }
+  free(old);
+  free(old_cnt);
+  return changed;
+}
+
+// returns the time the first result expires or 0 if none does
+time_t resolver_next_expiry(const resolver_t* r)
+{
+  time_t next = 0;
+  u_int32_t i;
+  for(i = 0; r && i < r->cnt_; ++i) {
+    time_t e = r->queries_[i]->expires_;
+    if(e && (!next || e < next))
+      next = e;
+  }
+  return next;
+}
+
+// fills in the results of all queries which are found in the cache file and
+// returns the number of queries which are still unresolved
+int resolver_load(resolver_t* r, const char* path)
+{
+  if(!r || !path)
+    return -1;
+
+  FILE* f = fopen(path, "r");
+  if(!f) {
+    log_printf(INFO, "unable to open resolver cache %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  char line[1024];
+  int lineno = 0;
+  while(fgets(line, sizeof(line), f)) {
+    lineno++;
+    if(line[0] == '#' || line[0] == '\n')
+      continue;
+
+    char addr[256], port[64], host[INET6_ADDRSTRLEN + 16], serv[8];
+    int rt, passive;
+    if(sscanf(line, "%d %d %255s %63s %61s %7s", &rt, &passive, addr, port, host, serv) != 6 || rt < ANY || rt > IPV6_ONLY) {
+      log_printf(WARNING, "ignoring malformed line %d of resolver cache %s", lineno, path);
+      continue;
+    }
+    const char* a = strcmp(addr, "*") ? addr : NULL;
+    const char* p = strcmp(port, "*") ? port : NULL;
+    resolver_query_t* q = resolver_find(r, resolver_hash(a, p, rt, passive), a, p, rt, passive);
+    if(!q)
+      continue;
+
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    if(getaddrinfo(host, serv, &hints, &res) || !res) {
+      log_printf(WARNING, "ignoring invalid address on line %d of resolver cache %s", lineno, path);
+      continue;
+    }
+    if(!q->addrs_)
+      r->cached_++;
+    resolver_set(q, res);
+    freeaddrinfo(res);
+    // cached addresses are looked up again soon, if this fails they are
+    // kept and retried like any other failed lookup
+    if(r->max_ttl_ && !q->passive_ && q->addr_ && !resolver_is_numeric(q->addr_))
+      q->expires_ = resolver_now() + (r->max_ttl_ < RESOLVER_NEGATIVE_TTL ? r->max_ttl_ : RESOLVER_NEGATIVE_TTL);
+  }
+  fclose(f);
+
+  int missing = 0;
+  u_int32_t i;
+  for(i = 0; i < r->cnt_; ++i)
+    if(!r->queries_[i]->addrs_)
+      missing++;
+  log_printf(INFO, "found %u of %u addresses in resolver cache %s", r->cached_, r->cnt_, path);
+  return missing;
+}
+
+// writes the results of all queries to a temporary file which then
+// replaces the cache file, readers see either the old or the new version
+int resolver_save(resolver_t* r, const char* path)
+{
+  if(!r || !path)
+    return -1;
+
+  // the temporary file gets a unique name next to the cache so nothing
+  // planted at a predictable path is followed and rename() stays atomic
+  char* tmp;
+  if(asprintf(&tmp, "%s.XXXXXX", path) < 0)
+    return -2;
+
+  int fd = mkstemp(tmp);
+  FILE* f = NULL;
+  if(fd >= 0) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fchmod(fd, 0644);
+    f = fdopen(fd, "w");
+  }
+  if(!f) {
+    log_printf(WARNING, "unable to write resolver cache %s: %s", path, strerror(errno));
+    if(fd >= 0) {
+      close(fd);
+      unlink(tmp);
+    }
+    free(tmp);
+    return -1;
+  }
+
+  fprintf(f, "# tcpproxy resolver cache\n");
+  u_int32_t i, j;
+  for(i = 0; i < r->cnt_; ++i) {
+    resolver_query_t* q = r->queries_[i];
+    for(j = 0; j < q->addrs_cnt_; ++j) {
+      char host[INET6_ADDRSTRLEN + 16], serv[8];
+      if(getnameinfo((struct sockaddr*)&(q->addrs_[j].addr_), q->addrs_[j].len_, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV))
+        continue;
+      fprintf(f, "%d %d %s %s %s %s\n", q->rt_, q->passive_, q->addr_ ? q->addr_ : "*", q->port_ ? q->port_ : "*", host, serv);
+    }
+  }
+
+  int ret = 0;
+  if(fflush(f) || fsync(fd))
+    ret = -1;
+  if(fclose(f))
+    ret = -1;
+  if(!ret && rename(tmp, path))
+    ret = -1;
+  if(ret) {
+    log_printf(WARNING, "unable to write resolver cache %s: %s", path, strerror(errno));
+    unlink(tmp);
+  }
+  else
+    log_printf(DEBUG, "resolver cache %s written", path);
+  free(tmp);
+  return ret;
+}
@@ -0,0 +1,78 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_resolver_h_INCLUDED
+#define TCPPROXY_resolver_h_INCLUDED
+
+#include <stdatomic.h>
+#include <time.h>
+
+#include "tcp.h"
+
+#define RESOLVER_MIN_TTL 1
+#define RESOLVER_NEGATIVE_TTL 5
+
+struct resolver_query_struct {
+  char* addr_;
+  char* port_;
+  resolv_type_t rt_;
+  int passive_;
+  u_int32_t hash_;
+  tcp_endpoint_t* addrs_;
+  u_int32_t addrs_cnt_;
+  time_t expires_;
+  struct resolver_query_struct* next_;
+};
+typedef struct resolver_query_struct resolver_query_t;
+
+// collects the addresses to resolve, identical queries are only added once
+typedef struct {
+  resolver_query_t** table_;
+  u_int32_t table_size_;
+  resolver_query_t** queries_;
+  u_int32_t cnt_;
+  u_int32_t max_;
+  u_int32_t lookups_;
+  u_int32_t cached_;
+  int max_ttl_;
+  _Atomic u_int32_t next_;
+} resolver_t;
+
+time_t resolver_now();
+
+void resolver_init(resolver_t* r);
+void resolver_clear(resolver_t* r);
+void resolver_set_ttl(resolver_t* r, int max_ttl);
+resolver_query_t* resolver_add(resolver_t* r, const char* addr, const char* port, resolv_type_t rt, int passive);
+int resolver_copy(resolver_t* dest, const resolver_t* src, int expiry_only);
+int resolver_run(resolver_t* r, int jobs);
+int resolver_refresh(resolver_t* r, int jobs);
+time_t resolver_next_expiry(const resolver_t* r);
+int resolver_load(resolver_t* r, const char* path);
+int resolver_save(resolver_t* r, const char* path);
+
+#endif
@@ -31,22 +31,22 @@
 #include "sig_handler.h"
 
 #include <signal.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 
+// the handler only ever writes the signal number to the pipe, this way it
+// never competes with signal_handle() over the read end of the pipe
 static int sig_pipe_fds[2];
 
 static void sig_handler(int sig)
 {
-  sigset_t set;
-  int ret = read(sig_pipe_fds[0], &set, sizeof(sigset_t));
-  if(ret != sizeof(sigset_t))
-    sigemptyset(&set);
-
-  sigaddset(&set, sig);
-  ret = write(sig_pipe_fds[1], &set, sizeof(sigset_t));
+  int saved_errno = errno;
+  unsigned char s = (unsigned char)sig;
+  if(write(sig_pipe_fds[1], &s, 1) < 0)
+    errno = saved_errno;
 }
 
 
@@ -96,20 +96,15 @@ int signal_init()
 
 int signal_handle()
 {
-  sigset_t set, oldset, tmpset;
-
-  sigemptyset(&tmpset);
-  sigaddset(&tmpset, SIGINT);
-  sigaddset(&tmpset, SIGQUIT);
-  sigaddset(&tmpset, SIGTERM);
-  sigaddset(&tmpset, SIGHUP);
-  sigaddset(&tmpset, SIGUSR1);
-  sigaddset(&tmpset, SIGUSR2);
-  sigprocmask(SIG_BLOCK, &tmpset, &oldset);
+  sigset_t set;
+  sigemptyset(&set);
 
-  int ret = read(sig_pipe_fds[0], &set, sizeof(sigset_t));
-  if(ret != sizeof(sigset_t))
-    sigemptyset(&set);
+  unsigned char buf[64];
+  int ret, i;
+  while((ret = read(sig_pipe_fds[0], buf, sizeof(buf))) > 0) {
+    for(i = 0; i < ret; ++i)
+      sigaddset(&set, buf[i]);
+  }
 
   int return_value = 0;
   int sig;
@@ -128,10 +123,22 @@ int signal_handle()
     }
   }
 
-  sigprocmask(SIG_SETMASK, &oldset, NULL);
   return return_value;
 }
 
+void signal_block(sigset_t* oldset)
+{
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGQUIT);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGHUP);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &set, oldset);
+}
+
 void signal_stop()
 {
   struct sigaction act;
@@ -28,8 +28,11 @@
 #ifndef TCPPROXY_sig_handler_h_INCLUDED
 #define TCPPROXY_sig_handler_h_INCLUDED
 
+#include <signal.h>
+
 int signal_init();
 int signal_handle();
+void signal_block(sigset_t* oldset);
 void signal_stop();
 
 #endif
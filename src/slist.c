@@ -50,26 +50,47 @@ int slist_init(slist_t* lst, void (*delete_element)(void*))
 
   lst->delete_element = delete_element;
   lst->first_ = NULL;
+  lst->last_ = NULL;
+  lst->length_ = 0;
+  lst->arena_ = NULL;
 
   return 0;
 }
 
+static slist_element_t* slist_alloc_element(slist_t* lst)
+{
+  if(lst->arena_)
+    return arena_alloc(lst->arena_);
+  return malloc(sizeof(slist_element_t));
+}
+
+static void slist_free_element(slist_t* lst, slist_element_t* element)
+{
+  if(lst->arena_)
+    arena_free(lst->arena_, element);
+  else
+    free(element);
+}
+
 slist_element_t* slist_add(slist_t* lst, void* data)
 {
   if(!lst || !data)
     return NULL;
 
-  slist_element_t* new_element = malloc(sizeof(slist_element_t));
+  slist_element_t* new_element = slist_alloc_element(lst);
   if(!new_element)
     return NULL;
 
   new_element->data_ = data;
   new_element->next_ = NULL;
+  new_element->prev_ = lst->last_;
 
   if(!lst->first_)
     lst->first_ = new_element;
   else
-    slist_get_last(lst->first_)->next_ = new_element;
+    lst->last_->next_ = new_element;
+  lst->last_ = new_element;
+  lst->length_++;
 
   return new_element;
 }
@@ -79,27 +100,34 @@ void slist_remove(slist_t* lst, void* data)
   if(!lst || !lst->first_ || !data)
     return;
 
-  slist_element_t* tmp = lst->first_->next_;
-  slist_element_t* prev = lst->first_;
-  if(lst->first_->data_ == data) {
-    lst->first_ = tmp;
-    lst->delete_element(prev->data_);
-    free(prev);
-  }
-  else {
-    while(tmp) {
-      if(tmp->data_ == data) {
-        prev->next_ = tmp->next_;
-        lst->delete_element(tmp->data_);
-        free(tmp);
-        return;
-      }
-      prev = tmp;
-      tmp = tmp->next_;
+  slist_element_t* tmp;
+  for(tmp = lst->first_; tmp; tmp = tmp->next_) {
+    if(tmp->data_ == data) {
+      slist_remove_element(lst, tmp);
+      return;
     }
   }
 }
 
+void slist_remove_element(slist_t* lst, slist_element_t* element)
+{
+  if(!lst || !element)
+    return;
+
+  if(element->prev_)
+    element->prev_->next_ = element->next_;
+  else
+    lst->first_ = element->next_;
+  if(element->next_)
+    element->next_->prev_ = element->prev_;
+  else
+    lst->last_ = element->prev_;
+  lst->length_--;
+
+  lst->delete_element(element->data_);
+  slist_free_element(lst, element);
+}
+
 void slist_clear(slist_t* lst)
 {
   if(!lst || !lst->first_)
@@ -109,22 +137,19 @@ void slist_clear(slist_t* lst)
     slist_element_t* deletee = lst->first_;
     lst->first_ = lst->first_->next_;
     lst->delete_element(deletee->data_);
-    free(deletee);
+    slist_free_element(lst, deletee);
   }
   while(lst->first_);
 
   lst->first_ = NULL;
+  lst->last_ = NULL;
+  lst->length_ = 0;
 }
 
 int slist_length(slist_t* lst)
 {
-  if(!lst || !lst->first_)
+  if(!lst)
     return 0;
 
-  int len = 0;
-  slist_element_t* tmp;
-  for(tmp = lst->first_; tmp; tmp = tmp->next_)
-    len++;
-
-  return len;
+  return lst->length_;
 }
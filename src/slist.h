@@ -28,9 +28,12 @@
 #ifndef TCPPROXY_slist_h_INCLUDED
 #define TCPPROXY_slist_h_INCLUDED
 
+#include "arena.h"
+
 struct slist_element_struct {
   void* data_;
   struct slist_element_struct* next_;
+  struct slist_element_struct* prev_;
 };
 typedef struct slist_element_struct slist_element_t;
 
@@ -39,12 +42,16 @@ slist_element_t* slist_get_last(slist_element_t* first);
 struct slist_struct {
   void (*delete_element)(void* element);
   slist_element_t* first_;
+  slist_element_t* last_;
+  int length_;
+  arena_t* arena_;
 };
 typedef struct slist_struct slist_t;
 
 int slist_init(slist_t* lst, void (*delete_element)(void*));
 slist_element_t* slist_add(slist_t* lst, void* data);
 void slist_remove(slist_t* lst, void* data);
+void slist_remove_element(slist_t* lst, slist_element_t* element);
 void slist_clear(slist_t* lst);
 int slist_length(slist_t* lst);
 
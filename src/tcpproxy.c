@@ -29,10 +29,11 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/select.h>
+#include <time.h>
 
 #include "datatypes.h"
 #include "options.h"
@@ -42,10 +43,33 @@
 #include "daemon.h"
 
 #include "listener.h"
-#include "clients.h"
-#include "cfg_parser.h"
+#include "config_store.h"
+#include "worker.h"
+#include "reload.h"
 
-int main_loop(options_t* opt, listeners_t* listeners)
+// a failed revalidation of cached addresses is retried after
+// RESOLVER_NEGATIVE_TTL seconds, doubling up to MAIN_REVALIDATE_MAX ms
+#define MAIN_REVALIDATE_MAX 300000
+
+static u_int64_t main_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// the workers only have to switch their listening sockets over to the new
+// config, it has been parsed and resolved by the reload thread
+static void publish_config(options_t* opt, config_store_t* configs, config_t* cfg, worker_t* workers)
+{
+  config_publish(configs, cfg);
+  log_printf(INFO, "publishing config version %llu", (unsigned long long)cfg->version_);
+  int i;
+  for(i = 0; i < opt->threads_; ++i)
+    worker_send(&workers[i], WORKER_RELOAD);
+}
+
+int main_loop(options_t* opt, listeners_t* listeners, config_store_t* configs, const int* cpus)
 {
   log_printf(INFO, "entering main loop");
 
@@ -53,59 +77,181 @@ int main_loop(options_t* opt, listeners_t* listeners)
   if(sig_fd < 0)
     return -1;
 
-  clients_t clients;
-  int return_value = clients_init(&clients, opt->buffer_size_);
+  int done_fds[2];
+  if(pipe(done_fds)) {
+    log_printf(ERROR, "Error on pipe(): %s", strerror(errno));
+    signal_stop();
+    return -1;
+  }
 
+  reload_t reload;
+  if(reload_init(&reload, opt)) {
+    close(done_fds[0]);
+    close(done_fds[1]);
+    signal_stop();
+    return -1;
+  }
+
+  worker_t* workers = calloc(opt->threads_, sizeof(worker_t));
+  if(!workers) {
+    log_printf(ERROR, "memory error on worker allocation");
+    reload_clear(&reload);
+    close(done_fds[0]);
+    close(done_fds[1]);
+    signal_stop();
+    return -2;
+  }
+
+  int return_value = 0;
+  int i;
+  for(i = 0; i < opt->threads_ && !return_value; ++i) {
+    workers[i].peers_ = workers;
+    workers[i].peers_cnt_ = opt->threads_;
+    return_value = worker_start(&workers[i], i, cpus ? cpus[i] : -1, opt, &listeners[i], configs, done_fds[1]);
+  }
+  if(!return_value)
+    log_printf(NOTICE, "started %d worker thread%s", opt->threads_, opt->threads_ > 1 ? "s" : "");
+
+  config_t* cfg = config_acquire(configs);
+  if(!return_value && cfg && cfg->cached_) {
+    log_printf(NOTICE, "revalidating cached addresses in the background");
+    reload_start(&reload);
+  }
+
+  // all times are in milliseconds, a deadline of 0 is not set
+  u_int64_t now = main_now();
+  u_int64_t last_rebalance = now;
+  u_int64_t next_rebalance = (opt->rebalance_ && opt->threads_ > 1) ? now + opt->rebalance_ : 0;
+  u_int64_t next_refresh = opt->resolv_refresh_ ? config_next_refresh(cfg) * 1000 : 0;
+  u_int64_t next_revalidate = 0, revalidate_delay = 0;
+  int retired = 0;
   while(!return_value) {
-    fd_set readfds, writefds;
+    fd_set readfds;
     FD_ZERO(&readfds);
-    FD_ZERO(&writefds);
     FD_SET(sig_fd, &readfds);
-    int nfds = sig_fd;
-    listeners_read_fds(listeners, &readfds, &nfds);
-    clients_read_fds(&clients, &readfds, &nfds);
-    clients_write_fds(&clients, &writefds, &nfds);
-    int ret = select(nfds + 1, &readfds, &writefds, NULL, NULL);
+    FD_SET(done_fds[0], &readfds);
+    FD_SET(reload.fds_[0], &readfds);
+    int nfds = (sig_fd > done_fds[0] ? sig_fd : done_fds[0]);
+    nfds = (nfds > reload.fds_[0] ? nfds : reload.fds_[0]) + 1;
+    u_int64_t deadline = next_rebalance;
+    if(retired && (!deadline || deadline > now + CONFIG_RECLAIM_INTERVAL))
+      deadline = now + CONFIG_RECLAIM_INTERVAL;
+    if(next_refresh && !reload.running_ && (!deadline || deadline > next_refresh))
+      deadline = next_refresh;
+    if(next_revalidate && !reload.running_ && (!deadline || deadline > next_revalidate))
+      deadline = next_revalidate;
+    struct timeval tv, *timeout = NULL;
+    if(deadline) {
+      u_int64_t wait = deadline > now ? deadline - now : 0;
+      tv.tv_sec = wait / 1000;
+      tv.tv_usec = (wait % 1000) * 1000;
+      timeout = &tv;
+    }
+    int ret = select(nfds, &readfds, NULL, NULL, timeout);
     if(ret == -1 && errno != EINTR) {
       log_printf(ERROR, "select returned with error: %s", strerror(errno));
       return_value = -1;
       break;
     }
-    if(!ret || ret == -1)
+    now = main_now();
+    if(retired)
+      retired = config_reclaim(configs, worker_epoch(workers, opt->threads_));
+    if(next_rebalance && now >= next_rebalance) {
+      worker_rebalance(workers, opt->threads_, (now - last_rebalance) * 1000000);
+      last_rebalance = now;
+      next_rebalance = now + opt->rebalance_;
+    }
+    if(next_refresh && !reload.running_ && now >= next_refresh) {
+      log_printf(DEBUG, "resolving expired addresses again");
+      reload_refresh(&reload, config_acquire(configs));
+      next_refresh = 0;
+    }
+    if(next_revalidate && !reload.running_ && now >= next_revalidate) {
+      log_printf(NOTICE, "revalidating cached addresses again");
+      reload_start(&reload);
+      next_revalidate = 0;
+    }
+    if(ret <= 0)
       continue;
 
+    if(FD_ISSET(done_fds[0], &readfds)) {
+      int id = -1;
+      if(read(done_fds[0], &id, sizeof(id)) == sizeof(id) && id >= 0 && id < opt->threads_) {
+        log_printf(ERROR, "worker %d stopped unexpectedly", id);
+        return_value = workers[id].ret_ ? workers[id].ret_ : -1;
+      }
+      else
+        return_value = -1;
+      break;
+    }
+
+    if(FD_ISSET(reload.fds_[0], &readfds)) {
+      int refresh = reload.base_ != NULL;
+      config_t* cfg = reload_finish(&reload);
+      if(cfg) {
+        publish_config(opt, configs, cfg, workers);
+        retired = config_reclaim(configs, worker_epoch(workers, opt->threads_));
+      }
+      if(!refresh && config_acquire(configs)->cached_) {
+        revalidate_delay = revalidate_delay ? revalidate_delay * 2 : RESOLVER_NEGATIVE_TTL * 1000;
+        if(revalidate_delay > MAIN_REVALIDATE_MAX)
+          revalidate_delay = MAIN_REVALIDATE_MAX;
+        next_revalidate = now + revalidate_delay;
+      }
+      else if(!refresh)
+        next_revalidate = revalidate_delay = 0;
+      if(opt->resolv_refresh_)
+        next_refresh = config_next_refresh(config_acquire(configs)) * 1000;
+      if(reload.pending_ && !reload.running_)
+        reload_start(&reload);
+    }
+
     if(FD_ISSET(sig_fd, &readfds)) {
       return_value = signal_handle();
       if(return_value == SIGINT || return_value == SIGQUIT || return_value == SIGTERM) break;
       if(return_value == SIGHUP) {
         if(opt->config_file_) {
           log_printf(NOTICE, "re-reading config file: %s", opt->config_file_);
-          read_configfile(opt->config_file_, listeners);
+          reload_start(&reload);
         } else
           log_printf(NOTICE, "ignoring SIGHUP: no config file specified");
-
-        return_value = 0;
       } else if(return_value == SIGUSR1) {
-        listeners_print(listeners);
+        reload_print(&reload, configs->version_);
+        for(i = 0; i < opt->threads_; ++i)
+          worker_send(&workers[i], WORKER_PRINT_LISTENERS);
       } else if(return_value == SIGUSR2) {
-        clients_print(&clients);
+        for(i = 0; i < opt->threads_; ++i)
+          worker_send(&workers[i], WORKER_PRINT_CLIENTS);
       }
+      return_value = 0;
     }
-
-    return_value = listeners_handle_accept(listeners, &clients, &readfds);
-    if(return_value) break;
-
-    return_value = clients_write(&clients, &writefds);
-    if(return_value) break;
-
-    return_value = clients_read(&clients, &readfds);
   }
 
-  clients_clear(&clients);
+  for(i = 0; i < opt->threads_; ++i)
+    worker_send(&workers[i], WORKER_STOP);
+  for(i = 0; i < opt->threads_; ++i)
+    worker_join(&workers[i]);
+  for(i = 0; i < opt->threads_; ++i)
+    worker_clear(&workers[i]);
+  free(workers);
+
+  reload_clear(&reload);
+  close(done_fds[0]);
+  close(done_fds[1]);
   signal_stop();
   return return_value;
 }
 
+static void clear_listeners(listeners_t* listeners, int cnt, config_store_t* configs, health_board_t* board)
+{
+  int i;
+  for(i = 0; i < cnt; ++i)
+    listeners_clear(&listeners[i]);
+  free(listeners);
+  config_store_clear(configs);
+  health_board_clear(board);
+}
+
 int main(int argc, char* argv[])
 {
   log_init();
@@ -154,29 +300,61 @@ int main(int argc, char* argv[])
   log_printf(NOTICE, "just started...");
   options_parse_post(&opt);
 
-  listeners_t listeners;
-  ret = listeners_init(&listeners);
-  if(ret) {
+  // the results of the health checks are shared by all workers
+  health_board_t board;
+  if(health_board_init(&board)) {
+    options_clear(&opt);
+    log_close();
+    exit(-1);
+  }
+
+  config_store_t configs;
+  config_store_init(&configs);
+  config_t* cfg = reload_load(&opt, 1);
+  listeners_t* listeners = cfg ? calloc(opt.threads_, sizeof(listeners_t)) : NULL;
+  if(!listeners) {
+    health_board_clear(&board);
+    config_delete(cfg);
     options_clear(&opt);
     log_close();
     exit(-1);
   }
+  config_publish(&configs, cfg);
+
+  int* cpus = NULL;
+  int steer_cnt = opt.threads_;
+  if(opt.cpu_affinity_) {
+    cpus = malloc(opt.threads_ * sizeof(int));
+    ret = cpus ? worker_cpus(cpus, opt.threads_) : -1;
+    if(ret < 0) {
+      if(cpus) free(cpus);
+      cpus = NULL;
+    }
+    else if(ret < opt.threads_) {
+      log_printf(WARNING, "more worker threads than CPUs, not steering connections to workers");
+      steer_cnt = 0;
+    }
+  }
 
-  if(opt.local_port_) {
-    ret = listeners_add(&listeners, opt.local_addr_, opt.lresolv_type_, opt.local_port_, opt.remote_addr_, opt.rresolv_type_, opt.remote_port_, opt.source_addr_);
-    if(!ret) ret = listeners_update(&listeners);
+  // every worker thread gets its own copy of the listening sockets, these
+  // have to be opened before privileges are dropped
+  int i;
+  for(i = 0; i < opt.threads_; ++i) {
+    ret = listeners_init(&listeners[i], opt.listen_backlog_, opt.threads_ > 1, &board);
     if(ret) {
-      listeners_clear(&listeners);
+      clear_listeners(listeners, i, &configs, &board);
+      if(cpus) free(cpus);
       options_clear(&opt);
       log_close();
       exit(-1);
     }
-  } else {
-    ret = read_configfile(opt.config_file_, &listeners);
-    if(ret || !slist_length(&listeners)) {
-      if(!ret)
-        log_printf(ERROR, "no listeners defined in config file %s", opt.config_file_);
-      listeners_clear(&listeners);
+    if(cpus)
+      listeners_set_cpus(&listeners[i], cpus[i], cpus, steer_cnt);
+
+    ret = listeners_apply(&listeners[i], cfg);
+    if(ret || !slist_length(&(listeners[i].list_))) {
+      clear_listeners(listeners, i + 1, &configs, &board);
+      if(cpus) free(cpus);
       options_clear(&opt);
       log_close();
       exit(-1);
@@ -186,7 +364,8 @@ int main(int argc, char* argv[])
   priv_info_t priv;
   if(opt.username_)
     if(priv_init(&priv, opt.username_, opt.groupname_)) {
-      listeners_clear(&listeners);
+      clear_listeners(listeners, opt.threads_, &configs, &board);
+      if(cpus) free(cpus);
       options_clear(&opt);
       log_close();
       exit(-1);
@@ -202,14 +381,16 @@ int main(int argc, char* argv[])
 
   if(opt.chroot_dir_)
     if(do_chroot(opt.chroot_dir_)) {
-      listeners_clear(&listeners);
+      clear_listeners(listeners, opt.threads_, &configs, &board);
+      if(cpus) free(cpus);
       options_clear(&opt);
       log_close();
       exit(-1);
     }
   if(opt.username_)
     if(priv_drop(&priv)) {
-      listeners_clear(&listeners);
+      clear_listeners(listeners, opt.threads_, &configs, &board);
+      if(cpus) free(cpus);
       options_clear(&opt);
       log_close();
       exit(-1);
@@ -227,9 +408,10 @@ int main(int argc, char* argv[])
     fclose(pid_file);
   }
 
-  ret = main_loop(&opt, &listeners);
+  ret = main_loop(&opt, listeners, &configs, cpus);
 
-  listeners_clear(&listeners);
+  clear_listeners(listeners, opt.threads_, &configs, &board);
+  if(cpus) free(cpus);
   options_clear(&opt);
 
   if(!ret)
@@ -0,0 +1,193 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "datatypes.h"
+
+#include <string.h>
+#include <limits.h>
+
+#include "timer_wheel.h"
+
+// hierarchical timing wheel with a resolution of one tick (the callers use
+// milliseconds). Level l holds the timers expiring within the next
+// TIMER_WHEEL_SIZE^(l+1) ticks, the slot of a timer is taken from the bits
+// of its expiry time which belong to its level. Whenever the lower bits of
+// the current time wrap around, the slot of the next level matching the
+// current time is cascaded into the lower levels. Timers further away than
+// the top level are parked in the top level and placed again on cascade.
+// Arming and cancelling a timer is O(1).
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_SPAN(level) (1ULL << (TIMER_WHEEL_BITS * (level)))
+#define TIMER_WHEEL_NEVER ((u_int64_t)-1)
+
+void timer_wheel_init(timer_wheel_t* w, u_int64_t now)
+{
+  memset(w, 0, sizeof(timer_wheel_t));
+  w->now_ = now;
+}
+
+void timer_wheel_entry_init(timer_wheel_entry_t* e, void* data)
+{
+  e->expires_ = 0;
+  e->next_ = NULL;
+  e->pprev_ = NULL;
+  e->level_ = 0;
+  e->slot_ = 0;
+  e->data_ = data;
+}
+
+static void timer_wheel_link(timer_wheel_entry_t** head, timer_wheel_entry_t* e)
+{
+  e->next_ = *head;
+  if(e->next_)
+    e->next_->pprev_ = &(e->next_);
+  *head = e;
+  e->pprev_ = head;
+}
+
+static void timer_wheel_insert(timer_wheel_t* w, timer_wheel_entry_t* e)
+{
+  if(e->expires_ <= w->now_) {
+    e->level_ = TIMER_WHEEL_LEVELS;
+    timer_wheel_link(&(w->expired_), e);
+    return;
+  }
+
+  u_int64_t expires = e->expires_;
+  if(expires - w->now_ >= TIMER_WHEEL_SPAN(TIMER_WHEEL_LEVELS))
+    expires = w->now_ + TIMER_WHEEL_SPAN(TIMER_WHEEL_LEVELS) - 1;
+  int level = 0;
+  while(level < TIMER_WHEEL_LEVELS - 1 && expires - w->now_ >= TIMER_WHEEL_SPAN(level + 1))
+    level++;
+
+  e->level_ = level;
+  e->slot_ = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  w->used_[level] |= 1ULL << e->slot_;
+  timer_wheel_link(&(w->slots_[level][e->slot_]), e);
+}
+
+void timer_wheel_arm(timer_wheel_t* w, timer_wheel_entry_t* e, u_int64_t expires)
+{
+  if(!w || !e)
+    return;
+
+  timer_wheel_cancel(w, e);
+  e->expires_ = expires;
+  timer_wheel_insert(w, e);
+}
+
+void timer_wheel_cancel(timer_wheel_t* w, timer_wheel_entry_t* e)
+{
+  if(!w || !e || !e->pprev_)
+    return;
+
+  *(e->pprev_) = e->next_;
+  if(e->next_)
+    e->next_->pprev_ = e->pprev_;
+  if(e->level_ < TIMER_WHEEL_LEVELS && !w->slots_[e->level_][e->slot_])
+    w->used_[e->level_] &= ~(1ULL << e->slot_);
+  e->next_ = NULL;
+  e->pprev_ = NULL;
+}
+
+// returns the next tick at which a slot has to be cascaded or expires,
+// this is the first level holding any timers which decides this
+static u_int64_t timer_wheel_next(timer_wheel_t* w)
+{
+  if(w->expired_)
+    return w->now_;
+
+  int level;
+  for(level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+    if(!w->used_[level])
+      continue;
+
+    int shift = TIMER_WHEEL_BITS * level;
+    int idx = (w->now_ >> shift) & TIMER_WHEEL_MASK;
+    u_int64_t round = w->now_ >> (shift + TIMER_WHEEL_BITS) << (shift + TIMER_WHEEL_BITS);
+    u_int64_t later = idx < TIMER_WHEEL_MASK ? w->used_[level] & (~0ULL << (idx + 1)) : 0;
+    if(later)
+      return round + ((u_int64_t)__builtin_ctzll(later) << shift);
+    return round + (TIMER_WHEEL_SPAN(1) << shift);
+  }
+  return TIMER_WHEEL_NEVER;
+}
+
+static void timer_wheel_cascade(timer_wheel_t* w, int level, int slot)
+{
+  timer_wheel_entry_t* e = w->slots_[level][slot];
+  w->slots_[level][slot] = NULL;
+  w->used_[level] &= ~(1ULL << slot);
+  while(e) {
+    timer_wheel_entry_t* next = e->next_;
+    timer_wheel_insert(w, e);
+    e = next;
+  }
+}
+
+static void timer_wheel_tick(timer_wheel_t* w)
+{
+  int level;
+  for(level = 1; level < TIMER_WHEEL_LEVELS && !(w->now_ & (TIMER_WHEEL_SPAN(level) - 1)); ++level)
+    timer_wheel_cascade(w, level, (w->now_ >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+  timer_wheel_cascade(w, 0, w->now_ & TIMER_WHEEL_MASK);
+}
+
+// returns the time until the wheel has to be advanced again or -1 if no
+// timer is armed
+int timer_wheel_timeout(timer_wheel_t* w, u_int64_t now)
+{
+  u_int64_t next = timer_wheel_next(w);
+  if(next == TIMER_WHEEL_NEVER)
+    return -1;
+  if(next <= now)
+    return 0;
+  return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
+
+// advances the wheel up to now and returns one expired timer after the
+// other, the returned timer is disarmed and may be armed again right away
+timer_wheel_entry_t* timer_wheel_expire(timer_wheel_t* w, u_int64_t now)
+{
+  if(!w)
+    return NULL;
+
+  while(!w->expired_ && w->now_ < now) {
+    u_int64_t next = timer_wheel_next(w);
+    if(next > now) {
+      w->now_ = now;
+      break;
+    }
+    w->now_ = next;
+    timer_wheel_tick(w);
+  }
+
+  timer_wheel_entry_t* e = w->expired_;
+  timer_wheel_cancel(w, e);
+  return e;
+}
@@ -0,0 +1,61 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_timer_wheel_h_INCLUDED
+#define TCPPROXY_timer_wheel_h_INCLUDED
+
+#include <sys/types.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer_wheel_entry_struct {
+  u_int64_t expires_;
+  struct timer_wheel_entry_struct* next_;
+  struct timer_wheel_entry_struct** pprev_;
+  int level_;
+  int slot_;
+  void* data_;
+};
+typedef struct timer_wheel_entry_struct timer_wheel_entry_t;
+
+typedef struct {
+  u_int64_t now_;
+  u_int64_t used_[TIMER_WHEEL_LEVELS];
+  timer_wheel_entry_t* slots_[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+  timer_wheel_entry_t* expired_;
+} timer_wheel_t;
+
+void timer_wheel_init(timer_wheel_t* w, u_int64_t now);
+void timer_wheel_entry_init(timer_wheel_entry_t* e, void* data);
+void timer_wheel_arm(timer_wheel_t* w, timer_wheel_entry_t* e, u_int64_t expires);
+void timer_wheel_cancel(timer_wheel_t* w, timer_wheel_entry_t* e);
+int timer_wheel_timeout(timer_wheel_t* w, u_int64_t now);
+timer_wheel_entry_t* timer_wheel_expire(timer_wheel_t* w, u_int64_t now);
+
+#endif
@@ -0,0 +1,457 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "datatypes.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "worker.h"
+#include "sig_handler.h"
+#include "log.h"
+
+// every worker runs its own event loop with its own poller, clients and
+// copy of the listening sockets. The workers only share the options, the
+// published config and the log, commands from the main thread arrive
+// through the control pipe.
+
+static u_int64_t worker_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the reuseport program selects the sockets in the order they joined their
+// group, so new listeners are opened worker by worker like on startup.
+// applied_ is the config version the listeners of a worker are at.
+static void worker_wait_turn(worker_t* w, u_int64_t version)
+{
+  if(!w->id_ || w->listeners_->cpus_cnt_ <= 1)
+    return;
+
+  worker_t* prev = &(w->peers_[w->id_ - 1]);
+  u_int64_t start = worker_now();
+  while(atomic_load(&prev->running_) && atomic_load_explicit(&prev->applied_, memory_order_acquire) < version) {
+    if(atomic_load(&w->stopping_))
+      return;
+    if(worker_now() - start > (u_int64_t)WORKER_TURN_TIMEOUT * 1000000) {
+      log_printf(WARNING, "worker %d: worker %d did not open its listeners in time, new connections might be steered to the wrong worker", w->id_, prev->id_);
+      return;
+    }
+    struct timespec ts = { 0, 1000000 };
+    nanosleep(&ts, NULL);
+  }
+}
+
+// switches the listeners over to the most recently published config and
+// announces the new epoch, the previous config must not be used afterwards
+static void worker_reload(worker_t* w)
+{
+  config_t* cfg = config_acquire(w->configs_);
+  if(!cfg || cfg->version_ == atomic_load_explicit(&w->epoch_, memory_order_relaxed))
+    return;
+
+  u_int64_t start = worker_now();
+  worker_wait_turn(w, cfg->version_);
+  if(listeners_apply(w->listeners_, cfg))
+    log_printf(WARNING, "worker %d: config version %llu could not be applied completely", w->id_, (unsigned long long)cfg->version_);
+  atomic_store_explicit(&w->applied_, cfg->version_, memory_order_release);
+  listeners_register(w->listeners_, &w->poller_);
+  if(w->id_ == WORKER_CHECKS)
+    listeners_watch(w->listeners_, &w->health_);
+  listeners_sync(w->listeners_);
+  clients_retarget(&w->clients_);
+  atomic_store_explicit(&w->epoch_, cfg->version_, memory_order_release);
+  log_printf(INFO, "worker %d: switched to config version %llu in %llu us", w->id_, (unsigned long long)cfg->version_, (unsigned long long)((worker_now() - start) / 1000));
+}
+
+// with io_uring connections are handed off once their requests in flight
+// are done, the worker they go to is told after the fact
+static void worker_flush_moved(worker_t* w)
+{
+  int cnt = clients_moved(&w->clients_);
+  if(!cnt || w->moving_to_ < 0)
+    return;
+
+  log_printf(DEBUG, "worker %d: handing %d connections to worker %d", w->id_, cnt, w->moving_to_);
+  worker_send(&(w->peers_[w->moving_to_]), WORKER_ADOPT);
+}
+
+static int worker_handle_ctrl(worker_t* w)
+{
+  char cmds[32];
+  int ret = read(w->ctrl_fds_[0], cmds, sizeof(cmds));
+  if(ret < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+  int i, stop = 0;
+  for(i = 0; i < ret; ++i) {
+    switch(cmds[i]) {
+    case WORKER_STOP: stop = 1; break;
+    case WORKER_RELOAD: worker_reload(w); break;
+    case WORKER_PRINT_LISTENERS: {
+      log_printf(NOTICE, "worker %d:", w->id_);
+      listeners_print(w->listeners_);
+      break;
+    }
+    case WORKER_PRINT_CLIENTS: {
+      log_printf(NOTICE, "worker %d:", w->id_);
+      clients_print(&w->clients_);
+      break;
+    }
+    case WORKER_MIGRATE: {
+      int to = atomic_load(&w->migrate_to_);
+      if(to < 0 || to >= w->peers_cnt_ || to == w->id_)
+        break;
+      worker_t* dest = &(w->peers_[to]);
+      // connections handed to a worker which is stopping would be closed
+      if(atomic_load(&w->stopping_) || atomic_load(&dest->stopping_))
+        break;
+      worker_flush_moved(w);
+      w->moving_to_ = to;
+      int cnt = clients_handoff(&w->clients_, atomic_load(&w->migrate_bytes_), WORKER_REBALANCE_MAX, &dest->inbox_);
+      if(cnt) {
+        log_printf(DEBUG, "worker %d: handing %d connections to worker %d", w->id_, cnt, to);
+        worker_send(dest, WORKER_ADOPT);
+      }
+      break;
+    }
+    case WORKER_ADOPT: {
+      int cnt = clients_adopt(&w->clients_, &w->inbox_, listeners_target, w->listeners_);
+      log_printf(DEBUG, "worker %d: took over %d connections", w->id_, cnt);
+      break;
+    }
+    default: break;
+    }
+  }
+  return stop;
+}
+
+// pins the calling thread to the CPU of the worker and returns the NUMA
+// node of this CPU or -1 if this is not known
+static int worker_pin(worker_t* w)
+{
+  if(w->cpu_ < 0)
+    return -1;
+
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(w->cpu_, &set);
+  int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if(ret) {
+    log_printf(WARNING, "unable to pin worker %d to CPU %d: %s", w->id_, w->cpu_, strerror(ret));
+    return -1;
+  }
+  log_printf(INFO, "worker %d pinned to CPU %d", w->id_, w->cpu_);
+
+#ifdef SYS_getcpu
+  unsigned int cpu, node;
+  if(!syscall(SYS_getcpu, &cpu, &node, NULL))
+    return node;
+#endif
+#endif
+  return -1;
+}
+
+static int worker_register_buffer(void* arg, u_int32_t idx, void* addr, size_t len)
+{
+  return poller_register_buffer((poller_t*)arg, idx, addr, len);
+}
+
+static int worker_loop(worker_t* w)
+{
+  options_t* opt = w->opt_;
+  if(poller_init(&w->poller_, opt->io_engine_))
+    return -1;
+
+  buffer_pool_init(&w->pool_, opt->hugepages_, worker_pin(w));
+  if(poller_completions(&w->poller_))
+    buffer_pool_set_register(&w->pool_, worker_register_buffer, &w->poller_);
+  w->moving_to_ = -1;
+
+  u_int32_t max_connections = opt->max_connections_;
+  if(max_connections && opt->threads_ > 1)
+    max_connections = (max_connections + opt->threads_ - 1) / opt->threads_;
+  int return_value = clients_init(&w->clients_, opt->buffer_size_, opt->splice_, opt->lazy_buffers_, opt->cut_through_, max_connections, &w->pool_, &w->poller_);
+  if(!return_value)
+    return_value = poller_add(&w->poller_, w->ctrl_fds_[0], POLLER_READ, POLLER_CONTROL, NULL);
+  if(!return_value)
+    return_value = listeners_register(w->listeners_, &w->poller_);
+  health_init(&w->health_, w->listeners_->board_, &w->poller_);
+  if(w->id_ == WORKER_CHECKS)
+    listeners_watch(w->listeners_, &w->health_);
+
+  // the time spent between two calls to poller_wait and the amount of data
+  // sent are published for the rebalancer
+  u_int64_t busy = 0, woken = 0;
+  int stop = 0;
+  while(!return_value && !stop) {
+    if(opt->rebalance_) {
+      if(woken)
+        busy += worker_now() - woken;
+      atomic_store_explicit(&w->stat_busy_, busy, memory_order_relaxed);
+      atomic_store_explicit(&w->stat_bytes_, w->clients_.bytes_, memory_order_relaxed);
+    }
+    int timeout = clients_timeout(&w->clients_);
+    int check_timeout = health_timeout(&w->health_);
+    if(check_timeout >= 0 && (timeout < 0 || check_timeout < timeout))
+      timeout = check_timeout;
+    int ret = poller_wait(&w->poller_, timeout);
+    if(opt->rebalance_)
+      woken = worker_now();
+    if(ret == -1 && errno != EINTR) {
+      log_printf(ERROR, "poller_wait returned with error: %s", strerror(errno));
+      return_value = -1;
+      break;
+    }
+    clients_expire(&w->clients_);
+    health_expire(&w->health_);
+    if(health_changed(&w->health_))
+      listeners_sync(w->listeners_);
+
+    int i;
+    for(i = 0; i < ret && !return_value && !stop; ++i) {
+      poller_event_t* ev = &(w->poller_.ready_[i]);
+      switch(ev->type_) {
+      case POLLER_CONTROL: {
+        stop = worker_handle_ctrl(w);
+        if(stop < 0)
+          return_value = -1;
+        break;
+      }
+      case POLLER_LISTENER: {
+        if(ev->events_ & POLLER_ACCEPT)
+          return_value = listeners_handle_accepted(ev->data_, &w->clients_, ev->res_);
+        else
+          return_value = listeners_handle_accept(ev->data_, &w->clients_, opt->accept_budget_);
+        break;
+      }
+      case POLLER_CLIENT: return_value = clients_handle(&w->clients_, ev->data_, ev->fd_, ev->events_, ev->res_); break;
+      case POLLER_CHECK: return_value = health_handle(&w->health_, ev->data_, ev->events_); break;
+      default: break;
+      }
+    }
+    worker_flush_moved(w);
+  }
+
+  health_clear(&w->health_);
+  clients_clear(&w->clients_);
+  buffer_pool_clear(&w->pool_);
+  listeners_unregister(w->listeners_);
+  poller_clear(&w->poller_);
+  return return_value;
+}
+
+static void* worker_main(void* arg)
+{
+  worker_t* w = (worker_t*)arg;
+  log_printf(DEBUG, "worker %d started", w->id_);
+  w->ret_ = worker_loop(w);
+  // the next worker must not wait for this one any more
+  atomic_store(&w->applied_, (u_int64_t)-1);
+  if(write(w->done_fd_, &(w->id_), sizeof(w->id_)) != sizeof(w->id_))
+    log_printf(ERROR, "worker %d unable to report its termination: %s", w->id_, strerror(errno));
+  return NULL;
+}
+
+// assigns the CPUs the process may run on round-robin to the workers and
+// returns the number of distinct CPUs used
+int worker_cpus(int* cpus, int cnt)
+{
+#ifdef __linux__
+  cpu_set_t set;
+  if(sched_getaffinity(0, sizeof(set), &set)) {
+    log_printf(ERROR, "Error on sched_getaffinity(): %s", strerror(errno));
+    return -1;
+  }
+  int allowed = CPU_COUNT(&set);
+  if(allowed <= 0)
+    return -1;
+
+  int i, cpu = -1;
+  for(i = 0; i < cnt; ++i) {
+    do {
+      cpu = (cpu + 1) % CPU_SETSIZE;
+    } while(!CPU_ISSET(cpu, &set));
+    cpus[i] = cpu;
+  }
+  return cnt < allowed ? cnt : allowed;
+#else
+  log_printf(WARNING, "CPU affinity is not supported on this platform");
+  return -1;
+#endif
+}
+
+int worker_start(worker_t* w, int id, int cpu, options_t* opt, listeners_t* listeners, config_store_t* configs, int done_fd)
+{
+  if(!w)
+    return -1;
+
+  w->id_ = id;
+  w->cpu_ = cpu;
+  mpsc_init(&w->inbox_);
+  atomic_init(&w->stat_bytes_, 0);
+  atomic_init(&w->stat_busy_, 0);
+  atomic_init(&w->migrate_to_, -1);
+  atomic_init(&w->migrate_bytes_, 0);
+  w->prev_bytes_ = 0;
+  w->prev_busy_ = 0;
+  atomic_init(&w->running_, 0);
+  atomic_init(&w->stopping_, 0);
+  w->joined_ = 0;
+  w->done_fd_ = done_fd;
+  w->ret_ = 0;
+  w->opt_ = opt;
+  w->listeners_ = listeners;
+  w->configs_ = configs;
+  config_t* cfg = config_acquire(configs);
+  atomic_init(&w->epoch_, cfg ? cfg->version_ : 0);
+  atomic_init(&w->applied_, cfg ? cfg->version_ : 0);
+  if(pipe(w->ctrl_fds_)) {
+    log_printf(ERROR, "Error on pipe(): %s", strerror(errno));
+    return -1;
+  }
+  fcntl(w->ctrl_fds_[0], F_SETFL, O_NONBLOCK);
+  fcntl(w->ctrl_fds_[0], F_SETFD, FD_CLOEXEC);
+  fcntl(w->ctrl_fds_[1], F_SETFD, FD_CLOEXEC);
+
+  // signals are handled by the main thread only
+  sigset_t oldset;
+  signal_block(&oldset);
+  int ret = pthread_create(&w->thread_, NULL, worker_main, w);
+  pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+  if(ret) {
+    log_printf(ERROR, "unable to start worker %d: %s", id, strerror(ret));
+    close(w->ctrl_fds_[0]);
+    close(w->ctrl_fds_[1]);
+    return -1;
+  }
+  atomic_store(&w->running_, 1);
+  return 0;
+}
+
+// the workers send commands to each other as well, so this may be called
+// from any thread
+int worker_send(worker_t* w, worker_cmd_t cmd)
+{
+  if(!w || !atomic_load(&w->running_))
+    return -1;
+
+  if(cmd == WORKER_STOP)
+    atomic_store(&w->stopping_, 1);
+
+  char c = (char)cmd;
+  if(write(w->ctrl_fds_[1], &c, 1) != 1) {
+    log_printf(ERROR, "unable to send command to worker %d: %s", w->id_, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// the control pipe stays open until worker_clear as other workers which
+// have not been joined yet might still send commands to it
+int worker_join(worker_t* w)
+{
+  if(!w || !atomic_load(&w->running_))
+    return -1;
+
+  pthread_join(w->thread_, NULL);
+  atomic_store(&w->running_, 0);
+  w->joined_ = 1;
+  return w->ret_;
+}
+
+// must only be called once all workers have been joined
+void worker_clear(worker_t* w)
+{
+  if(!w)
+    return;
+
+  if(w->joined_) {
+    close(w->ctrl_fds_[0]);
+    close(w->ctrl_fds_[1]);
+    w->joined_ = 0;
+  }
+
+  clients_handoff_drop(&w->inbox_);
+}
+
+// returns the oldest config version still in use by any worker
+u_int64_t worker_epoch(worker_t* workers, int cnt)
+{
+  u_int64_t epoch = (u_int64_t)-1;
+  int i;
+  for(i = 0; i < cnt; ++i) {
+    u_int64_t e = atomic_load_explicit(&workers[i].epoch_, memory_order_acquire);
+    if(atomic_load(&workers[i].running_) && e < epoch)
+      epoch = e;
+  }
+  return epoch;
+}
+
+// compares the load of the workers during the last interval and asks the
+// busiest worker to hand off connections to the least busy one if their
+// share of busy time differs by more than WORKER_REBALANCE_THRESHOLD percent
+void worker_rebalance(worker_t* workers, int cnt, u_int64_t interval_ns)
+{
+  if(!workers || cnt < 2 || !interval_ns)
+    return;
+
+  int i, max = -1, min = -1;
+  u_int64_t load[cnt], bytes[cnt];
+  for(i = 0; i < cnt; ++i) {
+    u_int64_t b = atomic_load_explicit(&workers[i].stat_bytes_, memory_order_relaxed);
+    u_int64_t t = atomic_load_explicit(&workers[i].stat_busy_, memory_order_relaxed);
+    bytes[i] = b - workers[i].prev_bytes_;
+    load[i] = (t - workers[i].prev_busy_) * 100 / interval_ns;
+    workers[i].prev_bytes_ = b;
+    workers[i].prev_busy_ = t;
+    if(!atomic_load(&workers[i].running_))
+      continue;
+    if(max < 0 || load[i] > load[max])
+      max = i;
+    if(min < 0 || load[i] < load[min])
+      min = i;
+  }
+  if(max < 0 || max == min || load[max] < load[min] + WORKER_REBALANCE_THRESHOLD || bytes[max] <= bytes[min])
+    return;
+
+  log_printf(DEBUG, "rebalancing: worker %d is %llu%% busy, worker %d is %llu%% busy", max, (unsigned long long)load[max], min, (unsigned long long)load[min]);
+  atomic_store(&workers[max].migrate_to_, min);
+  atomic_store(&workers[max].migrate_bytes_, (bytes[max] - bytes[min]) / 2);
+  worker_send(&workers[max], WORKER_MIGRATE);
+}
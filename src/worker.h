@@ -0,0 +1,96 @@
+/*
+ *  tcpproxy
+ *
+ *  tcpproxy is a simple tcp connection proxy which combines the
+ *  features of rinetd and 6tunnel. tcpproxy supports IPv4 and
+ *  IPv6 and also supports connections from IPv6 to IPv4
+ *  endpoints and vice versa.
+ *
+ *
+ *  Copyright (C) 2010-2015 Christian Pointner <equinox@spreadspace.org>
+ *
+ *  This file is part of tcpproxy.
+ *
+ *  tcpproxy is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  tcpproxy is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with tcpproxy. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TCPPROXY_worker_h_INCLUDED
+#define TCPPROXY_worker_h_INCLUDED
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "options.h"
+#include "poller.h"
+#include "buffer_pool.h"
+#include "listener.h"
+#include "clients.h"
+#include "health.h"
+#include "mpsc.h"
+#include "config_store.h"
+
+#define WORKER_REBALANCE_THRESHOLD 20
+#define WORKER_REBALANCE_MAX 64
+
+// the health checks of the backends are run by this worker only
+#define WORKER_CHECKS 0
+
+// how long a reload waits for the previous worker to open its listeners (ms)
+#define WORKER_TURN_TIMEOUT 1000
+
+enum worker_cmd_enum { WORKER_STOP = 'q', WORKER_RELOAD = 'r',
+                       WORKER_PRINT_LISTENERS = 'l', WORKER_PRINT_CLIENTS = 'c',
+                       WORKER_MIGRATE = 'm', WORKER_ADOPT = 'a' };
+typedef enum worker_cmd_enum worker_cmd_t;
+
+typedef struct worker_struct {
+  int id_;
+  int cpu_;
+  pthread_t thread_;
+  _Atomic int running_;
+  _Atomic int stopping_;
+  int joined_;
+  int ctrl_fds_[2];
+  int done_fd_;
+  int ret_;
+  options_t* opt_;
+  listeners_t* listeners_;
+  config_store_t* configs_;
+  _Atomic u_int64_t epoch_;
+  _Atomic u_int64_t applied_;
+  poller_t poller_;
+  buffer_pool_t pool_;
+  clients_t clients_;
+  health_t health_;
+  struct worker_struct* peers_;
+  int peers_cnt_;
+  mpsc_queue_t inbox_;
+  _Atomic u_int64_t stat_bytes_;
+  _Atomic u_int64_t stat_busy_;
+  _Atomic int migrate_to_;
+  _Atomic u_int64_t migrate_bytes_;
+  int moving_to_;
+  u_int64_t prev_bytes_;
+  u_int64_t prev_busy_;
+} worker_t;
+
+int worker_cpus(int* cpus, int cnt);
+int worker_start(worker_t* w, int id, int cpu, options_t* opt, listeners_t* listeners, config_store_t* configs, int done_fd);
+int worker_send(worker_t* w, worker_cmd_t cmd);
+int worker_join(worker_t* w);
+void worker_clear(worker_t* w);
+u_int64_t worker_epoch(worker_t* workers, int cnt);
+void worker_rebalance(worker_t* workers, int cnt, u_int64_t interval_ns);
+
+#endif